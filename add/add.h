@@ -40,9 +40,12 @@ extern char	*PkgName;
 extern char	*PkgAddCmd;
 extern char	FirstPen[];
 extern add_mode_t AddMode;
+extern int	Jobs;
+extern Boolean	Batch;
 
 int		make_hierarchy(char *, Boolean);
-void		extract_plist(const char *, Package *);
-void		apply_perms(const char *, const char *);
+int		extract_plist(const char *, Package *);
+void		apply_perms(const char *, const char **);
+int		plan_perform(char **);
 
 #endif	/* _INST_ADD_H_INCLUDE */
@@ -21,35 +21,128 @@
 #include <sys/cdefs.h>
 __FBSDID("$FreeBSD: stable/10/usr.sbin/pkg_install/add/extract.c 252363 2013-06-29 00:37:49Z obrien $");
 
-#include <ctype.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include "lib.h"
 #include "add.h"
 
 
-#define STARTSTRING "/usr/bin/tar cf -"
-#define TOOBIG(str) \
-    (((int)strlen(str) + FILENAME_MAX + where_count > maxargs) ||\
-	((int)strlen(str) + FILENAME_MAX + perm_count > maxargs))
-
-#define PUSHOUT(todir) /* push out string */ \
-    if (where_count > (int)sizeof(STARTSTRING)-1) { \
-	strcat(where_args, "|/usr/bin/tar --unlink -xpPf - -C "); \
-	strcat(where_args, todir); \
-	if (system(where_args)) { \
-	    cleanup(0); \
-	    errx(2, "%s: can not invoke %ld byte tar pipeline: %s", \
-		 __func__, (long)strlen(where_args), where_args); \
-	} \
-	strcpy(where_args, STARTSTRING); \
-	where_count = sizeof(STARTSTRING)-1; \
-    } \
+#define PERM_MAX	1024	/* files per apply_perms() call, at most */
+#define DIRFD_MAX	8	/* destination directories kept open */
+
+#define PUSHOUT(todir) /* apply permissions to what has been moved */ \
     if (perm_count) { \
+	perm_args[perm_count] = NULL; \
 	apply_perms(todir, perm_args); \
-	perm_args[0] = 0;\
 	perm_count = 0; \
     }
 
+/* The destination directories open, most recently used last */
+static struct {
+    char *path;
+    int fd;
+} DirFds[DIRFD_MAX];
+static int NDirFds;
+
+/* The playpen, where everything is moved from */
+static int SrcFd = -1;
+static char SrcDir[FILENAME_MAX];
+
+/*
+ * Return a descriptor for a destination directory, or -1.  Packages
+ * switch between a few with @cwd, so the last few used are kept open.
+ */
+static int
+extract_dirfd(const char *dir)
+{
+    char *path;
+    int i, fd;
+
+    for (i = NDirFds - 1; i >= 0; i--)
+	if (!strcmp(DirFds[i].path, dir))
+	    break;
+    if (i >= 0) {
+	path = DirFds[i].path;
+	fd = DirFds[i].fd;
+    }
+    else {
+	if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+	    warn("%s: can't open '%s'", __func__, dir);
+	    return -1;
+	}
+	if ((path = strdup(dir)) == NULL)
+	    err(2, NULL);
+	if (NDirFds == DIRFD_MAX) {
+	    close(DirFds[0].fd);
+	    free(DirFds[0].path);
+	    i = 0;
+	}
+	else
+	    i = NDirFds++;
+    }
+    memmove(&DirFds[i], &DirFds[i + 1], (NDirFds - i - 1) * sizeof(*DirFds));
+    DirFds[NDirFds - 1].path = path;
+    DirFds[NDirFds - 1].fd = fd;
+    return fd;
+}
+
+/* Close all the destination directories, in case they are about to change */
+static void
+extract_dirfd_flush(void)
+{
+    while (NDirFds > 0) {
+	NDirFds--;
+	close(DirFds[NDirFds].fd);
+	free(DirFds[NDirFds].path);
+    }
+}
+
+static void
+extract_close(void)
+{
+    extract_dirfd_flush();
+    if (SrcFd != -1) {
+	close(SrcFd);
+	SrcFd = -1;
+    }
+}
+
+/* Make the directories leading up to name, relative to dfd, as tar would */
+static int
+extract_parents(int dfd, const char *name)
+{
+    char path[FILENAME_MAX], *cp;
+
+    if (strlcpy(path, name, sizeof(path)) >= sizeof(path))
+	return FAIL;
+    for (cp = path + 1; (cp = strchr(cp, '/')) != NULL; cp++) {
+	*cp = '\0';
+	if (mkdirat(dfd, path, 0777) == FAIL && errno != EEXIST)
+	    return FAIL;
+	*cp = '/';
+    }
+    return SUCCESS;
+}
+
+/*
+ * Move name from the playpen to dir, for when it can't simply be
+ * renamed there: copy it across, or failing that, have tar do it,
+ * replacing whatever is in the way.
+ */
+static int
+extract_copy(const char *dir, const char *name)
+{
+    char from[FILENAME_MAX], to[FILENAME_MAX];
+
+    snprintf(from, sizeof(from), "%s/%s", SrcDir, name);
+    snprintf(to, sizeof(to), "%s/%s", dir, name);
+    if (move_node(from, to) == SUCCESS)
+	return SUCCESS;
+    return vsystem("/usr/bin/tar cf - -C %s %s | /usr/bin/tar --unlink -xpPf - -C %s",
+	SrcDir, name, dir) ? FAIL : SUCCESS;
+}
+
 static void
 rollback(const char *name, const char *home, PackingList start, PackingList stop)
 {
@@ -63,6 +156,8 @@ rollback(const char *name, const char *home, PackingList start, PackingList stop
 	if (q->type == PLIST_FILE) {
 	    snprintf(try, FILENAME_MAX, "%s/%s", dir, q->name);
 	    if (make_preserve_name(bup, FILENAME_MAX, name, try) && fexists(bup)) {
+		stat_cache_invalidate(try);
+		stat_cache_invalidate(bup);
 		(void)chflags(try, 0);
 		(void)unlink(try);
 		if (rename(bup, try))
@@ -82,55 +177,31 @@ rollback(const char *name, const char *home, PackingList start, PackingList stop
     }
 }
 
-#define add_char(buf, len, pos, ch) do {\
-    if ((pos) < (len)) { \
-        buf[(pos)] = (ch); \
-        buf[(pos) + 1] = '\0'; \
-    } \
-    ++(pos); \
-} while (0)
-
-static int
-add_arg(char *buf, int len, const char *str)
-{
-    int i = 0;
-
-    add_char(buf, len, i, ' ');
-    for (; *str != '\0'; ++str) {
-	if (!isalnum(*str) && *str != '/' && *str != '.' && *str != '-')
-	    add_char(buf, len, i, '\\');
-	add_char(buf, len, i, *str);
-    }
-    return (i);
-}
-
-void
+/*
+ * Move the files of pkg from the playpen into place.  Returns FAIL if
+ * that couldn't be finished, which fails just this package, as it may
+ * only be a dependency of the one we were asked to install.
+ */
+int
 extract_plist(const char *home, Package *pkg)
 {
     PackingList p = pkg->head;
     char *last_file, *prefix = NULL;
-    char *where_args, *perm_args, *last_chdir;
-    long maxargs;
-    int where_count = 0, perm_count = 0, add_count;
+    const char *perm_args[PERM_MAX + 1];
+    int perm_count = 0;
     Boolean preserve;
 
-    maxargs = sysconf(_SC_ARG_MAX) / 2;	/* Just use half the argument space */
-    where_args = alloca(maxargs);
-    if (!where_args) {
-	cleanup(0);
-	errx(2, "%s: can't get argument list space", __func__);
+    /*
+     * Everything is moved relative to descriptors for the playpen and
+     * destination directories, so nothing goes through the stat cache
+     * on the way.  It is flushed instead, before and after.
+     */
+    stat_cache_flush();
+    if (!Fake && ((SrcFd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 ||
+	getcwd(SrcDir, sizeof(SrcDir)) == NULL)) {
+	warn("%s: can't open the playpen", __func__);
+	goto bail;
     }
-    perm_args = alloca(maxargs);
-    if (!perm_args) {
-	cleanup(0);
-	errx(2, "%s: can't get argument list space", __func__);
-    }
-
-    strcpy(where_args, STARTSTRING);
-    where_count = sizeof(STARTSTRING)-1;
-    perm_args[0] = 0;
-
-    last_chdir = 0;
     preserve = find_plist_option(pkg, "preserve") ? TRUE : FALSE;
 
     /* Reset the world */
@@ -156,64 +227,56 @@ extract_plist(const char *home, Package *pkg)
 	    if (Verbose)
 		printf("extract: %s/%s\n", Directory, p->name);
 	    if (!Fake) {
-		char try[FILENAME_MAX];
+		struct stat sb;
+		const char *name;
+		int dfd;
+
+		if ((dfd = extract_dirfd(Directory)) == -1)
+		    goto bail;
+
+		/*
+		 * Absolute names go under Directory all the same, and were
+		 * unpacked into the playpen without their leading slash.
+		 */
+		for (name = p->name; *name == '/'; name++)
+		    ;
 
 		/* first try to rename it into place */
-		snprintf(try, FILENAME_MAX, "%s/%s", Directory, p->name);
-		if (fexists(try)) {
-		    (void)chflags(try, 0);	/* XXX hack - if truly immutable, rename fails */
+		if (fstatat(dfd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+		    (void)chflagsat(dfd, name, 0, AT_SYMLINK_NOFOLLOW);	/* XXX hack - if truly immutable, rename fails */
 		    if (preserve && PkgName) {
-			char pf[FILENAME_MAX];
+			char try[FILENAME_MAX], pf[FILENAME_MAX];
 
+			snprintf(try, FILENAME_MAX, "%s/%s", Directory, name);
 			if (make_preserve_name(pf, FILENAME_MAX, PkgName, try)) {
-			    if (rename(try, pf)) {
+			    if (renameat(dfd, name, AT_FDCWD, pf)) {
 				warnx(
 				"unable to back up %s to %s, aborting pkg_add",
 				try, pf);
+				extract_close();
+				stat_cache_flush();
+				shell_close();
 				rollback(PkgName, home, pkg->head, p);
-				return;
+				return FAIL;
 			    }
 			}
 		    }
 		}
-		if (rename(p->name, try) == 0) {
-		    /* try to add to list of perms to be changed and run in bulk. */
-		    if (p->name[0] == '/' || TOOBIG(p->name)) {
-			PUSHOUT(Directory);
-		    }
-		    add_count = add_arg(&perm_args[perm_count], maxargs - perm_count, p->name);
-		    if (add_count < 0 || add_count >= maxargs - perm_count) {
-			cleanup(0);
-			errx(2, "%s: oops, miscounted strings!", __func__);
-		    }
-		    perm_count += add_count;
+		/* apply perms in bulk */
+		if (perm_count == PERM_MAX) {
+		    PUSHOUT(Directory);
 		}
-		else {
-		    /* rename failed, try copying with a big tar command */
-		    if (last_chdir != Directory) {
-			if (last_chdir == NULL) {
-			    PUSHOUT(Directory);
-			} else {
-			    PUSHOUT(last_chdir);
-			}
-			last_chdir = Directory;
-		    }
-		    else if (p->name[0] == '/' || TOOBIG(p->name)) {
-			PUSHOUT(Directory);
-		    }
-		    add_count = add_arg(&where_args[where_count], maxargs - where_count, p->name);
-		    if (add_count < 0 || add_count >= maxargs - where_count) {
-			cleanup(0);
-			errx(2, "%s: oops, miscounted strings!", __func__);
-		    }
-		    where_count += add_count;
-		    add_count = add_arg(&perm_args[perm_count], maxargs - perm_count, p->name);
-		    if (add_count < 0 || add_count >= maxargs - perm_count) {
-			cleanup(0);
-			errx(2, "%s: oops, miscounted strings!", __func__);
-		    }
-		    perm_count += add_count;
+		/* otherwise make the directories it goes in, or copy it across */
+		if (renameat(SrcFd, name, dfd, name) == FAIL &&
+		    (errno != ENOENT || extract_parents(dfd, name) == FAIL ||
+		     renameat(SrcFd, name, dfd, name) == FAIL) &&
+		    (extract_parents(dfd, name) == FAIL ||
+		     extract_copy(Directory, name) == FAIL)) {
+		    warnx("%s: unable to move '%s' into '%s'", __func__,
+			name, Directory);
+		    goto bail;
 		}
+		perm_args[perm_count++] = name;
 	    }
 	    break;
 
@@ -227,8 +290,8 @@ extract_plist(const char *home, Package *pkg)
 	    PUSHOUT(Directory);
 	    if (strcmp(p->name, ".")) {
 		if (!Fake && make_hierarchy(p->name, TRUE) == FAIL) {
-		    cleanup(0);
-		    errx(2, "%s: unable to cwd to '%s'", __func__, p->name);
+		    warnx("%s: unable to cwd to '%s'", __func__, p->name);
+		    goto bail;
 		}
 		Directory = p->name;
 	    }
@@ -239,20 +302,22 @@ extract_plist(const char *home, Package *pkg)
 	case PLIST_CMD:
 	    if ((strstr(p->name, "%B") || strstr(p->name, "%F") ||
 		 strstr(p->name, "%f")) && last_file == NULL) {
-		cleanup(0);
-		errx(2, "%s: no last file specified for '%s' command",
+		warnx("%s: no last file specified for '%s' command",
 		    __func__, p->name);
+		goto bail;
 	    }
 	    if (strstr(p->name, "%D") && Directory == NULL) {
-		cleanup(0);
-		errx(2, "%s: no directory specified for '%s' command",
+		warnx("%s: no directory specified for '%s' command",
 		    __func__, p->name);
+		goto bail;
 	    }
 	    format_cmd(cmd, FILENAME_MAX, p->name, Directory, last_file);
 	    PUSHOUT(Directory);
+	    /* It may move the directories around */
+	    extract_dirfd_flush();
 	    if (Verbose)
 		printf("extract: execute '%s'\n", cmd);
-	    if (!Fake && system(cmd))
+	    if (!Fake && shell_cmd(cmd))
 		warnx("command '%s' failed", cmd);
 	    break;
 
@@ -285,4 +350,14 @@ extract_plist(const char *home, Package *pkg)
 	p = p->next;
     }
     PUSHOUT(Directory);
+    extract_close();
+    stat_cache_flush();
+    shell_close();
+    return SUCCESS;
+
+ bail:
+    extract_close();
+    stat_cache_flush();
+    shell_close();
+    return FAIL;
 }
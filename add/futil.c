@@ -22,6 +22,10 @@
 __FBSDID("$FreeBSD: stable/10/usr.sbin/pkg_install/add/futil.c 240476 2012-09-14 00:19:06Z jkim $");
 
 #include <err.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <pwd.h>
 #include "lib.h"
 #include "add.h"
 
@@ -50,13 +54,17 @@ make_hierarchy(char *dir, Boolean set_perm)
 	    }
 	}
 	else {
+	    stat_cache_invalidate(dir);
 	    if (mkdir(dir, 0777) < 0) {
 		if (cp2)
 		    *cp2 = '/';
 		return FAIL;
 	    }
-	    if (set_perm)
-		apply_perms(NULL, dir);
+	    if (set_perm) {
+		const char *files[2] = { dir, NULL };
+
+		apply_perms(NULL, files);
+	    }
 	}
 	/* Put it back */
 	if (cp2) {
@@ -67,32 +75,180 @@ make_hierarchy(char *dir, Boolean set_perm)
     return SUCCESS;
 }
 
-/* Using permission defaults, apply them as necessary */
+/* A user or group, by name or number, and the id it stands for */
+struct perm_id {
+    struct perm_id *next;
+    Boolean group;
+    long id;
+    char name[1];
+};
+
+static struct perm_id *PermIds;
+
+#define PERMS_MODE	0x1
+#define PERMS_OWNER	0x2
+
+/* What apply_perms() is to do to each file */
+struct perms {
+    void *set;			/* from setmode(), if there is a mode */
+    uid_t uid;			/* (uid_t)-1 to leave alone */
+    gid_t gid;			/* (gid_t)-1 to leave alone */
+    int failed;			/* PERMS_MODE and PERMS_OWNER */
+};
+
+/*
+ * Look up a user or group, remembering the answer since a packing list
+ * names the same few over and over.  Returns -1 if there is none.
+ * That isn't remembered, as a later package's install script may well
+ * create it.
+ */
+static long
+perm_id(const char *name, Boolean group)
+{
+    struct perm_id *pi;
+    struct passwd *pw;
+    struct group *gr;
+    const char *errstr;
+    size_t len;
+    long id;
+
+    for (pi = PermIds; pi != NULL; pi = pi->next)
+	if (pi->group == group && !strcmp(pi->name, name))
+	    return pi->id;
+
+    if (group)
+	id = (gr = getgrnam(name)) != NULL ? (long)gr->gr_gid : -1;
+    else
+	id = (pw = getpwnam(name)) != NULL ? (long)pw->pw_uid : -1;
+    /* As with chown, a number will do if it isn't a name */
+    if (id == -1) {
+	id = strtonum(name, 0, INT_MAX, &errstr);
+	if (errstr != NULL)
+	    return -1;
+    }
+
+    len = strlen(name);
+    if ((pi = malloc(sizeof(*pi) + len)) == NULL)
+	err(2, NULL);
+    memcpy(pi->name, name, len + 1);
+    pi->group = group;
+    pi->id = id;
+    pi->next = PermIds;
+    PermIds = pi;
+    return id;
+}
+
+/*
+ * Apply the permissions to name, relative to the directory dfd, and to
+ * everything below it.  Symbolic links are not followed, and as with
+ * chmod -R their own modes are left alone.
+ */
+static void
+perms_walk(int dfd, const char *name, struct perms *pp)
+{
+    struct stat sb;
+    struct dirent *dp;
+    DIR *dirp;
+    mode_t mode;
+    int fd;
+
+    if (fstatat(dfd, name, &sb, AT_SYMLINK_NOFOLLOW) == FAIL) {
+	pp->failed |= PERMS_MODE | PERMS_OWNER;
+	return;
+    }
+    if (pp->set != NULL && !S_ISLNK(sb.st_mode)) {
+	mode = getmode(pp->set, sb.st_mode);
+	if ((mode & ALLPERMS) != (sb.st_mode & ALLPERMS) &&
+	    fchmodat(dfd, name, mode, 0) == FAIL)
+	    pp->failed |= PERMS_MODE;
+    }
+    if ((pp->uid != (uid_t)-1 && pp->uid != sb.st_uid) ||
+	(pp->gid != (gid_t)-1 && pp->gid != sb.st_gid))
+	if (fchownat(dfd, name, pp->uid, pp->gid, AT_SYMLINK_NOFOLLOW) == FAIL)
+	    pp->failed |= PERMS_OWNER;
+    if (!S_ISDIR(sb.st_mode))
+	return;
+
+    if ((fd = openat(dfd, name, O_RDONLY | O_DIRECTORY)) == -1 ||
+	(dirp = fdopendir(fd)) == NULL) {
+	if (fd != -1)
+	    close(fd);
+	pp->failed |= PERMS_MODE | PERMS_OWNER;
+	return;
+    }
+    while ((dp = readdir(dirp)) != NULL)
+	if (strcmp(dp->d_name, ".") && strcmp(dp->d_name, ".."))
+	    perms_walk(dirfd(dirp), dp->d_name, pp);
+    closedir(dirp);
+}
+
+/*
+ * Using permission defaults, apply them as necessary to a NULL
+ * terminated list of files.
+ */
 void
-apply_perms(const char *dir, const char *arg)
+apply_perms(const char *dir, const char **files)
 {
-    const char *cd_to;
+    const char *cd_to, *bad;
+    struct perms perms;
+    long id;
+    int dfd, i, failed;
 
-    if (!dir || *arg == '/')	/* absolute path? */
+    if (!dir || *files[0] == '/')	/* absolute path? */
 	cd_to = "/";
     else
 	cd_to = dir;
 
-    if (Mode)
-	if (vsystem("cd %s && /bin/chmod -R %s %s", cd_to, Mode, arg))
-	    warnx("couldn't change modes of '%s' to '%s'", arg, Mode);
-    if (Owner && Group) {
-	if (vsystem("cd %s && /usr/sbin/chown -R %s:%s %s", cd_to, Owner, Group, arg))
-	    warnx("couldn't change owner/group of '%s' to '%s:%s'",
-		   arg, Owner, Group);
-	return;
-    }
+    bad = files[0];
+    memset(&perms, 0, sizeof(perms));
+    perms.uid = (uid_t)-1;
+    perms.gid = (gid_t)-1;
+    if (Mode && (perms.set = setmode(Mode)) == NULL)
+	warnx("couldn't change modes of '%s' to '%s'", files[0], Mode);
+    /* Like chown, change nothing if either name is bad */
     if (Owner) {
-	if (vsystem("cd %s && /usr/sbin/chown -R %s %s", cd_to, Owner, arg))
-	    warnx("couldn't change owner of '%s' to '%s'", arg, Owner);
+	if ((id = perm_id(Owner, FALSE)) == -1)
+	    perms.failed |= PERMS_OWNER;
+	else
+	    perms.uid = id;
+    }
+    if (Group) {
+	if ((id = perm_id(Group, TRUE)) == -1)
+	    perms.failed |= PERMS_OWNER;
+	else
+	    perms.gid = id;
+    }
+    if (perms.failed)
+	perms.uid = (uid_t)-1, perms.gid = (gid_t)-1;
+
+    if (perms.set != NULL || perms.uid != (uid_t)-1 ||
+	perms.gid != (gid_t)-1) {
+	if ((dfd = open(cd_to, O_RDONLY | O_DIRECTORY)) == -1) {
+	    warn("%s", cd_to);
+	    perms.failed |= (perms.set != NULL ? PERMS_MODE : 0) | PERMS_OWNER;
+	}
+	else {
+	    for (i = 0; files[i] != NULL; i++) {
+		failed = perms.failed;
+		perms_walk(dfd, files[i], &perms);
+		/* Blame the first that went wrong */
+		if (perms.failed != failed && bad == files[0])
+		    bad = files[i];
+	    }
+	    close(dfd);
+	}
+    }
+    free(perms.set);
+
+    if (perms.failed & PERMS_MODE && Mode)
+	warnx("couldn't change modes of '%s' to '%s'", bad, Mode);
+    if (!(perms.failed & PERMS_OWNER))
 	return;
-    } else if (Group)
-	if (vsystem("cd %s && /usr/bin/chgrp -R %s %s", cd_to, Group, arg))
-	    warnx("couldn't change group of '%s' to '%s'", arg, Group);
+    if (Owner && Group)
+	warnx("couldn't change owner/group of '%s' to '%s:%s'",
+	       bad, Owner, Group);
+    else if (Owner)
+	warnx("couldn't change owner of '%s' to '%s'", bad, Owner);
+    else if (Group)
+	warnx("couldn't change group of '%s' to '%s'", bad, Group);
 }
-
@@ -47,17 +47,22 @@ char	*PkgAddCmd	= NULL;
 char	*Directory	= NULL;
 char	FirstPen[FILENAME_MAX];
 add_mode_t AddMode	= NORMAL;
+int	Jobs		= 0;
+Boolean	Batch		= FALSE;
 
 char	**pkgs;
 
 static void usage(void);
+static char **read_pkg_list(FILE *);
 
-static char opts[] = "hviIRfFnrp:P:SMt:C:K";
+static char opts[] = "hviIRfFnrp:P:SMt:C:Kj:B";
 static struct option longopts[] = {
+	{ "batch",	no_argument,		NULL,		'B' },
 	{ "chroot",	required_argument,	NULL,		'C' },
 	{ "dry-run",	no_argument,		NULL,		'n' },
 	{ "force",	no_argument,		NULL,		'f' },
 	{ "help",	no_argument,		NULL,		'h' },
+	{ "jobs",	required_argument,	NULL,		'j' },
 	{ "keep",	no_argument,		NULL,		'K' },
 	{ "master",	no_argument,		NULL,		'M' },
 	{ "no-deps",	no_argument,		NULL,		'i' },
@@ -76,7 +81,8 @@ main(int argc, char **argv)
 {
     int ch, error;
     char **start;
-    char *cp, *remotepkg = NULL;
+    const char *errstr;
+    char *cp, *remotepkg = NULL, **list;
     static char pkgaddpath[MAXPATHLEN];
 
     if (*argv[0] != '/' && strchr(argv[0], '/') != NULL)
@@ -150,6 +156,16 @@ main(int argc, char **argv)
 	    IgnoreDeps = TRUE;
 	    break;
 
+	case 'B':
+	    Batch = TRUE;
+	    break;
+
+	case 'j':
+	    Jobs = strtonum(optarg, 1, 1024, &errstr);
+	    if (errstr != NULL)
+		errx(1, "number of jobs is %s: %s", errstr, optarg);
+	    break;
+
 	case 'h':
 	default:
 	    usage();
@@ -159,6 +175,17 @@ main(int argc, char **argv)
     argc -= optind;
     argv += optind;
 
+    if (Batch && AddMode != NORMAL) {
+	warnx("batch mode can't be used with master or slave mode");
+	usage();
+    }
+    /* In batch mode, the packages may be listed on stdin instead */
+    if (Batch && argc == 0 && (list = read_pkg_list(stdin)) != NULL) {
+	argv = list;
+	for (argc = 0; argv[argc] != NULL; argc++)
+	    ;
+    }
+
     if (AddMode != SLAVE) {
 	pkgs = (char **)malloc((argc+1) * sizeof(char *));
 	for (ch = 0; ch <= argc; pkgs[ch++] = NULL) ;
@@ -231,11 +258,36 @@ main(int argc, char **argv)
 	return 0;
 }
 
+/* Read a list of packages for batch mode, one to a line */
+static char **
+read_pkg_list(FILE *fp)
+{
+    char **list = NULL, *line;
+    size_t len;
+    int n = 0;
+
+    while ((line = fgetln(fp, &len)) != NULL) {
+	while (len > 0 && isspace((unsigned char)line[len - 1]))
+	    len--;
+	while (len > 0 && isspace((unsigned char)*line)) {
+	    line++;
+	    len--;
+	}
+	if (len == 0 || *line == '#')
+	    continue;
+	if ((list = reallocf(list, (n + 2) * sizeof(*list))) == NULL ||
+	    (list[n++] = strndup(line, len)) == NULL)
+	    err(2, NULL);
+	list[n] = NULL;
+    }
+    return list;
+}
+
 static void
 usage(void)
 {
     fprintf(stderr, "%s\n%s\n",
-	"usage: pkg_add [-viInfFrRMSK] [-t template] [-p prefix] [-P prefix] [-C chrootdir]",
-	"               pkg-name [pkg-name ...]");
+	"usage: pkg_add [-viInfFrRMSKB] [-t template] [-p prefix] [-P prefix] [-C chrootdir]",
+	"               [-j jobs] pkg-name [pkg-name ...]");
     exit(1);
 }
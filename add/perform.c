@@ -22,6 +22,7 @@
 __FBSDID("$FreeBSD: stable/10/usr.sbin/pkg_install/add/perform.c 240476 2012-09-14 00:19:06Z jkim $");
 
 #include <err.h>
+#include <errno.h>
 #include <paths.h>
 #include "lib.h"
 #include "add.h"
@@ -29,13 +30,65 @@ __FBSDID("$FreeBSD: stable/10/usr.sbin/pkg_install/add/perform.c 240476 2012-09-
 #include <libgen.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <time.h>
 
 static int pkg_do(char *);
 static int sanity_check(char *);
+static int unpack_ready(struct pkg_meta *, void *);
+static void prefetch_deps(const char *, Package *);
+static int pkg_do_dep(const char *);
+static int pkg_perform_jobs(char **);
+static void jobs_cleanup(void);
+static void batch_begin(void);
+static void batch_end(int, int);
+static void batch_phase(int);
 static char LogDir[FILENAME_MAX];
 static int zapLogDir;		/* Should we delete LogDir? */
 struct pkgdb *db = NULL;
 
+/* What unpack_ready() needs to know, and tells us, about a package */
+struct unpack_state {
+    const char *pkg;
+    char *playpen;
+    Package *plist;
+    const char *where_to;
+    int inPlace;
+};
+
+/* A package named on the command line, when installing with -j */
+struct job {
+    char	*pkg;
+    char	*name;		/* from its packing list */
+    char	**deps;		/* the packages it says it depends on */
+    int		ndeps;
+    Boolean	stage;		/* can be unpacked ahead of time */
+    Boolean	seen;		/* already put in order */
+    Boolean	reserved;	/* size is counted in JobsReserved */
+    off_t	size;		/* the space its playpen needs */
+    pid_t	pid;		/* of the worker unpacking it */
+    int		fd;		/* the worker says where it put it */
+    char	pen[FILENAME_MAX];
+};
+
+static struct job *JobList;
+static int NJobs;
+static struct job *Staged;	/* for pkg_do() to install from */
+static char JobsPenDir[FILENAME_MAX];	/* where the workers' playpens go */
+static off_t JobsReserved;	/* promised to them there */
+
+/* Where the time goes in batch mode */
+enum {
+    PHASE_UNPACK, PHASE_CHECK, PHASE_SCRIPTS, PHASE_EXTRACT, PHASE_MTREE,
+    PHASE_REGISTER, PHASE_CLEANUP, PHASE_MAX
+};
+static const char *PhaseNames[PHASE_MAX] = {
+    "unpack", "checks", "scripts", "extract", "mtree", "register", "cleanup"
+};
+static double PhaseTime[PHASE_MAX];
+static int Phase = -1;
+static struct timespec PhaseStart, BatchStart;
+static char BatchRoot[FILENAME_MAX];	/* all the playpens go in here */
+
 int
 pkg_perform(char **pkgs)
 {
@@ -44,12 +97,29 @@ pkg_perform(char **pkgs)
     signal(SIGINT, cleanup);
     signal(SIGHUP, cleanup);
 
+    /* Only pretending?  Then just say what would happen */
+    if (Fake && AddMode == NORMAL)
+	return plan_perform(pkgs);
+    if (!Fake)
+	lock_log_dir();
+    if (Batch)
+	batch_begin();
     if (AddMode == SLAVE)
 	err_cnt = pkg_do(NULL);
+    else if (AddMode == NORMAL && Jobs > 1 && !Fake)
+	err_cnt = pkg_perform_jobs(pkgs);
     else {
 	for (i = 0; pkgs[i]; i++)
 	    err_cnt += pkg_do(pkgs[i]);
     }
+    /* Record everything the new packages depend on in one go */
+    batch_phase(PHASE_REGISTER);
+    reqby_commit();
+    if (Batch) {
+	for (i = 0; pkgs != NULL && pkgs[i] != NULL; i++)
+	    ;
+	batch_end(i, err_cnt);
+    }
     return err_cnt;
 }
 
@@ -64,9 +134,10 @@ pkg_do(char *pkg)
     Package Plist;
     char pkg_fullname[FILENAME_MAX];
     char playpen[FILENAME_MAX];
-    char extract_contents[FILENAME_MAX];
-    char *extract;
+    char prevpen[FILENAME_MAX];
     const char *where_to;
+    struct unpack_state us;
+    struct pkg_meta meta;
     FILE *cfile;
     int code;
     PackingList p;
@@ -77,18 +148,22 @@ pkg_do(char *pkg)
     char pre_script[FILENAME_MAX] = INSTALL_FNAME;
     char post_script[FILENAME_MAX];
     char pre_arg[FILENAME_MAX], post_arg[FILENAME_MAX];
-    char *conflict[2];
-    char **matched;
+    char **conflicts, **matched;
+    int nconflicts;
     int fd;
+    struct job *job = Staged;
 
+    Staged = NULL;	/* not for any dependencies we recurse into */
     conflictsfound = 0;
     code = 0;
     zapLogDir = 0;
     LogDir[0] = '\0';
     strcpy(playpen, FirstPen);
+    strlcpy(prevpen, where_playpen(), sizeof(prevpen));
     inPlace = 0;
 
     memset(&Plist, '\0', sizeof(Plist));
+    batch_phase(PHASE_UNPACK);
 
     /* Are we coming in for a second pass, everything already extracted? */
     if (!pkg) {
@@ -120,98 +195,66 @@ pkg_do(char *pkg)
 	    read_plist(&Plist, cfile);
 	    fclose(cfile);
 	}
-	else {
-	    strcpy(pkg_fullname, pkg);		/*
-						 * Copy for sanity's sake,
-						 * could remove pkg_fullname
-						 */
-	    if (strcmp(pkg, "-")) {
-		if (stat(pkg_fullname, &sb) == FAIL) {
-		    warnx("can't stat package file '%s'", pkg_fullname);
-		    goto bomb;
-		}
-		sprintf(extract_contents, "--fast-read %s", CONTENTS_FNAME);
-		extract = extract_contents;
-	    }
-	    else {
-		extract = NULL;
-		sb.st_size = 100000;	/* Make up a plausible average size */
-	    }
-	    if (!(where_to = make_playpen(playpen, sb.st_size * 4)))
-		errx(1, "unable to make playpen for %lld bytes", (long long)sb.st_size * 4);
-	    /* Since we can call ourselves recursively, keep notes on where we came from */
+	/* Has a worker already unpacked it for us? */
+	else if (job != NULL && job->pen[0] != '\0') {
+	    strcpy(pkg_fullname, pkg);
+	    if (!(where_to = enter_playpen(job->pen)))
+		goto bomb;
 	    if (!getenv("_TOP"))
 		setenv("_TOP", where_to, 1);
-	    if (unpack(pkg_fullname, extract)) {
-		warnx(
-	"unable to extract table of contents file from '%s' - not a package?",
-		pkg_fullname);
-		goto bomb;
-	    }
 	    cfile = fopen(CONTENTS_FNAME, "r");
 	    if (!cfile) {
 		warnx(
-	"unable to open table of contents file '%s' - not a package?",
+		"unable to open table of contents file '%s' - not a package?",
 		CONTENTS_FNAME);
 		goto bomb;
 	    }
 	    read_plist(&Plist, cfile);
 	    fclose(cfile);
-
-	    /* Extract directly rather than moving?  Oh goodie! */
-	    if (find_plist_option(&Plist, "extract-in-place")) {
-		if (Verbose)
-		    printf("Doing in-place extraction for %s\n", pkg_fullname);
-		p = find_plist(&Plist, PLIST_CWD);
-		if (p) {
-		    if (!isdir(p->name) && !Fake) {
-			if (Verbose)
-			    printf("Desired prefix of %s does not exist, creating..\n", p->name);
-			vsystem("/bin/mkdir -p %s", p->name);
-			if (chdir(p->name) == -1) {
-			    warn("unable to change directory to '%s'", p->name);
-			    goto bomb;
-			}
-		    }
-		    where_to = p->name;
-		    inPlace = 1;
-		}
-		else {
-		    warnx(
-		"no prefix specified in '%s' - this is a bad package!",
-			pkg_fullname);
-		    goto bomb;
-		}
+	}
+	else {
+	    strcpy(pkg_fullname, pkg);		/*
+						 * Copy for sanity's sake,
+						 * could remove pkg_fullname
+						 */
+	    if (strcmp(pkg, "-") && stat(pkg_fullname, &sb) == FAIL) {
+		warnx("can't stat package file '%s'", pkg_fullname);
+		goto bomb;
 	    }
 
 	    /*
-	     * Apply a crude heuristic to see how much space the package will
-	     * take up once it's unpacked.  I've noticed that most packages
-	     * compress an average of 75%, so multiply by 4 for good measure.
+	     * Unpack the whole package in a single pass.  unpack_ready()
+	     * reads the packing list as soon as it has gone by, makes a
+	     * playpen of the right size and decides where the rest of the
+	     * package goes.
 	     */
+	    us.pkg = pkg_fullname;
+	    us.playpen = playpen;
+	    us.plist = &Plist;
+	    us.where_to = NULL;
+	    us.inPlace = 0;
+	    if (unpack_pkg(pkg_fullname, &meta, unpack_ready, &us)) {
+		pkg_meta_free(&meta);
+		warnx("unable to extract '%s'!", pkg_fullname);
+		goto bomb;
+	    }
+	    pkg_meta_free(&meta);
+	    where_to = us.where_to;
+	    inPlace = us.inPlace;
 
-	    if (!extract && !inPlace && min_free(playpen) < sb.st_size * 4) {
-		warnx("projected size of %lld exceeds available free space.\n"
-"Please set your PKG_TMPDIR variable to point to a location with more\n"
-		       "free space and try again", (long long)sb.st_size * 4);
-		warnx("not extracting %s\ninto %s, sorry!",
-			pkg_fullname, where_to);
+	    /* The rest of the work is done from the playpen */
+	    if (inPlace && !Fake && chdir(playpen) == FAIL) {
+		warn("unable to change directory to '%s'", playpen);
 		goto bomb;
 	    }
 
 	    /* If this is a direct extract and we didn't want it, stop now */
 	    if (inPlace && Fake)
 		goto success;
-
-	    /* Finally unpack the whole mess.  If extract is null we
-	       already + did so so don't bother doing it again. */
-	    if (extract && unpack(pkg_fullname, NULL)) {
-		warnx("unable to extract '%s'!", pkg_fullname);
-		goto bomb;
-	    }
 	}
 
 	/* Check for sanity and dependencies */
+	batch_phase(PHASE_CHECK);
 	if (sanity_check(pkg))
 	    goto bomb;
 
@@ -251,25 +294,31 @@ pkg_do(char *pkg)
 	goto success;	/* close enough for government work */
     }
 
-    /* Now check the packing list for conflicts */
+    /* Now check the packing list for conflicts, all at once */
     if (!IgnoreDeps){
-    for (p = Plist.head; p != NULL; p = p->next) {
-	if (p->type == PLIST_CONFLICTS) {
-	    int i;
-	    conflict[0] = strdup(p->name);
-	    conflict[1] = NULL;
-	    matched = matchinstalled(MATCH_GLOB, conflict, &errcode);
-	    free(conflict[0]);
-	    if (errcode == 0 && matched != NULL)
-		for (i = 0; matched[i] != NULL; i++)
-		    if (isinstalledpkg(matched[i]) > 0) {
-			warnx("package '%s' conflicts with %s", Plist.name,
-				matched[i]);
-			conflictsfound = 1;
-		    }
+    nconflicts = 0;
+    for (p = Plist.head; p != NULL; p = p->next)
+	if (p->type == PLIST_CONFLICTS)
+	    nconflicts++;
+    if (nconflicts > 0) {
+	int i;
 
-	    continue;
+	if ((conflicts = calloc(nconflicts + 1, sizeof(*conflicts))) == NULL) {
+	    cleanup(0);
+	    err(2, NULL);
 	}
+	nconflicts = 0;
+	for (p = Plist.head; p != NULL; p = p->next)
+	    if (p->type == PLIST_CONFLICTS)
+		conflicts[nconflicts++] = p->name;
+	matched = matchinstalled_globs(conflicts, &errcode);
+	free(conflicts);
+	if (errcode == 0 && matched != NULL)
+	    for (i = 0; matched[i] != NULL; i++) {
+		warnx("package '%s' conflicts with %s", Plist.name,
+			matched[i]);
+		conflictsfound = 1;
+	    }
     }
     if(conflictsfound) {
 	if(!Force) {
@@ -322,6 +371,8 @@ pkg_do(char *pkg)
     }
 #endif
 
+    prefetch_deps(pkg, &Plist);
+
     /* Now check the packing list for dependencies */
     for (p = Plist.head; p ; p = p->next) {
 	char *deporigin;
@@ -341,11 +392,6 @@ pkg_do(char *pkg)
 	    const char *cp = NULL;
 
 	    if (!Fake) {
-		char prefixArg[2 + MAXPATHLEN]; /* "-P" + Prefix */
-		if (PrefixRecursive) {
-		    strlcpy(prefixArg, "-P", sizeof(prefixArg));
-		    strlcat(prefixArg, Prefix, sizeof(prefixArg));
-		}
 		if (!isURL(pkg) && !getenv("PKG_ADD_BASE")) {
 		    const char *ext;
 
@@ -365,7 +411,7 @@ pkg_do(char *pkg)
 		    if (cp) {
 			if (Verbose)
 			    printf("Loading it from %s.\n", cp);
-			if (vsystem("%s %s %s '%s'", PkgAddCmd, Verbose ? "-v " : "", PrefixRecursive ? prefixArg : "", cp)) {
+			if (pkg_do_dep(cp)) {
 			    warnx("autoload of dependency '%s' failed%s",
 				cp, Force ? " (proceeding anyway)" : "!");
 			    if (!Force)
@@ -379,16 +425,10 @@ pkg_do(char *pkg)
 			    ++code;
 		    }
 		}
-		else if ((cp = fileGetURL(pkg, p->name, KeepPackage)) != NULL) {
+		else if (fileComposeURL(pkg, p->name, path)) {
 		    if (Verbose)
-			printf("Finished loading %s via a URL\n", p->name);
-		    if (!fexists("+CONTENTS")) {
-			warnx("autoloaded package %s has no +CONTENTS file?",
-				p->name);
-			if (!Force)
-			    ++code;
-		    }
-		    else if (vsystem("(pwd; /bin/cat +CONTENTS) | %s %s %s %s -S", PkgAddCmd, Verbose ? "-v" : "", PrefixRecursive ? prefixArg : "", KeepPackage ? "-K" : "")) {
+			printf("Loading it from %s.\n", path);
+		    if (pkg_do_dep(path)) {
 			warnx("pkg_add of dependency '%s' failed%s",
 				p->name, Force ? " (proceeding anyway)" : "!");
 			if (!Force)
@@ -396,8 +436,6 @@ pkg_do(char *pkg)
 		    }
 		    else if (Verbose)
 			printf("\t'%s' loaded successfully.\n", p->name);
-		    /* Nuke the temporary playpen */
-		    leave_playpen();
 		}
 	    }
 	    else {
@@ -419,6 +457,7 @@ pkg_do(char *pkg)
 	goto bomb;
 
     /* Look for the requirements file */
+    batch_phase(PHASE_SCRIPTS);
     if ((fd = open(REQUIRE_FNAME, O_RDWR)) != -1) {
 	fstat(fd, &sb);
 	fchmod(fd, sb.st_mode | S_IXALL);	/* be sure, chmod a+x */
@@ -469,9 +508,11 @@ pkg_do(char *pkg)
     }
 
     /* Now finally extract the entire show if we're not going direct */
-    if (!inPlace && !Fake)
-	extract_plist(".", &Plist);
+    batch_phase(PHASE_EXTRACT);
+    if (!inPlace && !Fake && extract_plist(".", &Plist) == FAIL)
+	goto bomb;
 
+    batch_phase(PHASE_MTREE);
     if (!Fake && fexists(MTREE_FNAME)) {
 	if (Verbose)
 	    printf("Running mtree for %s..\n", Plist.name);
@@ -479,12 +520,18 @@ pkg_do(char *pkg)
 	if (Verbose)
 	    printf("mtree -U -f %s -d -e -p %s >%s\n", MTREE_FNAME, p ? p->name : "/", _PATH_DEVNULL);
 	if (!Fake) {
-	    if (vsystem("/usr/sbin/mtree -U -f %s -d -e -p %s >%s", MTREE_FNAME, p ? p->name : "/", _PATH_DEVNULL))
+	    struct spawn_opts so;
+
+	    memset(&so, 0, sizeof(so));
+	    so.quiet = TRUE;
+	    if (spawn_cmd(&so, "/usr/sbin/mtree", "-U", "-f", MTREE_FNAME,
+		"-d", "-e", "-p", p ? p->name : "/", NULL))
 		warnx("mtree returned a non-zero status - continuing");
 	}
     }
 
     /* Run the installation script one last time? */
+    batch_phase(PHASE_SCRIPTS);
     if (!NoInstall && (fd = open(post_script, O_RDWR)) != -1) {
 	fstat(fd, &sb);
 	fchmod(fd, sb.st_mode | S_IXALL);	/* be sure, chmod a+x */
@@ -500,6 +547,7 @@ pkg_do(char *pkg)
     }
 
     /* Time to record the deed? */
+    batch_phase(PHASE_REGISTER);
     if (!NoRecord && !Fake) {
 	char contents[FILENAME_MAX];
 	char **depnames = NULL, **deporigins = NULL, ***depmatches;
@@ -524,22 +572,27 @@ pkg_do(char *pkg)
 	fstat(fd, &sb);
 	fchmod(fd, sb.st_mode | S_IRALL | S_IXALL);	/* be sure, chmod a+rx */
 	close(fd);
-	move_file(".", DESC_FNAME, LogDir);
-	move_file(".", COMMENT_FNAME, LogDir);
-	if (fexists(INSTALL_FNAME))
-	    move_file(".", INSTALL_FNAME, LogDir);
-	if (fexists(POST_INSTALL_FNAME))
-	    move_file(".", POST_INSTALL_FNAME, LogDir);
-	if (fexists(DEINSTALL_FNAME))
-	    move_file(".", DEINSTALL_FNAME, LogDir);
-	if (fexists(POST_DEINSTALL_FNAME))
-	    move_file(".", POST_DEINSTALL_FNAME, LogDir);
-	if (fexists(REQUIRE_FNAME))
-	    move_file(".", REQUIRE_FNAME, LogDir);
-	if (fexists(DISPLAY_FNAME))
-	    move_file(".", DISPLAY_FNAME, LogDir);
-	if (fexists(MTREE_FNAME))
-	    move_file(".", MTREE_FNAME, LogDir);
+	if (move_file(".", DESC_FNAME, LogDir) == FAIL ||
+	    move_file(".", COMMENT_FNAME, LogDir) == FAIL ||
+	    (fexists(INSTALL_FNAME) &&
+	     move_file(".", INSTALL_FNAME, LogDir) == FAIL) ||
+	    (fexists(POST_INSTALL_FNAME) &&
+	     move_file(".", POST_INSTALL_FNAME, LogDir) == FAIL) ||
+	    (fexists(DEINSTALL_FNAME) &&
+	     move_file(".", DEINSTALL_FNAME, LogDir) == FAIL) ||
+	    (fexists(POST_DEINSTALL_FNAME) &&
+	     move_file(".", POST_DEINSTALL_FNAME, LogDir) == FAIL) ||
+	    (fexists(REQUIRE_FNAME) &&
+	     move_file(".", REQUIRE_FNAME, LogDir) == FAIL) ||
+	    (fexists(DISPLAY_FNAME) &&
+	     move_file(".", DISPLAY_FNAME, LogDir) == FAIL) ||
+	    (fexists(MTREE_FNAME) &&
+	     move_file(".", MTREE_FNAME, LogDir) == FAIL)) {
+	    warnx("can't record package into '%s', you're on your own!",
+		   LogDir);
+	    code = 1;
+	    goto success;	/* close enough for government work */
+	}
 	sprintf(contents, "%s/%s", LogDir, CONTENTS_FNAME);
 	contfile = fopen(contents, "w");
 	if (!contfile) {
@@ -573,18 +626,7 @@ pkg_do(char *pkg)
 		dep_count++;
 	    } else {
 	       /* No origin recorded, try to register on literal package name */
-	       sprintf(contents, "%s/%s/%s", LOG_DIR, p->name,
-		     REQUIRED_BY_FNAME);
-	       contfile = fopen(contents, "a");
-	       if (!contfile) {
-		  warnx("can't open dependency file '%s'!\n"
-			"dependency registration is incomplete", contents);
-	       } else {
-		  fprintf(contfile, "%s\n", Plist.name);
-		  if (fclose(contfile) == EOF) {
-		     warnx("cannot properly close file %s", contents);
-		  }
-	       }
+	       reqby_add(p->name, Plist.name);
 	    }
 	}
 	if (dep_count > 0) {
@@ -597,35 +639,14 @@ pkg_do(char *pkg)
 			char **tmp = depmatches[i];
 			for (j = 0; tmp[j] != NULL; j++) {
 			    /* Origin looked up */
-			    sprintf(contents, "%s/%s/%s", LOG_DIR, tmp[j],
-				REQUIRED_BY_FNAME);
 			    if (depnames[i] && strcmp(depnames[i], tmp[j]) != 0)
 				warnx("warning: package '%s' requires '%s', but '%s' "
 				    "is installed", Plist.name, depnames[i], tmp[j]);
-			    contfile = fopen(contents, "a");
-			    if (!contfile) {
-				warnx("can't open dependency file '%s'!\n"
-				    "dependency registration is incomplete", contents);
-			    } else {
-				fprintf(contfile, "%s\n", Plist.name);
-				if (fclose(contfile) == EOF)
-				    warnx("cannot properly close file %s", contents);
-			    }
+			    reqby_add(tmp[j], Plist.name);
 			}
 		    } else if (depnames[i]) {
 			/* No package present with this origin, try literal package name */
-			sprintf(contents, "%s/%s/%s", LOG_DIR, depnames[i],
-			    REQUIRED_BY_FNAME);
-			contfile = fopen(contents, "a");
-			if (!contfile) {
-			    warnx("can't open dependency file '%s'!\n"
-				"dependency registration is incomplete", contents);
-			} else {
-			    fprintf(contfile, "%s\n", Plist.name);
-			    if (fclose(contfile) == EOF) {
-				warnx("cannot properly close file %s", contents);
-			    }
-			}
+			reqby_add(depnames[i], Plist.name);
 		    }
 		}
 	    }
@@ -665,12 +686,571 @@ pkg_do(char *pkg)
 	delete_package(FALSE, FALSE, &Plist);
 
  success:
+    batch_phase(PHASE_CLEANUP);
     /* delete the packing list contents */
     free_plist(&Plist);
-    leave_playpen();
+    /*
+     * Only leave the playpen if we got as far as making one, as we may
+     * be installing a dependency from inside another package's.
+     */
+    if (strcmp(where_playpen(), prevpen))
+	leave_playpen();
     return code;
 }
 
+/*
+ * Called by unpack_pkg() once the "+" files at the head of a package
+ * have been read: load the packing list and set up for extracting the
+ * rest of the package.
+ */
+static int
+unpack_ready(struct pkg_meta *meta, void *arg)
+{
+    struct unpack_state *us = arg;
+    PackingList p = NULL;
+    off_t size, need;
+
+    if (pkg_meta_plist(meta, us->plist) == FAIL) {
+	warnx(
+	"unable to extract table of contents file from '%s' - not a package?",
+	us->pkg);
+	return -1;
+    }
+
+    /* Extract directly rather than moving?  Oh goodie! */
+    if (find_plist_option(us->plist, "extract-in-place")) {
+	if (Verbose)
+	    printf("Doing in-place extraction for %s\n", us->pkg);
+	if ((p = find_plist(us->plist, PLIST_CWD)) == NULL) {
+	    warnx("no prefix specified in '%s' - this is a bad package!",
+		us->pkg);
+	    return -1;
+	}
+	us->inPlace = 1;
+    }
+
+    /*
+     * See how much space the package will take up once it's unpacked.
+     * pkg_create records this; for older packages, add up the sizes in
+     * the archive headers.  An old package read from stdin can't be read
+     * twice, so there's no telling, and only its metadata is allowed for.
+     */
+    if ((size = plist_size(us->plist)) < 0 && strcmp(us->pkg, "-"))
+	size = unpack_size(us->pkg);
+    if (size < 0) {
+	if (Verbose)
+	    printf("Size of %s not known, not checking for space\n",
+		us->pkg);
+	size = 0;
+    }
+
+    /* An in-place package only needs the playpen for its metadata */
+    need = pkg_meta_size(meta) + (us->inPlace ? 0 : size);
+    /* Only this package fails, not any we are a dependency of */
+    if (!(us->where_to = make_playpen(us->playpen, need))) {
+	warnx("unable to make playpen for %lld bytes", (long long)need);
+	return -1;
+    }
+    /* Since we can call ourselves recursively, keep notes on where we came from */
+    if (!getenv("_TOP"))
+	setenv("_TOP", us->where_to, 1);
+    if (pkg_meta_extract(meta) == FAIL)
+	return -1;
+
+    if (us->inPlace) {
+	us->where_to = p->name;
+	/* If this is a direct extract and we didn't want it, stop now */
+	if (Fake)
+	    return 1;
+	if (!isdir(p->name)) {
+	    if (Verbose)
+		printf("Desired prefix of %s does not exist, creating..\n", p->name);
+	    spawn_cmd(NULL, "/bin/mkdir", "-p", p->name, NULL);
+	}
+	if (min_free(p->name) < size) {
+	    warnx("projected size of %lld exceeds available free space in %s",
+		(long long)size, p->name);
+	    return -1;
+	}
+	/* Stream the rest of the package straight into place */
+	if (chdir(p->name) == -1) {
+	    warn("unable to change directory to '%s'", p->name);
+	    return -1;
+	}
+    }
+
+    /*
+     * If we're only pretending, nothing past the packing list and the
+     * scripts is looked at, so don't bother extracting it.
+     */
+    if (Fake)
+	return 1;
+    return 0;
+}
+
+/*
+ * Install a dependency in this process, as running pkg_add on it would
+ * have: with our -v and -K, and our prefix only if it was given with -P.
+ * Everything else from our command line is put aside until it's done.
+ */
+static int
+pkg_do_dep(const char *pkg)
+{
+    char dep[FILENAME_MAX], saveLogDir[FILENAME_MAX];
+    char *savePrefix = Prefix, *saveEnvPrefix = NULL;
+    Boolean saveForce = Force, saveNoInstall = NoInstall;
+    Boolean saveNoRecord = NoRecord, saveFail = FailOnAlreadyInstalled;
+    int saveZap = zapLogDir;
+    add_mode_t saveMode = AddMode;
+    int savePhase = Phase;
+    int ret;
+
+    strlcpy(saveLogDir, LogDir, sizeof(saveLogDir));
+    /* Our own scripts are yet to run, with our prefix */
+    if (getenv(PKG_PREFIX_VNAME) != NULL &&
+	(saveEnvPrefix = strdup(getenv(PKG_PREFIX_VNAME))) == NULL) {
+	cleanup(0);
+	err(2, NULL);
+    }
+    if (!PrefixRecursive)
+	Prefix = NULL;
+    Force = NoInstall = NoRecord = FALSE;
+    FailOnAlreadyInstalled = TRUE;
+    AddMode = NORMAL;
+
+    strlcpy(dep, pkg, sizeof(dep));
+    ret = pkg_do(dep);
+
+    strlcpy(LogDir, saveLogDir, sizeof(LogDir));
+    if (saveEnvPrefix != NULL) {
+	setenv(PKG_PREFIX_VNAME, saveEnvPrefix, 1);
+	free(saveEnvPrefix);
+    }
+    else
+	unsetenv(PKG_PREFIX_VNAME);
+    zapLogDir = saveZap;
+    Prefix = savePrefix;
+    Force = saveForce;
+    NoInstall = saveNoInstall;
+    NoRecord = saveNoRecord;
+    FailOnAlreadyInstalled = saveFail;
+    AddMode = saveMode;
+    /* Back to timing whatever we were doing */
+    batch_phase(savePhase);
+    return ret;
+}
+
+/*
+ * If the dependencies are to come from a URL, download all the missing
+ * ones at once before installing any of them.  The packing list names
+ * every dependency, not just the direct ones, so this is all of them.
+ */
+static void
+prefetch_deps(const char *pkg, Package *plist)
+{
+    PackingList p;
+    const char **specs;
+    char *deporigin;
+    int n = 0;
+
+    if (Fake || pkg == NULL || (!isURL(pkg) && !getenv("PKG_ADD_BASE")))
+	return;
+    for (p = plist->head; p != NULL; p = p->next)
+	if (p->type == PLIST_PKGDEP)
+	    n++;
+    if ((specs = calloc(n + 1, sizeof(*specs))) == NULL) {
+	cleanup(0);
+	err(2, NULL);
+    }
+    n = 0;
+    for (p = plist->head; p != NULL; p = p->next) {
+	if (p->type != PLIST_PKGDEP)
+	    continue;
+	deporigin = (p->next != NULL && p->next->type == PLIST_DEPORIGIN) ?
+	    p->next->name : NULL;
+	if (isinstalledpkg(p->name) <= 0 &&
+	    !(deporigin != NULL && matchbyorigin(deporigin, NULL) != NULL))
+	    specs[n++] = p->name;
+    }
+    fileFetchAll(pkg, specs, n);
+    free(specs);
+}
+
+static int
+job_cmp(const void *a, const void *b)
+{
+    return strcmp((*(struct job * const *)a)->name,
+	(*(struct job * const *)b)->name);
+}
+
+/*
+ * Read the packing lists of the packages on the command line, without
+ * unpacking them, to find out what each one depends on and how much
+ * space it needs.  Packages that must be extracted in place, that don't
+ * record their size, or that aren't local files, are left for pkg_do()
+ * to unpack when their turn comes.
+ */
+static void
+jobs_load(char **pkgs)
+{
+    struct pkg_meta meta;
+    Package plist;
+    PackingList p;
+    struct job *j;
+    int i;
+
+    for (NJobs = 0; pkgs[NJobs] != NULL; NJobs++)
+	;
+    if ((JobList = calloc(NJobs, sizeof(*JobList))) == NULL)
+	err(2, NULL);
+    for (i = 0; i < NJobs; i++) {
+	j = &JobList[i];
+	j->pkg = pkgs[i];
+	j->pid = -1;
+	j->fd = -1;
+	if (!strcmp(j->pkg, "-") || isURL(j->pkg) || !isfile(j->pkg) ||
+	    pkg_meta_load(j->pkg, &meta))
+	    continue;
+	memset(&plist, 0, sizeof(plist));
+	if (pkg_meta_plist(&meta, &plist) == SUCCESS && plist.name != NULL) {
+	    j->name = strdup(plist.name);
+	    for (p = plist.head; p != NULL; p = p->next)
+		if (p->type == PLIST_PKGDEP)
+		    j->ndeps++;
+	    if ((j->deps = calloc(j->ndeps + 1, sizeof(*j->deps))) == NULL)
+		err(2, NULL);
+	    j->ndeps = 0;
+	    for (p = plist.head; p != NULL; p = p->next)
+		if (p->type == PLIST_PKGDEP)
+		    j->deps[j->ndeps++] = strdup(p->name);
+	    j->stage = find_plist_option(&plist, "extract-in-place") == NULL;
+	    /* One too old to say how big it is can't have space set aside */
+	    if ((j->size = plist_size(&plist)) < 0)
+		j->stage = FALSE;
+	    j->size += pkg_meta_size(&meta);
+	}
+	free_plist(&plist);
+	pkg_meta_free(&meta);
+    }
+}
+
+/* Put a package after all the ones it depends on, depth first */
+static void
+job_visit(struct job *j, struct job **byname, int nnamed, struct job **order,
+    int *n)
+{
+    struct job key, *kp = &key, **dp;
+    int i;
+
+    if (j->seen)
+	return;
+    j->seen = TRUE;	/* a dependency loop is simply broken here */
+    for (i = 0; i < j->ndeps; i++) {
+	key.name = j->deps[i];
+	if ((dp = bsearch(&kp, byname, nnamed, sizeof(*byname),
+	    job_cmp)) != NULL)
+	    job_visit(*dp, byname, nnamed, order, n);
+    }
+    order[(*n)++] = j;
+}
+
+/*
+ * Work out the order to install the packages in.  Dependencies that
+ * aren't on the command line don't come into it; pkg_do() deals with
+ * them as before.  Otherwise, the command line order is kept.
+ */
+static struct job **
+jobs_order(void)
+{
+    struct job **order, **byname;
+    int i, n = 0, nnamed = 0;
+
+    if ((order = calloc(NJobs, sizeof(*order))) == NULL ||
+	(byname = calloc(NJobs, sizeof(*byname))) == NULL)
+	err(2, NULL);
+    for (i = 0; i < NJobs; i++)
+	if (JobList[i].name != NULL)
+	    byname[nnamed++] = &JobList[i];
+    qsort(byname, nnamed, sizeof(*byname), job_cmp);
+    for (i = 0; i < NJobs; i++)
+	job_visit(&JobList[i], byname, nnamed, order, &n);
+    free(byname);
+    return order;
+}
+
+/*
+ * In a worker: unpack a package into a playpen of its own, and write
+ * the playpen's name to fd for pkg_do() to install from.
+ */
+static int
+job_unpack(const char *pkg, int fd)
+{
+    struct unpack_state us;
+    struct pkg_meta meta;
+    Package plist;
+    char playpen[FILENAME_MAX], prevpen[FILENAME_MAX], cwd[FILENAME_MAX];
+    int rv;
+
+    /* None of these are ours to clean up or write out */
+    zapLogDir = 0;
+    BatchRoot[0] = '\0';
+    JobList = NULL;
+    NJobs = 0;
+    reqby_abort();
+    signal(SIGTERM, cleanup);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    memset(&plist, 0, sizeof(plist));
+    strcpy(playpen, FirstPen);
+    strlcpy(prevpen, where_playpen(), sizeof(prevpen));
+    us.pkg = pkg;
+    us.playpen = playpen;
+    us.plist = &plist;
+    us.where_to = NULL;
+    us.inPlace = 0;
+    rv = unpack_pkg(pkg, &meta, unpack_ready, &us);
+    pkg_meta_free(&meta);
+    free_plist(&plist);
+    if (rv == 0 && !us.inPlace && getcwd(cwd, FILENAME_MAX) != NULL &&
+	write(fd, cwd, strlen(cwd)) == (ssize_t)strlen(cwd))
+	return 0;
+    if (strcmp(where_playpen(), prevpen))
+	leave_playpen();
+    return 1;
+}
+
+/*
+ * Start a worker unpacking a package, if there's room for its playpen
+ * alongside those of the workers already started.  Each worker only
+ * checks the free space it sees itself, which the others are still
+ * using up, so the space is reserved here before the worker is started
+ * and only given back once its package has been dealt with.  Returns
+ * FALSE if the package must wait for some of that space; a package
+ * there isn't room for even on its own is left for pkg_do() to unpack,
+ * and to say why it can't.
+ */
+static Boolean
+job_stage(struct job *j)
+{
+    int fds[2];
+    off_t avail;
+    pid_t pid;
+
+    if (!j->stage)
+	return TRUE;
+    if ((avail = min_free(JobsPenDir)) >= 0 &&
+	avail - JobsReserved < j->size) {
+	if (JobsReserved > 0)
+	    return FALSE;
+	return TRUE;
+    }
+    if (pipe(fds) == FAIL) {
+	warn("pipe");
+	return TRUE;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    if ((pid = fork()) == -1) {
+	warn("fork");
+	close(fds[0]);
+	close(fds[1]);
+	return TRUE;
+    }
+    if (pid == 0) {
+	close(fds[0]);
+	_exit(job_unpack(j->pkg, fds[1]));
+    }
+    close(fds[1]);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    j->pid = pid;
+    j->fd = fds[0];
+    j->reserved = TRUE;
+    JobsReserved += j->size;
+    return TRUE;
+}
+
+/*
+ * Wait for the worker unpacking a package to finish, and find out where
+ * it put it.  If it failed, the package is unpacked again by pkg_do(),
+ * which reports why.
+ */
+static void
+job_collect(struct job *j)
+{
+    ssize_t n;
+    size_t len = 0;
+    int status;
+
+    if (j->pid == -1)
+	return;
+    while ((n = read(j->fd, j->pen + len, sizeof(j->pen) - 1 - len)) != 0) {
+	if (n == -1 && errno == EINTR)
+	    continue;
+	if (n == -1)
+	    break;
+	len += n;
+    }
+    j->pen[len] = '\0';
+    close(j->fd);
+    j->fd = -1;
+    while (waitpid(j->pid, &status, 0) == -1 && errno == EINTR)
+	;
+    j->pid = -1;
+    if (Verbose > 1 && j->pen[0] != '\0')
+	printf("%s was unpacked into %s\n", j->pkg, j->pen);
+}
+
+/*
+ * Remove a package's playpen, if pkg_do() didn't get as far as that,
+ * and give back the space reserved for it.
+ */
+static void
+job_discard(struct job *j)
+{
+    if (j->pen[0] != '\0' && isdir(j->pen))
+	spawn_cmd(NULL, REMOVE_CMD, "-rf", j->pen, NULL);
+    j->pen[0] = '\0';
+    if (j->reserved) {
+	JobsReserved -= j->size;
+	j->reserved = FALSE;
+    }
+}
+
+/* Where the workers' playpens will be made, as find_play_pen() has it */
+static void
+jobs_pen_dir(void)
+{
+    char pen[FILENAME_MAX];
+    const char *cp;
+
+    if (FirstPen[0] != '\0') {
+	strlcpy(pen, FirstPen, sizeof(pen));
+	cp = dirname(pen);
+    }
+    else if ((cp = getenv("PKG_TMPDIR")) == NULL &&
+	(cp = getenv("TMPDIR")) == NULL)
+	cp = "/var/tmp";
+    strlcpy(JobsPenDir, cp, sizeof(JobsPenDir));
+}
+
+/*
+ * Install with -j: put the packages in dependency order, and keep up
+ * to Jobs worker processes unpacking the next ones in line while each
+ * is installed in turn.  Scripts, mtree and registration only ever run
+ * here, one package at a time, so nothing is installed before whatever
+ * it depends on.
+ */
+static int
+pkg_perform_jobs(char **pkgs)
+{
+    struct job **order;
+    int i, next, err_cnt = 0;
+
+    jobs_load(pkgs);
+    jobs_pen_dir();
+    order = jobs_order();
+    for (i = next = 0; i < NJobs; i++) {
+	/* Nothing is reserved once next catches up, so this can't stall */
+	for (; next < NJobs && next < i + Jobs; next++)
+	    if (!job_stage(order[next]))
+		break;
+	batch_phase(PHASE_UNPACK);
+	job_collect(order[i]);
+	Staged = order[i];
+	err_cnt += pkg_do(order[i]->pkg);
+	Staged = NULL;
+	job_discard(order[i]);
+    }
+    free(order);
+    return err_cnt;
+}
+
+/* Stop any workers, and throw away whatever they have unpacked */
+static void
+jobs_cleanup(void)
+{
+    int i;
+
+    for (i = 0; i < NJobs; i++) {
+	if (JobList[i].pid != -1)
+	    kill(JobList[i].pid, SIGTERM);
+	job_collect(&JobList[i]);
+	job_discard(&JobList[i]);
+    }
+}
+
+/*
+ * Set up for installing a batch of packages: make a directory to keep
+ * all the playpens in, so that they can be removed in one go at the end
+ * rather than one at a time as each package is done with.
+ */
+static void
+batch_begin(void)
+{
+    const char *tmpdir;
+
+    clock_gettime(CLOCK_MONOTONIC, &BatchStart);
+    if (Fake)
+	return;
+
+    if (FirstPen[0] != '\0')
+	return;
+    if ((tmpdir = getenv("PKG_TMPDIR")) == NULL &&
+	(tmpdir = getenv("TMPDIR")) == NULL)
+	tmpdir = "/var/tmp";
+    snprintf(BatchRoot, sizeof(BatchRoot), "%s/pkgbatch.XXXXXX", tmpdir);
+    if (mkdtemp(BatchRoot) == NULL) {
+	warn("%s", BatchRoot);
+	BatchRoot[0] = '\0';
+	return;
+    }
+    snprintf(FirstPen, FILENAME_MAX, "%s/instmp.XXXXXX", BatchRoot);
+    PenRoot = BatchRoot;
+}
+
+/* Tidy up after a batch and say where the time went */
+static void
+batch_end(int npkgs, int failed)
+{
+    struct timespec now;
+    int i;
+
+    batch_phase(PHASE_CLEANUP);
+    if (BatchRoot[0] != '\0') {
+	spawn_cmd(NULL, REMOVE_CMD, "-rf", BatchRoot, NULL);
+	BatchRoot[0] = FirstPen[0] = '\0';
+	PenRoot = NULL;
+    }
+    batch_phase(-1);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("%d of %d package(s) added in %.2fs\n", npkgs - failed, npkgs,
+	(now.tv_sec - BatchStart.tv_sec) +
+	(now.tv_nsec - BatchStart.tv_nsec) / 1e9);
+    for (i = 0; i < PHASE_MAX; i++)
+	printf("    %-10s %8.2fs\n", PhaseNames[i], PhaseTime[i]);
+}
+
+/*
+ * Charge the time since the last call to the phase we were in, and
+ * move on to the next.  Dependencies installed along the way have
+ * their time charged to their own phases.
+ */
+static void
+batch_phase(int next)
+{
+    struct timespec now;
+
+    if (!Batch)
+	return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (Phase >= 0)
+	PhaseTime[Phase] += (now.tv_sec - PhaseStart.tv_sec) +
+	    (now.tv_nsec - PhaseStart.tv_nsec) / 1e9;
+    PhaseStart = now;
+    Phase = next;
+}
+
 static int
 sanity_check(char *pkg)
 {
@@ -700,10 +1280,16 @@ cleanup(int sig)
 	in_cleanup = 1;
     	if (sig)
 	    printf("Signal %d received, cleaning up..\n", sig);
+	/* The packages installed so far are worth keeping track of */
+	if (!Fake)
+	    reqby_commit();
     	if (!Fake && zapLogDir && LogDir[0])
-	    vsystem("%s -rf %s", REMOVE_CMD, LogDir);
+	    spawn_cmd(NULL, REMOVE_CMD, "-rf", LogDir, NULL);
+	jobs_cleanup();
     	while (leave_playpen())
 	    ;
+	if (BatchRoot[0] != '\0')
+	    spawn_cmd(NULL, REMOVE_CMD, "-rf", BatchRoot, NULL);
     }
     if (sig)
 	exit(1);
@@ -0,0 +1,477 @@
+/*
+ * FreeBSD install - a package for the installation and maintenance
+ * of non-core utilities.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * Work out what adding a set of packages would involve, for -n, from
+ * the metadata at the head of each package alone.
+ *
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <err.h>
+#include <libgen.h>
+#include <libutil.h>
+#include "lib.h"
+#include "add.h"
+
+#define PLAN_BUCKETS	256
+
+enum plan_state {
+    PLAN_INSTALL,	/* to be installed, and we know all about it */
+    PLAN_REMOTE,	/* to be fetched, and its head couldn't be */
+    PLAN_INSTALLED,	/* already there */
+    PLAN_MISSING,	/* couldn't be found */
+    PLAN_BAD		/* couldn't be read */
+};
+
+struct plan_pkg {
+    struct plan_pkg *next;	/* in the order they were found */
+    struct plan_pkg *hnext;
+    struct plan_pkg *wanted_by;
+    enum plan_state state;
+    char	*name;
+    char	*origin;
+    char	*path;		/* where it's to come from */
+    char	*installed;	/* what satisfies it, if it's already there */
+    char	*prefix;
+    char	**deps;
+    char	**deporigins;
+    int		ndeps;
+    char	**conflicts;	/* NULL-terminated */
+    off_t	download;
+    off_t	size;
+    int		files;
+    int		execs;
+    Boolean	top;		/* named on the command line */
+    Boolean	seen;
+};
+
+/* A filesystem something is to be written to */
+struct plan_fs {
+    struct plan_fs *next;
+    char	*dir;		/* the first place on it we came across */
+    fsid_t	fsid;
+    off_t	need;
+    off_t	avail;
+};
+
+static struct plan_pkg *Plan, **PlanTail = &Plan;
+static struct plan_pkg *PlanHash[PLAN_BUCKETS];
+static struct plan_fs *PlanFs;
+
+static unsigned int
+plan_hash(const char *name)
+{
+    unsigned int h = 5381;
+
+    while (*name)
+	h = h * 33 + (unsigned char)*name++;
+    return h % PLAN_BUCKETS;
+}
+
+static struct plan_pkg *
+plan_find(const char *name)
+{
+    struct plan_pkg *pp;
+
+    for (pp = PlanHash[plan_hash(name)]; pp != NULL; pp = pp->hnext)
+	if (!strcmp(pp->name, name))
+	    return pp;
+    return NULL;
+}
+
+static void
+plan_name(struct plan_pkg *pp, const char *name)
+{
+    unsigned int h = plan_hash(name);
+
+    pp->name = strdup(name);
+    pp->hnext = PlanHash[h];
+    PlanHash[h] = pp;
+}
+
+static struct plan_pkg *
+plan_new(const char *name, const char *origin, struct plan_pkg *wanted_by)
+{
+    struct plan_pkg *pp;
+
+    if ((pp = calloc(1, sizeof(*pp))) == NULL)
+	err(2, NULL);
+    if (name != NULL)
+	plan_name(pp, name);
+    if (origin != NULL)
+	pp->origin = strdup(origin);
+    pp->wanted_by = wanted_by;
+    pp->download = pp->size = -1;
+    *PlanTail = pp;
+    PlanTail = &pp->next;
+    return pp;
+}
+
+/*
+ * Read what we need to know about a package from its packing list.
+ * Only the start of the package is decompressed, unless the packing
+ * list is too old to record the package's size.  A package given by
+ * URL that isn't in the download cache is read as it is fetched, and
+ * the rest of it is never downloaded, so then an old package's size
+ * is left unknown.
+ */
+static void
+plan_load(struct plan_pkg *pp)
+{
+    struct pkg_meta meta;
+    struct stat sb;
+    Package plist;
+    PackingList p;
+    char local[FILENAME_MAX];
+    const char *file = pp->path;
+    Boolean remote = FALSE;
+    int n;
+
+    pp->state = PLAN_BAD;
+    if (isURL(file)) {
+	pp->download = fileStatURL(file, local);
+	if (local[0] == '\0') {
+	    if (pp->download < 0) {
+		pp->state = PLAN_MISSING;
+		return;
+	    }
+	    remote = TRUE;
+	}
+	else
+	    file = local;
+    }
+    else if (stat(file, &sb) == 0)
+	pp->download = sb.st_size;
+    else if (strcmp(file, "-")) {
+	pp->state = PLAN_MISSING;
+	return;
+    }
+    if (remote ? fileMetaURL(file, &meta) : pkg_meta_load(file, &meta)) {
+	if (remote)
+	    pp->state = PLAN_REMOTE;
+	pkg_meta_free(&meta);
+	return;
+    }
+    memset(&plist, 0, sizeof(plist));
+    if (pkg_meta_plist(&meta, &plist) == SUCCESS) {
+	pp->state = PLAN_INSTALL;
+	if (plist.name != NULL && pp->name == NULL)
+	    plan_name(pp, plist.name);
+	if (plist.origin != NULL && pp->origin == NULL)
+	    pp->origin = strdup(plist.origin);
+	if (Prefix != NULL && (pp->top || PrefixRecursive))
+	    pp->prefix = strdup(Prefix);
+	else if ((p = find_plist(&plist, PLIST_CWD)) != NULL)
+	    pp->prefix = strdup(p->name);
+	if ((pp->size = plist_size(&plist)) < 0 && !remote)
+	    pp->size = unpack_size(file);
+
+	n = 0;
+	for (p = plist.head; p != NULL; p = p->next) {
+	    if (p->type == PLIST_FILE)
+		pp->files++;
+	    else if (p->type == PLIST_CMD)
+		pp->execs++;
+	    else if (p->type == PLIST_PKGDEP)
+		pp->ndeps++;
+	    else if (p->type == PLIST_CONFLICTS)
+		n++;
+	}
+	if ((pp->deps = calloc(pp->ndeps + 1, sizeof(*pp->deps))) == NULL ||
+	    (pp->deporigins = calloc(pp->ndeps + 1,
+	    sizeof(*pp->deporigins))) == NULL ||
+	    (pp->conflicts = calloc(n + 1, sizeof(*pp->conflicts))) == NULL)
+	    err(2, NULL);
+	pp->ndeps = n = 0;
+	for (p = plist.head; p != NULL; p = p->next) {
+	    if (p->type == PLIST_PKGDEP) {
+		pp->deps[pp->ndeps] = strdup(p->name);
+		if (p->next != NULL && p->next->type == PLIST_DEPORIGIN)
+		    pp->deporigins[pp->ndeps] = strdup(p->next->name);
+		pp->ndeps++;
+	    }
+	    else if (p->type == PLIST_CONFLICTS)
+		pp->conflicts[n++] = strdup(p->name);
+	}
+    }
+    free_plist(&plist);
+    pkg_meta_free(&meta);
+}
+
+/* Find a dependency the way pkg_do() would */
+static char *
+plan_locate(const char *base, const char *name)
+{
+    char path[FILENAME_MAX], *cp;
+
+    if (isURL(base) || getenv("PKG_ADD_BASE")) {
+	if (fileComposeURL(base, name, path))
+	    return strdup(path);
+	return NULL;
+    }
+    if ((cp = fileFindByPath(base, name)) != NULL)
+	return strdup(cp);
+    return NULL;
+}
+
+/*
+ * Work through the dependencies of everything in the plan, a round at
+ * a time, until there are no new ones.  In each round, the origins of
+ * all the dependencies that aren't installed under the name asked for
+ * are looked up together, in a single pass over the installed packages.
+ */
+static void
+plan_resolve(struct plan_pkg *round)
+{
+    struct plan_pkg *pp, *dp, *next, **byorigin;
+    const char **origins;
+    char ***matches;
+    int i, n, max;
+
+    while (round != NULL) {
+	next = NULL;
+	max = 0;
+	for (pp = round; pp != NULL; pp = pp->next)
+	    if (pp->state == PLAN_INSTALL)
+		max += pp->ndeps;
+	if ((origins = calloc(max + 1, sizeof(*origins))) == NULL ||
+	    (byorigin = calloc(max + 1, sizeof(*byorigin))) == NULL)
+	    err(2, NULL);
+	n = 0;
+	for (pp = round; pp != NULL && pp != next; pp = pp->next)
+	    for (i = 0; pp->state == PLAN_INSTALL && i < pp->ndeps; i++) {
+		if (plan_find(pp->deps[i]) != NULL)
+		    continue;
+		dp = plan_new(pp->deps[i], pp->deporigins[i], pp);
+		if (next == NULL)
+		    next = dp;
+		if (isinstalledpkg(dp->name) > 0) {
+		    dp->state = PLAN_INSTALLED;
+		    dp->installed = strdup(dp->name);
+		}
+		else if (dp->origin != NULL) {
+		    origins[n] = dp->origin;
+		    byorigin[n++] = dp;
+		}
+	    }
+	if (n > 0 && (matches = matchallbyorigin(origins, NULL)) != NULL)
+	    for (i = 0; i < n; i++)
+		if (matches[i] != NULL && matches[i][0] != NULL) {
+		    byorigin[i]->state = PLAN_INSTALLED;
+		    byorigin[i]->installed = strdup(matches[i][0]);
+		}
+	free(origins);
+	free(byorigin);
+
+	/* Now load whatever is left, for the next round */
+	for (dp = next; dp != NULL; dp = dp->next) {
+	    if (dp->state == PLAN_INSTALLED)
+		continue;
+	    if ((dp->path = plan_locate(dp->wanted_by->path, dp->name)) ==
+		NULL)
+		dp->state = PLAN_MISSING;
+	    else
+		plan_load(dp);
+	}
+	round = next;
+    }
+}
+
+/* Put a package after all the ones it depends on, depth first */
+static void
+plan_visit(struct plan_pkg *pp, struct plan_pkg **order, int *n)
+{
+    struct plan_pkg *dp;
+    int i;
+
+    if (pp->seen)
+	return;
+    pp->seen = TRUE;
+    for (i = 0; i < pp->ndeps; i++)
+	if ((dp = plan_find(pp->deps[i])) != NULL)
+	    plan_visit(dp, order, n);
+    if (pp->state == PLAN_INSTALL || pp->state == PLAN_REMOTE)
+	order[(*n)++] = pp;
+}
+
+/* Note that size bytes are to be written under dir */
+static void
+plan_space(const char *dir, off_t size)
+{
+    struct plan_fs *fs;
+    struct statfs sf;
+    char path[FILENAME_MAX], *cp;
+
+    /* It may not exist yet: look at the nearest directory that does */
+    strlcpy(path, dir, sizeof(path));
+    while (statfs(path, &sf) == FAIL) {
+	if ((cp = strrchr(path, '/')) == NULL)
+	    return;
+	if (cp == path) {
+	    if (path[1] == '\0')
+		return;
+	    path[1] = '\0';
+	}
+	else
+	    *cp = '\0';
+    }
+    for (fs = PlanFs; fs != NULL; fs = fs->next)
+	if (!memcmp(&fs->fsid, &sf.f_fsid, sizeof(fs->fsid)))
+	    break;
+    if (fs == NULL) {
+	if ((fs = calloc(1, sizeof(*fs))) == NULL)
+	    err(2, NULL);
+	fs->dir = strdup(dir);
+	fs->fsid = sf.f_fsid;
+	fs->avail = (off_t)sf.f_bavail * (off_t)sf.f_bsize;
+	fs->next = PlanFs;
+	PlanFs = fs;
+    }
+    fs->need += size;
+}
+
+static const char *
+plan_bytes(off_t n, char *buf, size_t len)
+{
+    if (n < 0)
+	strlcpy(buf, "?", len);
+    else
+	humanize_number(buf, len, n, "B", HN_AUTOSCALE, HN_DECIMAL);
+    return buf;
+}
+
+/*
+ * Print the plan for adding the given packages: the order they would go
+ * in, what each one weighs, what is already installed or can't be found
+ * and how much room it all needs where.  Returns the number of problems
+ * that would stop the packages being added.
+ */
+int
+plan_perform(char **pkgs)
+{
+    struct plan_pkg *pp, **order;
+    struct plan_fs *fs;
+    char dl[8], sz[8], av[8], pen[FILENAME_MAX], **matched;
+    const char *tmpdir;
+    off_t total = 0, penneed = 0;
+    int i, n = 0, problems = 0;
+
+    for (i = 0; pkgs[i] != NULL; i++) {
+	pp = plan_new(NULL, NULL, NULL);
+	pp->top = TRUE;
+	pp->path = strdup(pkgs[i]);
+	plan_load(pp);
+	if (pp->name == NULL)
+	    plan_name(pp, pkgs[i]);
+	if (pp->state == PLAN_INSTALL && !Force &&
+	    (isinstalledpkg(pp->name) > 0 ||
+	    (pp->origin != NULL && matchbyorigin(pp->origin, NULL) != NULL))) {
+	    pp->state = PLAN_INSTALLED;
+	    pp->installed = strdup(pp->name);
+	}
+    }
+    if (!IgnoreDeps)
+	plan_resolve(Plan);
+
+    for (pp = Plan; pp != NULL; pp = pp->next)
+	n++;
+    if ((order = calloc(n, sizeof(*order))) == NULL)
+	err(2, NULL);
+    n = 0;
+    for (pp = Plan; pp != NULL; pp = pp->next)
+	if (pp->top)
+	    plan_visit(pp, order, &n);
+
+    printf("%-32s %9s %9s %7s %6s\n", "Package", "Download", "Size",
+	"Files", "Execs");
+    for (i = 0; i < n; i++) {
+	pp = order[i];
+	printf("%-32s %9s %9s ", pp->name,
+	    plan_bytes(pp->download, dl, sizeof(dl)),
+	    plan_bytes(pp->size, sz, sizeof(sz)));
+	if (pp->state == PLAN_REMOTE)
+	    printf("%7s %6s\n", "?", "?");
+	else
+	    printf("%7d %6d\n", pp->files, pp->execs);
+	if (pp->size > 0) {
+	    total += pp->size;
+	    if (pp->size > penneed)
+		penneed = pp->size;
+	    plan_space(pp->prefix != NULL ? pp->prefix : "/", pp->size);
+	}
+	if (pp->conflicts != NULL && pp->conflicts[0] != NULL &&
+	    (matched = matchinstalled_globs(pp->conflicts, NULL)) != NULL)
+	    for (; *matched != NULL; matched++) {
+		printf("  conflicts with installed package %s\n", *matched);
+		if (!Force)
+		    problems++;
+	    }
+    }
+    printf("%d package(s) to add, %s in all\n", n,
+	plan_bytes(total, sz, sizeof(sz)));
+
+    for (pp = Plan; pp != NULL; pp = pp->next)
+	switch (pp->state) {
+	case PLAN_INSTALLED:
+	    if (pp->top) {
+		printf("%s is already installed\n", pp->name);
+		if (FailOnAlreadyInstalled)
+		    problems++;
+	    }
+	    else if (Verbose)
+		printf("%s, wanted by %s, is already installed as %s\n",
+		    pp->name, pp->wanted_by->name, pp->installed);
+	    break;
+	case PLAN_MISSING:
+	    if (pp->top)
+		printf("%s can't be found\n", pp->name);
+	    else
+		printf("%s, wanted by %s, can't be found\n", pp->name,
+		    pp->wanted_by->name);
+	    if (!Force || pp->top)
+		problems++;
+	    break;
+	case PLAN_BAD:
+	    printf("%s can't be read - not a package?\n", pp->path);
+	    problems++;
+	    break;
+	default:
+	    break;
+	}
+
+    /* The playpens get the packages one at a time, or Jobs at a time */
+    if (FirstPen[0] != '\0') {
+	strlcpy(pen, FirstPen, sizeof(pen));
+	tmpdir = dirname(pen);
+    }
+    else if ((tmpdir = getenv("PKG_TMPDIR")) == NULL &&
+	(tmpdir = getenv("TMPDIR")) == NULL)
+	tmpdir = "/var/tmp";
+    plan_space(tmpdir, penneed * (Jobs > 1 ? Jobs : 1));
+
+    printf("%-32s %9s %9s\n", "Space needed in", "Needed", "Free");
+    for (fs = PlanFs; fs != NULL; fs = fs->next) {
+	printf("%-32s %9s %9s%s\n", fs->dir,
+	    plan_bytes(fs->need, sz, sizeof(sz)),
+	    plan_bytes(fs->avail, av, sizeof(av)),
+	    fs->need > fs->avail ? "  not enough room" : "");
+	if (fs->need > fs->avail)
+	    problems++;
+    }
+    free(order);
+    return problems;
+}
@@ -47,12 +47,13 @@ extern int	Dereference;
 extern int	PlistOnly;
 extern int	Recursive;
 extern int	Regenerate;
+extern int	CksumTypes;
 
 enum zipper {NONE, GZIP, BZIP, BZIP2, XZ };
 extern enum zipper	Zipper;
 
 void		add_cksum(Package *, PackingList, const char *);
-void		check_list(const char *, Package *);
+off_t		check_list(const char *, Package *);
 void		copy_plist(const char *, Package *);
 
 #endif	/* _INST_CREATE_H_INCLUDE */
@@ -43,14 +43,16 @@ int	PlistOnly	= FALSE;
 int	Recursive	= FALSE;
 int	Regenerate	= TRUE;
 int	Help		= FALSE;
+int	CksumTypes	= CKSUM_MD5 | CKSUM_SHA256;
 enum zipper	Zipper  = BZIP2;
 
 
 static void usage(void);
 
-static char opts[] = "EGYNnORhjJvxyzf:p:P:C:c:d:i:I:k:K:r:t:X:D:m:s:S:o:b:";
+static char opts[] = "EGYNnORhjJvxyzf:p:P:C:c:d:i:I:k:K:r:t:X:D:m:s:S:o:b:H:";
 static struct option longopts[] = {
 	{ "backup",	required_argument,	NULL,		'b' },
+	{ "checksum",	required_argument,	NULL,		'H' },
 	{ "extended",	no_argument,		NULL,		'E' },
 	{ "help",	no_argument,		&Help,		TRUE },
 	{ "no",		no_argument,		NULL,		'N' },
@@ -213,6 +215,11 @@ main(int argc, char **argv)
 	    Recursive = TRUE;
 	    break;
 
+	case 'H':
+	    if ((CksumTypes = cksum_parse(optarg)) == 0)
+		errx(1, "unknown checksum type in '%s'", optarg);
+	    break;
+
 	case 'n':
 	    Regenerate = FALSE;
 	    break;
@@ -244,6 +251,8 @@ main(int argc, char **argv)
     }
     if (start[0] == NULL)
 	start[0] = InstalledPkg;
+    /* What we checksum is about to be packed up, not kept */
+    cksum_cache_disable();
     if (!pkg_perform(start)) {
 	if (Verbose)
 	    warnx("package creation failed");
@@ -256,12 +265,13 @@ main(int argc, char **argv)
 static void
 usage(void)
 {
-    fprintf(stderr, "%s\n%s\n%s\n%s\n%s\n%s\n%s\n",
+    fprintf(stderr, "%s\n%s\n%s\n%s\n%s\n%s\n%s\n%s\n",
 "usage: pkg_create [-YNOhjnvyz] [-C conflicts] [-P pkgs] [-p prefix]",
 "                  [-i iscript] [-I piscript] [-k dscript] [-K pdscript]",
 "                  [-r rscript] [-s srcdir] [-S basedir]",
 "                  [-t template] [-X excludefile]",
 "                  [-D displayfile] [-m mtreefile] [-o originpath]",
+"                  [-H checksums]",
 "                  -c comment -d description -f packlist pkg-filename",
 "       pkg_create [-EGYNRhnvxy] -b pkg-name [pkg-filename]");
     exit(1);
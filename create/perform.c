@@ -49,7 +49,9 @@ pkg_perform(char **pkgs)
     char *cp;
     FILE *pkg_in, *fp;
     Package plist;
+    PackingList p, pnext;
     int len;
+    off_t size;
     const char *suf;
 
     /* Preliminary setup */
@@ -256,12 +258,25 @@ pkg_perform(char **pkgs)
     }
 
     /* Make a directory to stomp around in */
-    home = make_playpen(PlayPen, 0);
+    if ((home = make_playpen(PlayPen, 0)) == NULL)
+	errx(2, "%s: unable to make playpen", __func__);
     signal(SIGINT, cleanup);
     signal(SIGHUP, cleanup);
 
     /* Make first "real contents" pass over it */
-    check_list(home, &plist);
+    size = check_list(home, &plist);
+    /* Record the unpacked size, so pkg_add can size its playpen exactly */
+    for (p = plist.head; p != NULL; p = pnext) {
+	/* pkg_create -b is handed a packing list that records one already */
+	pnext = p->next;
+	if (p->type == PLIST_COMMENT &&
+	    !strncmp(p->name, PKG_SIZE_TAG, strlen(PKG_SIZE_TAG)))
+	    delete_plist(&plist, FALSE, PLIST_COMMENT, p->name);
+    }
+    if (asprintf(&cp, "%s%lld", PKG_SIZE_TAG, (long long)size) == -1)
+	errx(2, "%s: asprintf() failed", __func__);
+    add_plist_top(&plist, PLIST_COMMENT, cp);
+    free(cp);
     (void) umask(022);	/*
 			 * Make sure gen'ed directories, files don't have
 			 * group or other write bits.
@@ -479,6 +494,7 @@ make_dist(const char *homedir, const char *pkg, const char *suff, Package *plist
 
     fclose(totar);
     wait(&ret);
+    stat_cache_flush();
     /* assume either signal or bad exit is enough for us */
     if (ret) {
 	cleanup(0);
@@ -25,40 +25,54 @@ __FBSDID("$FreeBSD: stable/10/usr.sbin/pkg_install/create/pl.c 252363 2013-06-29
 #include "create.h"
 #include <errno.h>
 #include <err.h>
-#include <md5.h>
 
-/* Add an MD5 checksum entry for a file or link */
+/*
+ * Add checksum entries for a file or link, one for each type selected
+ * in CksumTypes.  The MD5 entry, if any, goes directly after the file.
+ */
 void
 add_cksum(Package *pkg, PackingList p, const char *fname)
 {
-    char *cp = NULL, buf[33];
+    static const int types[] = { CKSUM_SHA256, CKSUM_MD5, 0 };
+    char *cp, buf[CKSUM_BUFSIZE], lnk[FILENAME_MAX];
+    int i, len = -1;
 
     if (issymlink(fname)) {
-	int len;
-	char lnk[FILENAME_MAX];
-
-	if ((len = readlink(fname, lnk, FILENAME_MAX)) > 0)
-	    cp = MD5Data((unsigned char *)lnk, len, buf);
-    } else if (isfile(fname)) {
-	/* Don't record MD5 checksum for device nodes and such */
-	cp = MD5File(fname, buf);
+	if ((len = readlink(fname, lnk, FILENAME_MAX)) <= 0)
+	    return;
+    } else if (!isfile(fname)) {
+	/* Don't record checksums for device nodes and such */
+	return;
     }
 
-    if (cp != NULL) {
-	PackingList tmp = new_plist_entry();
+    for (i = 0; types[i]; i++) {
+	if (!(CksumTypes & types[i]))
+	    continue;
+	if (len > 0)
+	    cp = cksum_data(types[i], lnk, len, buf);
+	else
+	    cp = cksum_file(types[i], fname, buf);
+	if (cp != NULL) {
+	    PackingList tmp = new_plist_entry();
 
-	tmp->name = copy_string(strconcat("MD5:", cp));
-	tmp->type = PLIST_COMMENT;
-	tmp->next = p->next;
-	tmp->prev = p;
-	p->next = tmp;
-	if (pkg->tail == p)
-	    pkg->tail = tmp;
+	    tmp->name = copy_string(strconcat(cksum_tag(types[i]), cp));
+	    tmp->type = PLIST_COMMENT;
+	    tmp->next = p->next;
+	    tmp->prev = p;
+	    if (p->next)
+		p->next->prev = tmp;
+	    p->next = tmp;
+	    if (pkg->tail == p)
+		pkg->tail = tmp;
+	}
     }
 }
 
-/* Check a list for files that require preconversion */
-void
+/*
+ * Check a list for files that require preconversion, and return the
+ * total size of the files in it.
+ */
+off_t
 check_list(const char *home, Package *pkg)
 {
     const char *where = home;
@@ -66,6 +80,8 @@ check_list(const char *home, Package *pkg)
     char name[FILENAME_MAX];
     char *prefix = NULL;
     PackingList p;
+    struct stat sb;
+    off_t size = 0;
 
     for (p = pkg->head; p != NULL; p = p->next)
 	switch (p->type) {
@@ -90,11 +106,14 @@ check_list(const char *home, Package *pkg)
 		snprintf(name, sizeof(name), "%s%s/%s",
 		    BaseDir && where && where[0] == '/' ? BaseDir : "", where, p->name);
 
+	    if (cached_lstat(name, &sb) == 0 && S_ISREG(sb.st_mode))
+		size += sb.st_size;
 	    add_cksum(pkg, p, name);
 	    break;
 	default:
 	    break;
 	}
+    return size;
 }
 
 static int
@@ -104,10 +123,11 @@ trylink(const char *from, const char *to)
 	return 0;
     if (errno == ENOENT) {
 	/* try making the container directory */
-	char *cp = strrchr(to, '/');
-	if (cp)
-	    vsystem("/bin/mkdir -p %.*s", cp - to,
-		    to);
+	char dir[FILENAME_MAX], *cp = strrchr(to, '/');
+	if (cp) {
+	    snprintf(dir, sizeof(dir), "%.*s", (int)(cp - to), to);
+	    spawn_cmd(NULL, "/bin/mkdir", "-p", dir, NULL);
+	}
 	return link(from, to);
     }
     return -1;
@@ -122,6 +142,7 @@ trylink(const char *from, const char *to)
 			cleanup(0); \
 			errx(2, "%s: can't invoke tar pipeline", __func__); \
 		    } \
+		    stat_cache_flush(); \
 		    memset(where_args, 0, maxargs); \
  		    last_chdir = NULL; \
 		    strcpy(where_args, STARTSTRING); \
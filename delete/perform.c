@@ -27,7 +27,6 @@ __FBSDID("$FreeBSD: stable/10/usr.sbin/pkg_install/delete/perform.c 228990 2011-
 
 static int pkg_do(char *);
 static void sanity_check(char *);
-static void undepend(char *, char *);
 static char LogDir[FILENAME_MAX];
 
 struct pkgdb *db;
@@ -41,6 +40,8 @@ pkg_perform(char **pkgs)
     struct reqr_by_entry *rb_entry;
     struct reqr_by_head *rb_list;
 
+    if (!Fake)
+	lock_log_dir();
     if (MatchType != LEGACY_MATCH_EXACT) {
 	matched = matchinstalled(MatchType, pkgs, &errcode);
 	if (errcode != 0)
@@ -113,6 +114,8 @@ pkg_perform(char **pkgs)
 	err_cnt += pkg_do(pkgs[i]);
     }
 
+    /* Write out all the changes to +REQUIRED_BY files at once */
+    reqby_commit();
     return err_cnt;
 }
 
@@ -157,7 +160,7 @@ pkg_do(char *pkg)
 	if (!Force)
 	    return 1;
     	if (!Fake) {
-	    if (vsystem("%s -rf %s", REMOVE_CMD, LogDir)) {
+	    if (spawn_cmd(NULL, REMOVE_CMD, "-rf", LogDir, NULL)) {
     		warnx("couldn't remove log entry in %s, deinstall failed", LogDir);
 	    } else {
     		warnx("couldn't completely deinstall package '%s',\n"
@@ -290,7 +293,7 @@ pkg_do(char *pkg)
 		depnames[dep_count] = p->name;
 		dep_count++;
 	    } else {
-		undepend(p->name, pkg);
+		reqby_remove(p->name, pkg);
 	    }
 	}
     }
@@ -305,9 +308,9 @@ pkg_do(char *pkg)
 		    char **tmp = depmatches[i];
 		    int j;
 		    for (j = 0; tmp[j] != NULL; j++)
-			undepend(tmp[j], pkg);
+			reqby_remove(tmp[j], pkg);
 		} else if (depnames[i]) {
-		    undepend(depnames[i], pkg);
+		    reqby_remove(depnames[i], pkg);
 		}
 	    }
 	}
@@ -355,7 +358,7 @@ pkg_do(char *pkg)
     }
 
     if (!Fake) {
-	if (vsystem("%s -r%c %s", REMOVE_CMD, Force ? 'f' : ' ', LogDir)) {
+	if (spawn_cmd(NULL, REMOVE_CMD, Force ? "-rf" : "-r", LogDir, NULL)) {
 	    warnx("couldn't remove log entry in %s, deinstall failed", LogDir);
 	    if (!Force)
 		return 1;
@@ -377,50 +380,8 @@ sanity_check(char *pkg)
 void
 cleanup(int sig)
 {
+    if (!Fake)
+	reqby_commit();
     if (sig)
 	exit(1);
 }
-
-static void
-undepend(char *p, char *pkgname)
-{
-    char fname[FILENAME_MAX], ftmp[FILENAME_MAX];
-    FILE *fpwr;
-    int s;
-    struct reqr_by_entry *rb_entry;
-    struct reqr_by_head *rb_list;
-
-
-    if (requiredby(p, &rb_list, Verbose, FALSE) <= 0)
-	return;
-    snprintf(fname, sizeof(fname), "%s/%s/%s", LOG_DIR, p, REQUIRED_BY_FNAME);
-    snprintf(ftmp, sizeof(ftmp), "%s.XXXXXX", fname);
-    s = mkstemp(ftmp);
-    if (s == -1) {
-	warnx("couldn't open temp file '%s'", ftmp);
-	return;
-    }
-    fpwr = fdopen(s, "w");
-    if (fpwr == NULL) {
-	close(s);
-	warnx("couldn't fdopen temp file '%s'", ftmp);
-	goto cleanexit;
-    }
-    STAILQ_FOREACH(rb_entry, rb_list, link)
-	if (strcmp(rb_entry->pkgname, pkgname))		/* no match */
-	    fputs(rb_entry->pkgname, fpwr), putc('\n', fpwr);
-    if (fchmod(s, 0644) == FAIL) {
-	warnx("error changing permission of temp file '%s'", ftmp);
-	fclose(fpwr);
-	goto cleanexit;
-    }
-    if (fclose(fpwr) == EOF) {
-	warnx("error closing temp file '%s'", ftmp);
-	goto cleanexit;
-    }
-    if (rename(ftmp, fname) == -1)
-	warnx("error renaming '%s' to '%s'", ftmp, fname);
-cleanexit:
-    remove(ftmp);
-    return;
-}
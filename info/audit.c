@@ -0,0 +1,279 @@
+/*
+ * FreeBSD install - a package for the installation and maintenance
+ * of non-core utilities.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * Check the files of many installed packages against their recorded
+ * checksums, spreading the work over a pool of threads.
+ *
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "lib.h"
+#include "info.h"
+#include <err.h>
+#include <pthread.h>
+
+#define AUDIT_QUEUE	256	/* files waiting for a worker, at most */
+#define AUDIT_PROGRESS	64	/* files between progress updates */
+
+#define AUDIT_MISSING	2	/* in addition to the cksum_verify() results */
+
+/*
+ * An installed package being audited.  It stays around until the last
+ * of its files has been checked, so at most AUDIT_QUEUE packing lists
+ * are ever held in memory.
+ */
+struct audit_pkg {
+    const char	*name;
+    Package	plist;
+    struct cksum_ent *ents;
+    int		nents;
+    int		refs;		/* queued files, plus one while loading */
+    int		files;
+    int		missing;
+    int		failed;
+};
+
+struct audit_job {
+    struct audit_pkg	*ap;
+    struct cksum_ent	*e;
+};
+
+/* Everything below is protected by Lock */
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t NotEmpty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t NotFull = PTHREAD_COND_INITIALIZER;
+static struct audit_job Queue[AUDIT_QUEUE];
+static int QHead, QCount;
+static Boolean QDone;
+static int NPkgs, PkgsDone, Errors;
+static uintmax_t FilesDone;
+static Boolean Progress;
+static int ProgressLen;
+
+static void
+audit_progress_clear(void)
+{
+    if (ProgressLen) {
+	fprintf(stderr, "\r%*s\r", ProgressLen, "");
+	ProgressLen = 0;
+    }
+}
+
+static void
+audit_progress(void)
+{
+    if (Progress)
+	ProgressLen = fprintf(stderr, "\rAudited %d of %d packages, %ju files",
+	    PkgsDone, NPkgs, FilesDone) - 1;
+}
+
+/* Report the outcome of checking a single file */
+static void
+audit_result(struct audit_job *job, int result, int type)
+{
+    struct audit_pkg *ap = job->ap;
+
+    ap->files++;
+    FilesDone++;
+    if (result == 0 && !Verbose) {
+	if (FilesDone % AUDIT_PROGRESS == 0)
+	    audit_progress();
+	return;
+    }
+    if (result == AUDIT_MISSING)
+	ap->missing++;
+    else if (result == 1)
+	ap->failed++;
+    else if (result != 0)
+	return;
+    audit_progress_clear();
+    if (MachineReadable) {
+	if (result == AUDIT_MISSING)
+	    printf("missing\t%s\t%s\n", ap->name, job->e->path);
+	else
+	    printf("%s\t%s\t%s\t%s\n", result ? "failed" : "ok", ap->name,
+		job->e->path, cksum_name(type));
+    }
+    else if (result == AUDIT_MISSING)
+	printf("%s: %s doesn't exist\n", ap->name, job->e->path);
+    else
+	printf("%s: %s %s the original %s checksum\n", ap->name,
+	    job->e->path, result ? "fails" : "matched", cksum_name(type));
+    fflush(stdout);
+    audit_progress();
+}
+
+/* Drop a reference to a package, reporting on it once it's done */
+static void
+audit_release(struct audit_pkg *ap)
+{
+    if (--ap->refs > 0)
+	return;
+    audit_progress_clear();
+    if (MachineReadable)
+	printf("package\t%s\t%d\t%d\t%d\n", ap->name, ap->files, ap->missing,
+	    ap->failed);
+    else if (ap->missing || ap->failed || Verbose)
+	printf("%s: %d files checked, %d missing, %d failed checksum\n",
+	    ap->name, ap->files, ap->missing, ap->failed);
+    fflush(stdout);
+    if (ap->missing || ap->failed)
+	Errors++;
+    PkgsDone++;
+    audit_progress();
+    cksum_free(ap->ents, ap->nents);
+    free_plist(&ap->plist);
+    free(ap);
+}
+
+static void *
+audit_worker(void *arg __unused)
+{
+    struct audit_job job;
+    int result, type;
+
+    for (;;) {
+	pthread_mutex_lock(&Lock);
+	while (QCount == 0 && !QDone)
+	    pthread_cond_wait(&NotEmpty, &Lock);
+	if (QCount == 0) {
+	    pthread_mutex_unlock(&Lock);
+	    break;
+	}
+	job = Queue[QHead];
+	QHead = (QHead + 1) % AUDIT_QUEUE;
+	QCount--;
+	pthread_cond_signal(&NotFull);
+	pthread_mutex_unlock(&Lock);
+
+	/* The packing list is not modified until every file is checked */
+	type = job.e->type;
+	if (!CKSUM_PRESENT(job.e))
+	    result = AUDIT_MISSING;
+	else
+	    result = cksum_verify(&job.ap->plist, job.e->p, job.e->path,
+		NULL);
+
+	pthread_mutex_lock(&Lock);
+	audit_result(&job, result, type);
+	audit_release(job.ap);
+	pthread_mutex_unlock(&Lock);
+    }
+    return NULL;
+}
+
+/* Hand a file over to the workers, waiting for room in the queue */
+static void
+audit_queue(struct audit_pkg *ap, struct cksum_ent *e)
+{
+    struct audit_job *job;
+
+    pthread_mutex_lock(&Lock);
+    while (QCount == AUDIT_QUEUE)
+	pthread_cond_wait(&NotFull, &Lock);
+    job = &Queue[(QHead + QCount) % AUDIT_QUEUE];
+    job->ap = ap;
+    job->e = e;
+    QCount++;
+    ap->refs++;
+    pthread_cond_signal(&NotEmpty);
+    pthread_mutex_unlock(&Lock);
+}
+
+/*
+ * Load an installed package and queue up all of its files in disk
+ * order.  Read-ahead is requested for each file as it is queued, so
+ * the disk is kept busy up to AUDIT_QUEUE files ahead of the workers.
+ */
+static void
+audit_load(const char *pkg)
+{
+    struct audit_pkg *ap;
+    struct cksum_ent **order;
+    char fname[FILENAME_MAX];
+    FILE *fp;
+    int i;
+
+    snprintf(fname, FILENAME_MAX, "%s/%s/%s", LOG_DIR, pkg, CONTENTS_FNAME);
+    if ((fp = fopen(fname, "r")) == NULL) {
+	warn("%s", fname);
+	pthread_mutex_lock(&Lock);
+	Errors++;
+	PkgsDone++;
+	pthread_mutex_unlock(&Lock);
+	return;
+    }
+    if ((ap = calloc(1, sizeof(*ap))) == NULL)
+	err(2, NULL);
+    ap->name = pkg;
+    ap->refs = 1;
+    read_plist(&ap->plist, fp);
+    fclose(fp);
+
+    ap->nents = cksum_gather(&ap->plist, &ap->ents);
+    order = cksum_order(ap->ents, ap->nents);
+    for (i = 0; i < ap->nents; i++) {
+	cksum_prefetch(order[i]);
+	audit_queue(ap, order[i]);
+    }
+    free(order);
+
+    pthread_mutex_lock(&Lock);
+    audit_release(ap);
+    pthread_mutex_unlock(&Lock);
+}
+
+/*
+ * Verify every file of the given installed packages.  Returns the
+ * number of packages with missing or modified files.
+ */
+int
+audit_packages(char **pkgs)
+{
+    pthread_t *workers;
+    long jobs;
+    int i, error;
+
+    for (NPkgs = 0; pkgs[NPkgs] != NULL; NPkgs++)
+	;
+    if ((jobs = AuditJobs) <= 0 &&
+	(jobs = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+	jobs = 1;
+    Progress = !Quiet && !MachineReadable && isatty(STDERR_FILENO);
+
+    if ((workers = calloc(jobs, sizeof(*workers))) == NULL)
+	err(2, NULL);
+    for (i = 0; i < jobs; i++)
+	if ((error = pthread_create(&workers[i], NULL, audit_worker,
+	    NULL)) != 0)
+	    errc(2, error, "pthread_create");
+
+    for (i = 0; pkgs[i] != NULL; i++)
+	audit_load(pkgs[i]);
+
+    pthread_mutex_lock(&Lock);
+    QDone = TRUE;
+    pthread_cond_broadcast(&NotEmpty);
+    pthread_mutex_unlock(&Lock);
+    for (i = 0; i < jobs; i++)
+	pthread_join(workers[i], NULL);
+    free(workers);
+
+    audit_progress_clear();
+    if (!Quiet && !MachineReadable)
+	printf("%d of %d packages failed the audit (%ju files checked)\n",
+	    Errors, NPkgs, FilesDone);
+    return Errors;
+}
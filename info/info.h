@@ -65,6 +65,10 @@ extern int Flags;
 extern Boolean QUIET;
 extern Boolean UseBlkSz;
 extern Boolean KeepPackage;
+extern Boolean Audit;
+extern Boolean MachineReadable;
+extern int AuditJobs;
+extern Boolean Serve;
 extern char *InfoPrefix;
 extern char *CheckPkg;
 extern char *LookUpOrigin;
@@ -73,5 +77,9 @@ extern struct which_head *whead;
 
 extern void	show_file(const char *, const char *);
 extern int	show_cksum(const char *, Package *);
+extern int	audit_packages(char **);
+extern char	*abspath(const char *);
+extern int	service_run(void);
+extern void	service_cleanup(void);
 
 #endif	/* _INST_INFO_H_INCLUDE */
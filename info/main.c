@@ -36,23 +36,31 @@ char *InfoPrefix	= (char *)(uintptr_t)"";
 char *CheckPkg		= NULL;
 char *LookUpOrigin	= NULL;
 Boolean KeepPackage	= FALSE;
+Boolean Audit		= FALSE;
+Boolean MachineReadable	= FALSE;
+int AuditJobs		= 0;
+Boolean Serve		= FALSE;
 struct which_head *whead;
 
 static void usage(void);
 
-static char opts[] = "abcdDe:EfgGhiIjkKl:LmoO:pPqQrRst:vVW:xX";
+static char opts[] = "aAbcdDe:EfgGhiIjJ:kKl:LmMoO:pPqQrRsSt:vVW:xX";
 static struct option longopts[] = {
 	{ "all",	no_argument,		NULL,		'a' },
+	{ "audit",	no_argument,		NULL,		'A' },
 	{ "blocksize",	no_argument,		NULL,		'b' },
 	{ "exist",	required_argument,	NULL,		'X' },
 	{ "exists",	required_argument,	NULL,		'X' },
 	{ "extended",	no_argument,		NULL,		'e' },
 	{ "help",	no_argument,		NULL,		'h' },
+	{ "jobs",	required_argument,	NULL,		'J' },
 	{ "keep",	no_argument,		NULL,		'K' },
+	{ "machine",	no_argument,		NULL,		'M' },
 	{ "no-glob",	no_argument,		NULL,		'G' },
 	{ "origin",	required_argument,	NULL,		'O' },
 	{ "quiet",	no_argument,		NULL,		'q' },
 	{ "regex",	no_argument,		NULL,		'x' },
+	{ "serve",	no_argument,		NULL,		'S' },
 	{ "template",	required_argument,	NULL,		't' },
 	{ "verbose",	no_argument,		NULL,		'v' },
 	{ "version",	no_argument,		NULL,		'P' },
@@ -66,6 +74,7 @@ main(int argc, char **argv)
     int ch;
     char **pkgs, **start;
     char *pkgs_split;
+    const char *errstr;
 
     whead = malloc(sizeof(struct which_head));
     if (whead == NULL)
@@ -83,6 +92,10 @@ main(int argc, char **argv)
 	    MatchType = LEGACY_MATCH_ALL;
 	    break;
 
+	case 'A':
+	    Audit = TRUE;
+	    break;
+
 	case 'b':
 	    UseBlkSz = TRUE;
 	    break;
@@ -138,6 +151,12 @@ main(int argc, char **argv)
 	    Flags |= SHOW_REQUIRE;
 	    break;
 
+	case 'J':
+	    AuditJobs = strtonum(optarg, 1, 1024, &errstr);
+	    if (errstr != NULL)
+		errx(1, "number of jobs is %s: %s", errstr, optarg);
+	    break;
+
 	case 'k':
 	    Flags |= SHOW_DEINSTALL;
 	    break;
@@ -162,10 +181,18 @@ main(int argc, char **argv)
 	    Flags |= SHOW_MTREE;
 	    break;
 
+	case 'M':
+	    MachineReadable = TRUE;
+	    break;
+
 	case 's':
 	    Flags |= SHOW_SIZE;
 	    break;
 
+	case 'S':
+	    Serve = TRUE;
+	    break;
+
 	case 'o':
 	    Flags |= SHOW_ORIGIN;
 	    break;
@@ -272,9 +299,13 @@ main(int argc, char **argv)
 	*pkgs++ = *argv++;
     }
 
+    /* Audit everything unless told otherwise */
+    if (Audit && pkgs == start)
+	MatchType = LEGACY_MATCH_ALL;
+
     /* If no packages, yelp */
     if (pkgs == start && MatchType != LEGACY_MATCH_ALL && !CheckPkg && 
-	TAILQ_EMPTY(whead) && LookUpOrigin == NULL)
+	TAILQ_EMPTY(whead) && LookUpOrigin == NULL && !Serve)
 	warnx("missing package name(s)"), usage();
     *pkgs = NULL;
     return pkg_perform(start);
@@ -283,11 +314,13 @@ main(int argc, char **argv)
 static void
 usage(void)
 {
-    fprintf(stderr, "%s\n%s\n%s\n%s\n%s\n",
+    fprintf(stderr, "%s\n%s\n%s\n%s\n%s\n%s\n%s\n",
 	"usage: pkg_info [-bcdDEfgGiIjkKLmopPqQrRsvVxX] [-e package] [-l prefix]",
 	"                [-t template] -a | pkg-name ...",
+	"       pkg_info -A [-MqvxX] [-J jobs] [pkg-name ...]",
 	"       pkg_info [-qQ] -W filename",
 	"       pkg_info [-qQ] -O origin",
+	"       pkg_info -S [-v]",
 	"       pkg_info");
     exit(1);
 }
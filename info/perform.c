@@ -28,9 +28,10 @@ __FBSDID("$FreeBSD: stable/10/usr.sbin/pkg_install/info/perform.c 240682 2012-09
 #include <pkg.h>
 
 static int pkg_do(char *);
+static void open_db(void);
 static int find_pkg(struct which_head *);
+static void which_claim(struct which_entry *, const char *);
 static int cmp_path(const char *, const char *, const char *);
-static char *abspath(const char *);
 static int find_pkgs_by_origin(const char *);
 static int matched_packages(char **pkgs);
 struct pkgdb *db;
@@ -43,17 +44,19 @@ pkg_perform(char **pkgs)
     int i, errcode;
 
     signal(SIGINT, cleanup);
-    if (pkg_init(NULL, NULL))
-	errx(1, "Cannot parse configuration file");
-
-    db = NULL;
-    if (pkgdb_open(&db, PKGDB_DEFAULT) != EPKG_OK)
-	errx(1, "Enable to open pkgdb");
+    if (Serve) {
+	open_db();
+	return service_run();
+    }
 
     /* Overriding action? */
     if (Flags & SHOW_PKGNAME) {
+	open_db();
 	return matched_packages(pkgs);
     } else if (CheckPkg) {
+	if ((errcode = service_query("exists", CheckPkg, NULL)) != -1)
+	    return errcode;
+	open_db();
 	return isinstalledpkg(CheckPkg) > 0 ? 0 : 1;
 	/* Not reached */
     } else if (!TAILQ_EMPTY(whead)) {
@@ -62,6 +65,7 @@ pkg_perform(char **pkgs)
 	return find_pkgs_by_origin(LookUpOrigin);
     }
 
+    open_db();
     if (MatchType != LEGACY_MATCH_EXACT) {
 	matched = matchinstalled(MatchType, pkgs, &errcode);
 	if (errcode != 0)
@@ -87,7 +91,9 @@ pkg_perform(char **pkgs)
 	}
     }
 
-    for (i = 0; pkgs[i]; i++)
+    if (Audit)
+	err_cnt = audit_packages(pkgs);
+    else for (i = 0; pkgs[i]; i++)
 	err_cnt += pkg_do(pkgs[i]);
 
     pkgdb_close(db);
@@ -95,6 +101,21 @@ pkg_perform(char **pkgs)
     return err_cnt;
 }
 
+/*
+ * Open the package database, the first time it is needed.  Questions
+ * the query service answers never need it.
+ */
+static void
+open_db(void)
+{
+    if (db != NULL)
+	return;
+    if (pkg_init(NULL, NULL))
+	errx(1, "Cannot parse configuration file");
+    if (pkgdb_open(&db, PKGDB_DEFAULT) != EPKG_OK)
+	errx(1, "Enable to open pkgdb");
+}
+
 static int
 pkg_do(char *pkg)
 {
@@ -236,8 +257,22 @@ pkg_do(char *pkg)
 		printf("%sPackage SIze;\n", InfoPrefix);
 	    pkg_printf("%s\n", p);
 	}
-	if ((Flags & SHOW_CKSUM) && installed)
-	    code += show_cksum("Mismatched Checksums:\n", &plist);
+	if ((Flags & SHOW_CKSUM) && installed) {
+	    FILE *fp;
+
+	    snprintf(fname, FILENAME_MAX, "%s/%s/%s", LOG_DIR, pkg,
+		CONTENTS_FNAME);
+	    if ((fp = fopen(fname, "r")) == NULL) {
+		warn("%s", fname);
+		code++;
+	    } else {
+		plist.head = plist.tail = NULL;
+		read_plist(&plist, fp);
+		fclose(fp);
+		code += show_cksum("Mismatched Checksums:\n", &plist);
+		free_plist(&plist);
+	    }
+	}
 	if (Flags & SHOW_ORIGIN) {
 	    if (!Quiet)
 	       printf("%sOrigin:\n", InfoPrefix);
@@ -264,6 +299,7 @@ cleanup(int sig)
 
     if (!in_cleanup) {
 	in_cleanup = 1;
+	service_cleanup();
     }
     if (sig)
 	exit(1);
@@ -274,7 +310,7 @@ cleanup(int sig)
  * /'s, as realpath() would, but without resolving symlinks, because that can
  * potentially screw up our comparisons later.
  */
-static char *
+char *
 abspath(const char *pathname)
 {
     char *tmp, *tmp1, *resolved_path;
@@ -343,6 +379,18 @@ cmp_path(const char *target, const char *current, const char *cwd)
     return rval;
 }
 
+/* Record that pkg installed the file wp is looking for */
+static void
+which_claim(struct which_entry *wp, const char *pkg)
+{
+    if (wp->package[0] != '\0') {
+	warnx("both %s and %s claim to have installed %s\n",
+	      wp->package, pkg, wp->file);
+    } else {
+	strlcpy(wp->package, pkg, PATH_MAX);
+    }
+}
+
 /* 
  * Look through package dbs in LOG_DIR and find which
  * packages installed the files in which_list.
@@ -350,7 +398,7 @@ cmp_path(const char *target, const char *current, const char *cwd)
 static int 
 find_pkg(struct which_head *which_list)
 {
-    char **installed;
+    char **installed, **matched;
     int errcode, i;
     struct which_entry *wp;
 
@@ -362,11 +410,16 @@ find_pkg(struct which_head *which_list)
 	/* If it's not a file, we'll see if it's an executable. */
 	if (isfile(wp->file) == FALSE) {
 	    if (strchr(wp->file, '/') == NULL) {
-		tmp = vpipe("/usr/bin/which %s", wp->file);
-		if (tmp != NULL) {
-		    strlcpy(wp->file, tmp, PATH_MAX);
+		struct spawn_opts so;
+		char path[PATH_MAX];
+
+		memset(&so, 0, sizeof(so));
+		so.out = path;
+		so.outlen = sizeof(path);
+		if (spawn_cmd(&so, "/usr/bin/which", wp->file, NULL) == 0 &&
+		    *path != '\0') {
+		    strlcpy(wp->file, path, PATH_MAX);
 		    wp->skip = FALSE;
-		    free(tmp);
 		} else
 		    msg = "file is not in PATH";
 	    }
@@ -382,6 +435,21 @@ find_pkg(struct which_head *which_list)
 	    warnx("%s: %s", wp->file, msg);
     }
 
+    /* A running query service has the files of every package to hand */
+    TAILQ_FOREACH(wp, which_list, next) {
+	if (wp->skip == TRUE)
+	    continue;
+	if (service_query("which", wp->file, &matched) == -1)
+	    break;
+	for (i = 0; matched != NULL && matched[i] != NULL; i++)
+	    which_claim(wp, matched[i]);
+    }
+    if (wp == NULL)
+	goto report;
+    TAILQ_FOREACH(wp, which_list, next)
+	wp->package[0] = '\0';
+
+    open_db();
     installed = matchinstalled(LEGACY_MATCH_ALL, NULL, &errcode);
     if (installed == NULL)
         return errcode;
@@ -413,18 +481,14 @@ find_pkg(struct which_head *which_list)
 			continue;
 		    if (!cmp_path(wp->file, itr->name, cwd))
 			continue;
-		    if (wp->package[0] != '\0') {
-			warnx("both %s and %s claim to have installed %s\n",
-			      wp->package, installed[i], wp->file);
-		    } else {
-			strlcpy(wp->package, installed[i], PATH_MAX);
-		    }
+		    which_claim(wp, installed[i]);
 		}
 	    }
 	}
 	free_plist(&pkg);
     }
 
+ report:
     TAILQ_FOREACH(wp, which_list, next) {
 	if (wp->package[0] != '\0') {
 	    if (Quiet)
@@ -460,7 +524,10 @@ find_pkgs_by_origin(const char *origin)
     if (!Quiet)
 	printf("The following installed package(s) has %s origin:\n", origin);
 
-    matched = matchbyorigin(origin, &errcode);
+    if ((errcode = service_query("origin", origin, &matched)) == -1) {
+	open_db();
+	matched = matchbyorigin(origin, &errcode);
+    }
     if (matched == NULL)
 	return errcode;
 
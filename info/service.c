@@ -0,0 +1,478 @@
+/*
+ * FreeBSD install - a package for the installation and maintenance
+ * of non-core utilities.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * The query service: answer questions about the installed packages over
+ * a local socket, from indexes of their names, origins and files that
+ * are kept in memory until the package database changes.
+ *
+ * A question is a single line, "verb argument", and the answer is a line
+ * giving the exit status and the number of packages named, followed by
+ * the package names one per line.  The verbs are:
+ *
+ *	exists pkg-name		is the package installed (as pkg_info -e)
+ *	list			the names of all the installed packages
+ *	origin origin		the packages with the given origin (as -O)
+ *	which file		the packages that installed the file (as -W)
+ *
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "lib.h"
+#include "info.h"
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#define SERVICE_BUCKETS	65536
+#define SERVICE_BACKLOG	64
+#define SERVICE_CLIENTS	64	/* clients being served at once */
+#define SERVICE_TIMEOUT	5	/* seconds a client has to ask and listen */
+
+/* An installed package and its origin */
+struct svc_pkg {
+    const char *name;
+    char *origin;
+    struct stat sb;		/* of its +CONTENTS when it was read */
+};
+
+/* A client, and the question it is asking or the answer it is getting */
+struct svc_client {
+    int fd;
+    time_t deadline;
+    size_t len;
+    char *out;
+    size_t outlen, outoff;
+    char req[PATH_MAX + 16];
+};
+
+/* What is watched in LOG_DIR for changes to the package database */
+static const char *DbFiles[] = { "", "/local.sqlite", "/local.sqlite-wal" };
+#define NDBFILES	(sizeof(DbFiles) / sizeof(DbFiles[0]))
+
+/* A file and the package that installed it */
+struct svc_file {
+    struct svc_file *next;
+    const char *pkg;
+    char path[1];
+};
+
+static struct svc_pkg *Pkgs;
+static int NPkgs;
+static struct svc_file **Files;
+static Boolean Loaded;
+static struct stat DbStat[NDBFILES];
+static char *Socket;
+static struct svc_client Clients[SERVICE_CLIENTS];
+
+static unsigned int
+service_hash(const char *path)
+{
+    unsigned int h = 5381;
+
+    while (*path)
+	h = h * 33 + (unsigned char)*path++;
+    return h % SERVICE_BUCKETS;
+}
+
+static void
+service_add_file(const char *path, const char *pkg)
+{
+    struct svc_file *f;
+    unsigned int h = service_hash(path);
+    size_t len = strlen(path);
+
+    if ((f = malloc(sizeof(*f) + len)) == NULL)
+	err(2, NULL);
+    memcpy(f->path, path, len + 1);
+    f->pkg = pkg;
+    f->next = Files[h];
+    Files[h] = f;
+}
+
+/*
+ * Read the packing list of every installed package, the first time an
+ * origin or a file is asked about, and index them.
+ */
+static void
+service_load(void)
+{
+    char **installed, fname[FILENAME_MAX], *tmp, *path;
+    const char *cwd;
+    Package plist;
+    PackingList p;
+    FILE *fp;
+    int i;
+
+    if (Loaded)
+	return;
+    Loaded = TRUE;
+    if ((installed = installed_names()) == NULL)
+	return;
+    for (NPkgs = 0; installed[NPkgs] != NULL; NPkgs++)
+	;
+    if ((Pkgs = calloc(NPkgs, sizeof(*Pkgs))) == NULL ||
+	(Files = calloc(SERVICE_BUCKETS, sizeof(*Files))) == NULL)
+	err(2, NULL);
+
+    for (i = 0; i < NPkgs; i++) {
+	Pkgs[i].name = installed[i];
+	snprintf(fname, FILENAME_MAX, "%s/%s/%s", LOG_DIR, installed[i],
+	    CONTENTS_FNAME);
+	/* There may be none yet, in the middle of an installation */
+	if ((fp = fopen(fname, "r")) == NULL)
+	    continue;
+	if (fstat(fileno(fp), &Pkgs[i].sb) == FAIL)
+	    memset(&Pkgs[i].sb, 0, sizeof(Pkgs[i].sb));
+	plist.head = plist.tail = NULL;
+	read_plist(&plist, fp);
+	fclose(fp);
+
+	cwd = NULL;
+	for (p = plist.head; p != NULL; p = p->next) {
+	    if (p->type == PLIST_CWD)
+		cwd = p->name;
+	    else if (p->type == PLIST_ORIGIN && Pkgs[i].origin == NULL) {
+		if ((Pkgs[i].origin = strdup(p->name)) == NULL)
+		    err(2, NULL);
+	    }
+	    else if (p->type == PLIST_FILE && cwd != NULL) {
+		if (asprintf(&tmp, "%s/%s", cwd, p->name) == -1)
+		    err(2, NULL);
+		path = abspath(tmp);
+		service_add_file(path, installed[i]);
+		free(path);
+		free(tmp);
+	    }
+	}
+	free_plist(&plist);
+    }
+    if (Verbose)
+	printf("Indexed %d installed packages\n", NPkgs);
+}
+
+/* Throw the indexes away, to be read again when next needed */
+static void
+service_flush(void)
+{
+    struct svc_file *f;
+    int i;
+
+    if (Files != NULL) {
+	for (i = 0; i < SERVICE_BUCKETS; i++)
+	    while ((f = Files[i]) != NULL) {
+		Files[i] = f->next;
+		free(f);
+	    }
+	free(Files);
+	Files = NULL;
+    }
+    for (i = 0; i < NPkgs; i++)
+	free(Pkgs[i].origin);
+    free(Pkgs);
+    Pkgs = NULL;
+    NPkgs = 0;
+    Loaded = FALSE;
+    installed_flush();
+}
+
+/* Has the file changed since sb was taken of it? */
+static Boolean
+service_changed(const char *path, struct stat *sb)
+{
+    struct stat now;
+
+    if (stat(path, &now) == FAIL)
+	memset(&now, 0, sizeof(now));
+    if (now.st_dev == sb->st_dev && now.st_ino == sb->st_ino &&
+	now.st_size == sb->st_size && now.st_mtime == sb->st_mtime &&
+	now.st_ctime == sb->st_ctime &&
+	now.st_mtim.tv_nsec == sb->st_mtim.tv_nsec)
+	return FALSE;
+    *sb = now;
+    return TRUE;
+}
+
+/*
+ * Packages are registered and removed by creating and deleting their
+ * directories in LOG_DIR, which shows up in the directory itself, but
+ * a packing list can be rewritten in place and the database beside
+ * them is written through its own log, so those are watched as well.
+ */
+static void
+service_check(void)
+{
+    char fname[FILENAME_MAX];
+    Boolean changed = FALSE;
+    int i;
+
+    for (i = 0; i < (int)NDBFILES; i++) {
+	snprintf(fname, sizeof(fname), "%s%s", LOG_DIR, DbFiles[i]);
+	if (service_changed(fname, &DbStat[i]))
+	    changed = TRUE;
+    }
+    for (i = 0; !changed && i < NPkgs; i++) {
+	snprintf(fname, sizeof(fname), "%s/%s/%s", LOG_DIR, Pkgs[i].name,
+	    CONTENTS_FNAME);
+	if (service_changed(fname, &Pkgs[i].sb))
+	    changed = TRUE;
+    }
+    if (!changed)
+	return;
+    if (Verbose && Loaded)
+	printf("%s has changed\n", LOG_DIR);
+    service_flush();
+}
+
+/*
+ * Answer the question a client has asked, into its output buffer.
+ * Returns -1 if the question was not a line.
+ */
+static int
+service_answer(struct svc_client *cl)
+{
+    char *req = cl->req, *arg, **installed;
+    struct svc_file *f;
+    int i, count, status = 0;
+    FILE *fp;
+
+    if ((arg = memchr(req, '\n', cl->len)) == NULL)
+	return -1;
+    *arg = '\0';
+    if ((arg = strchr(req, ' ')) != NULL)
+	*arg++ = '\0';
+    else
+	arg = req + strlen(req);
+    if ((fp = open_memstream(&cl->out, &cl->outlen)) == NULL)
+	return -1;
+
+    service_check();
+    if (!strcmp(req, "exists"))
+	fprintf(fp, "%d 0\n", isinstalledpkg(arg) > 0 ? 0 : 1);
+    else if (!strcmp(req, "list")) {
+	if ((installed = installed_names()) == NULL)
+	    fprintf(fp, "1 0\n");
+	else {
+	    for (count = 0; installed[count] != NULL; count++)
+		;
+	    fprintf(fp, "0 %d\n", count);
+	    for (i = 0; i < count; i++)
+		fprintf(fp, "%s\n", installed[i]);
+	}
+    }
+    else if (!strcmp(req, "origin")) {
+	service_load();
+	for (count = i = 0; i < NPkgs; i++)
+	    if (Pkgs[i].origin != NULL && origin_match(arg, Pkgs[i].origin))
+		count++;
+	fprintf(fp, "0 %d\n", count);
+	for (i = 0; i < NPkgs; i++)
+	    if (Pkgs[i].origin != NULL && origin_match(arg, Pkgs[i].origin))
+		fprintf(fp, "%s\n", Pkgs[i].name);
+    }
+    else if (!strcmp(req, "which")) {
+	service_load();
+	count = 0;
+	if (Files != NULL)
+	    for (f = Files[service_hash(arg)]; f != NULL; f = f->next)
+		if (!strcmp(f->path, arg))
+		    count++;
+	fprintf(fp, "0 %d\n", count);
+	if (Files != NULL)
+	    for (f = Files[service_hash(arg)]; f != NULL; f = f->next)
+		if (!strcmp(f->path, arg))
+		    fprintf(fp, "%s\n", f->pkg);
+    }
+    else {
+	warnx("unknown request '%s'", req);
+	status = 2;
+	fprintf(fp, "%d 0\n", status);
+    }
+    if (fclose(fp) == EOF)
+	return -1;
+    cl->outoff = 0;
+    return 0;
+}
+
+/* Hang up on a client, whether or not it has had its answer */
+static void
+service_drop(struct svc_client *cl)
+{
+    close(cl->fd);
+    free(cl->out);
+    cl->fd = -1;
+    cl->out = NULL;
+}
+
+/*
+ * Take the next step with a client that poll() says is ready: read more
+ * of its question, and answer it once it is all there, or write more of
+ * the answer.  Nothing waits on any one client, so one that is slow or
+ * idle can't hold up the others.
+ */
+static void
+service_serve(struct svc_client *cl, short revents)
+{
+    ssize_t n;
+
+    if (cl->out == NULL) {
+	if (!(revents & (POLLIN | POLLHUP | POLLERR)))
+	    return;
+	n = read(cl->fd, cl->req + cl->len, sizeof(cl->req) - 1 - cl->len);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+	    return;
+	if (n <= 0) {
+	    service_drop(cl);
+	    return;
+	}
+	cl->len += n;
+	if (memchr(cl->req, '\n', cl->len) == NULL) {
+	    if (cl->len == sizeof(cl->req) - 1)
+		service_drop(cl);
+	    return;
+	}
+	if (service_answer(cl) == -1)
+	    service_drop(cl);
+    }
+    else if (revents & (POLLOUT | POLLHUP | POLLERR)) {
+	n = write(cl->fd, cl->out + cl->outoff, cl->outlen - cl->outoff);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+	    return;
+	if (n == -1 || (cl->outoff += n) == cl->outlen)
+	    service_drop(cl);
+    }
+}
+
+/*
+ * Answer questions on SERVICE_PATH until killed.  Each question is only
+ * a lookup in memory, so all the clients are served from the one loop,
+ * and any that take longer than SERVICE_TIMEOUT to ask and take their
+ * answer are hung up on.
+ */
+int
+service_run(void)
+{
+    struct sockaddr_un sun;
+    struct pollfd pfd[SERVICE_CLIENTS + 1];
+    struct stat sb;
+    const char *path = SERVICE_PATH;
+    time_t now, first;
+    int s, c, i, nclients;
+
+    if (*path == '\0')
+	errx(1, "no socket given for the query service");
+    if (strlen(path) >= sizeof(sun.sun_path))
+	errx(1, "%s: socket name too long", path);
+    if (service_query("exists", "", NULL) != -1)
+	errx(1, "a query service is already running on %s", path);
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_LOCAL;
+    strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+    if ((s = socket(PF_LOCAL, SOCK_STREAM, 0)) == -1)
+	err(1, "socket");
+    /* Left behind by one that went away */
+    if (lstat(path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+	unlink(path);
+    if (bind(s, (struct sockaddr *)&sun, sizeof(sun)) == FAIL)
+	err(1, "%s", path);
+    if ((Socket = strdup(path)) == NULL)
+	err(2, NULL);
+    /* Nothing can be changed through it, so anyone may ask */
+    if (chmod(path, 0666) == FAIL)
+	warn("%s", path);
+    if (listen(s, SERVICE_BACKLOG) == FAIL)
+	err(1, "%s", path);
+    if (fcntl(s, F_SETFL, O_NONBLOCK) == FAIL)
+	err(1, "%s", path);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGHUP, cleanup);
+    signal(SIGTERM, cleanup);
+    service_check();
+    if (Verbose)
+	printf("Answering queries on %s\n", path);
+    fflush(stdout);
+
+    for (i = 0; i < SERVICE_CLIENTS; i++)
+	Clients[i].fd = -1;
+    for (;;) {
+	now = time(NULL);
+	first = 0;
+	nclients = 0;
+	for (i = 0; i < SERVICE_CLIENTS; i++) {
+	    if (Clients[i].fd != -1 && Clients[i].deadline <= now)
+		service_drop(&Clients[i]);
+	    pfd[i + 1].fd = Clients[i].fd;
+	    pfd[i + 1].events = Clients[i].out == NULL ? POLLIN : POLLOUT;
+	    pfd[i + 1].revents = 0;
+	    if (Clients[i].fd == -1)
+		continue;
+	    nclients++;
+	    if (first == 0 || Clients[i].deadline < first)
+		first = Clients[i].deadline;
+	}
+	/* When they are all busy, the rest wait in the listen queue */
+	pfd[0].fd = nclients < SERVICE_CLIENTS ? s : -1;
+	pfd[0].events = POLLIN;
+	pfd[0].revents = 0;
+
+	if (poll(pfd, SERVICE_CLIENTS + 1,
+	    first == 0 ? INFTIM : (int)(first - now) * 1000) == -1) {
+	    if (errno != EINTR)
+		warn("poll");
+	    continue;
+	}
+	for (i = 0; i < SERVICE_CLIENTS; i++)
+	    if (pfd[i + 1].revents != 0 && Clients[i].fd != -1)
+		service_serve(&Clients[i], pfd[i + 1].revents);
+
+	if (pfd[0].revents & POLLIN) {
+	    if ((c = accept(s, NULL, NULL)) == -1) {
+		if (errno != EINTR && errno != ECONNABORTED &&
+		    errno != EAGAIN)
+		    warn("accept");
+		continue;
+	    }
+	    for (i = 0; Clients[i].fd != -1; i++)
+		;
+	    if (fcntl(c, F_SETFL, O_NONBLOCK) == FAIL) {
+		close(c);
+		continue;
+	    }
+	    Clients[i].fd = c;
+	    Clients[i].deadline = time(NULL) + SERVICE_TIMEOUT;
+	    Clients[i].len = 0;
+	}
+	if (Verbose)
+	    fflush(stdout);
+    }
+    /* Not reached */
+}
+
+/* Remove the socket, if we are the service */
+void
+service_cleanup(void)
+{
+    if (Socket != NULL) {
+	unlink(Socket);
+	Socket = NULL;
+    }
+}
@@ -27,7 +27,6 @@ __FBSDID("$FreeBSD: stable/10/usr.sbin/pkg_install/info/show.c 240682 2012-09-18
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <md5.h>
 
 void
 show_file(const char *title, const char *fname)
@@ -53,68 +52,33 @@ show_file(const char *title, const char *fname)
     printf("\n");	/* just in case */
 }
 
-static const char *
-elide_root(const char *dir)
-{
-    if (strcmp(dir, "/") == 0)
-	return "";
-    return dir;
-}
-
 /* Show files that don't match the recorded checksum */
 int
 show_cksum(const char *title, Package *plist)
 {
-    PackingList p;
-    const char *dir = ".";
-    char *prefix = NULL;
-    char tmp[FILENAME_MAX];
-    int errcode = 0;
+    struct cksum_ent *ents, *e;
+    int errcode = 0, i, n;
 
     if (!Quiet) {
 	printf("%s%s", InfoPrefix, title);
 	fflush(stdout);
     }
 
-    for (p = plist->head; p != NULL; p = p->next)
-	if (p->type == PLIST_CWD) {
-	    if (!prefix)
-		prefix = p->name;
-	    if (p->name == NULL)
-		dir = prefix;
-	    else
-		dir = p->name;
-	} else if (p->type == PLIST_FILE) {
-	    snprintf(tmp, FILENAME_MAX, "%s/%s", elide_root(dir), p->name);
-	    if (!fexists(tmp)) {
-		warnx("%s doesn't exist", tmp);
-		errcode = 1;
-	    } else if (p->next && p->next->type == PLIST_COMMENT &&
-	             (strncmp(p->next->name, "MD5:", 4) == 0)) {
-		char *cp = NULL, buf[33];
-
-		/*
-		 * For packing lists whose version is 1.1 or greater, the md5
-		 * hash for a symlink is calculated on the string returned
-		 * by readlink().
-		 */
-		if (issymlink(tmp) && verscmp(plist, 1, 0) > 0) {
-		    int len;
-		    char linkbuf[FILENAME_MAX];
-
-		    if ((len = readlink(tmp, linkbuf, FILENAME_MAX)) > 0)
-			cp = MD5Data((unsigned char *)linkbuf, len, buf);
-		} else if (isfile(tmp) || verscmp(plist, 1, 1) < 0)
-		    cp = MD5File(tmp, buf);
-
-		if (cp != NULL) {
-		    /* Mismatch? */
-		    if (strcmp(cp, p->next->name + 4))
-			printf("%s fails the original MD5 checksum\n", tmp);
-		    else if (Verbose)
-			printf("%s matched the original MD5 checksum\n", tmp);
-		}
-	    }
-	}
+    /* Read everything in disk order, then report in packing list order */
+    n = cksum_gather(plist, &ents);
+    cksum_verify_all(plist, ents, n);
+    for (i = 0; i < n; i++) {
+	e = &ents[i];
+	if (!CKSUM_PRESENT(e)) {
+	    warnx("%s doesn't exist", e->path);
+	    errcode = 1;
+	} else if (e->result == 1)
+	    printf("%s fails the original %s checksum\n", e->path,
+		cksum_name(e->type));
+	else if (e->result == 0 && Verbose)
+	    printf("%s matched the original %s checksum\n", e->path,
+		cksum_name(e->type));
+    }
+    cksum_free(ents, n);
     return (errcode);
 }
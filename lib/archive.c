@@ -0,0 +1,728 @@
+/*
+ * FreeBSD install - a package for the installation and maintenance
+ * of non-core utilities.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * Reading package archives with libarchive, rather than running tar.
+ *
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "lib.h"
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <archive.h>
+#include <archive_entry.h>
+
+#define UNPACK_BLOCKSIZE	(64 * 1024)
+#define UNPACK_RING		(16 * UNPACK_BLOCKSIZE)
+
+/*
+ * A compressed package being decompressed by a thread of its own, into
+ * a ring buffer that the extraction reads the uncompressed archive from.
+ * This is a two stage pipeline, not parallel decompression: the stream
+ * is still decompressed by the one thread, start to finish, and what is
+ * gained is only that writing out the files no longer waits on it, nor
+ * it on them.  Only the thread touches src until it has been joined.
+ */
+struct unpack_pipe {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;	/* Signalled whenever any of these change */
+    struct archive *src;
+    char *ring;
+    size_t head, count;		/* The data in the ring */
+    size_t taken;		/* How much of it libarchive has at the moment */
+    Boolean eof, error, stop;
+};
+
+/* A package being read from a stream, and copied to teefd as it goes */
+struct unpack_src {
+    FILE *fp;
+    int teefd;
+    char *buf;
+    size_t bufsize;
+};
+
+/* Open a package archive, whatever its format and compression */
+static struct archive *
+unpack_open(const char *pkg)
+{
+    struct archive *a;
+    int r;
+
+    if ((a = archive_read_new()) == NULL)
+	return NULL;
+    archive_read_support_filter_all(a);
+    archive_read_support_format_all(a);
+    if (!strcmp(pkg, "-"))
+	r = archive_read_open_fd(a, STDIN_FILENO, UNPACK_BLOCKSIZE);
+    else
+	r = archive_read_open_filename(a, pkg, UNPACK_BLOCKSIZE);
+    if (r != ARCHIVE_OK) {
+	warnx("%s: %s", pkg, archive_error_string(a));
+	archive_read_free(a);
+	return NULL;
+    }
+    return a;
+}
+
+/* Decompress the package into the ring, until it's all done or we stop */
+static void *
+unpack_inflate(void *arg)
+{
+    struct unpack_pipe *up = arg;
+    size_t tail, n;
+    ssize_t r;
+
+    for (;;) {
+	pthread_mutex_lock(&up->lock);
+	while (up->count == UNPACK_RING && !up->stop)
+	    pthread_cond_wait(&up->cond, &up->lock);
+	if (up->stop) {
+	    pthread_mutex_unlock(&up->lock);
+	    break;
+	}
+	tail = (up->head + up->count) % UNPACK_RING;
+	n = tail >= up->head ? UNPACK_RING - tail : up->head - tail;
+	if (n > UNPACK_RING - up->count)
+	    n = UNPACK_RING - up->count;
+	pthread_mutex_unlock(&up->lock);
+
+	/* Nobody else looks at this part of the ring until it's counted */
+	r = archive_read_data(up->src, up->ring + tail, n);
+
+	pthread_mutex_lock(&up->lock);
+	if (r > 0)
+	    up->count += r;
+	else {
+	    up->eof = TRUE;
+	    up->error = r < 0;
+	}
+	pthread_cond_broadcast(&up->cond);
+	pthread_mutex_unlock(&up->lock);
+	if (r <= 0)
+	    break;
+    }
+    return NULL;
+}
+
+static ssize_t
+unpack_pipe_read(struct archive *a, void *arg, const void **buf)
+{
+    struct unpack_pipe *up = arg;
+    size_t n;
+
+    pthread_mutex_lock(&up->lock);
+    /* libarchive is done with what it had last time */
+    up->head = (up->head + up->taken) % UNPACK_RING;
+    up->count -= up->taken;
+    up->taken = 0;
+    pthread_cond_broadcast(&up->cond);
+    while (up->count == 0 && !up->eof)
+	pthread_cond_wait(&up->cond, &up->lock);
+    if (up->count == 0) {
+	pthread_mutex_unlock(&up->lock);
+	if (up->error) {
+	    archive_set_error(a, archive_errno(up->src), "%s",
+		archive_error_string(up->src));
+	    return -1;
+	}
+	return 0;
+    }
+    n = up->count;
+    if (n > UNPACK_RING - up->head)
+	n = UNPACK_RING - up->head;
+    up->taken = n;
+    *buf = up->ring + up->head;
+    pthread_mutex_unlock(&up->lock);
+    return n;
+}
+
+static int
+unpack_pipe_close(struct archive *a __unused, void *arg)
+{
+    struct unpack_pipe *up = arg;
+
+    pthread_mutex_lock(&up->lock);
+    up->stop = TRUE;
+    pthread_cond_broadcast(&up->cond);
+    pthread_mutex_unlock(&up->lock);
+    pthread_join(up->thread, NULL);
+    archive_read_free(up->src);
+    pthread_cond_destroy(&up->cond);
+    pthread_mutex_destroy(&up->lock);
+    free(up->ring);
+    free(up);
+    return ARCHIVE_OK;
+}
+
+/*
+ * Extract from the uncompressed stream that src reads, decompressing
+ * it in another thread so that decompression and writing out the files
+ * overlap.  src is freed along with the archive returned.
+ */
+static struct archive *
+unpack_pipe(const char *pkg, struct archive *src)
+{
+    struct unpack_pipe *up;
+    struct archive *a;
+    int error;
+
+    if ((up = calloc(1, sizeof(*up))) == NULL ||
+	(up->ring = malloc(UNPACK_RING)) == NULL)
+	err(2, NULL);
+    up->src = src;
+    pthread_mutex_init(&up->lock, NULL);
+    pthread_cond_init(&up->cond, NULL);
+    if ((error = pthread_create(&up->thread, NULL, unpack_inflate, up)) != 0) {
+	warnc(error, "pthread_create");
+	pthread_cond_destroy(&up->cond);
+	pthread_mutex_destroy(&up->lock);
+	archive_read_free(src);
+	free(up->ring);
+	free(up);
+	return NULL;
+    }
+    if ((a = archive_read_new()) == NULL) {
+	unpack_pipe_close(NULL, up);
+	return NULL;
+    }
+    archive_read_support_format_all(a);
+    /* The close callback is called even if this fails */
+    if (archive_read_open(a, up, NULL, unpack_pipe_read,
+	unpack_pipe_close) != ARCHIVE_OK) {
+	warnx("%s: %s", pkg, archive_error_string(a));
+	archive_read_free(a);
+	return NULL;
+    }
+    return a;
+}
+
+/* Start reading the uncompressed contents of src as a single entry */
+static int
+unpack_raw(const char *pkg, struct archive *src, int r)
+{
+    struct archive_entry *e;
+
+    if (r == ARCHIVE_OK)
+	r = archive_read_next_header(src, &e);
+    if (r != ARCHIVE_OK) {
+	warnx("%s: %s", pkg, archive_error_string(src));
+	archive_read_free(src);
+	return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Open a package for extraction.  Unless it isn't compressed at all,
+ * it is decompressed in a thread of its own; see unpack_pipe().
+ */
+static struct archive *
+unpack_open_extract(const char *pkg)
+{
+    struct archive *src;
+    int r;
+
+    if ((src = archive_read_new()) == NULL)
+	return NULL;
+    archive_read_support_filter_all(src);
+    archive_read_support_format_raw(src);
+    if (!strcmp(pkg, "-"))
+	r = archive_read_open_fd(src, STDIN_FILENO, UNPACK_BLOCKSIZE);
+    else
+	r = archive_read_open_filename(src, pkg, UNPACK_BLOCKSIZE);
+    if (unpack_raw(pkg, src, r) == FAIL)
+	return NULL;
+    if (archive_filter_code(src, 0) == ARCHIVE_FILTER_NONE &&
+	strcmp(pkg, "-")) {
+	archive_read_free(src);
+	return unpack_open(pkg);
+    }
+    return unpack_pipe(pkg, src);
+}
+
+/* Where to extract to, restoring everything tar -xp would */
+static struct archive *
+unpack_disk(void)
+{
+    struct archive *disk;
+    int flags;
+
+    flags = ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_TIME |
+	ARCHIVE_EXTRACT_ACL | ARCHIVE_EXTRACT_FFLAGS | ARCHIVE_EXTRACT_XATTR |
+	ARCHIVE_EXTRACT_SECURE_SYMLINKS | ARCHIVE_EXTRACT_SECURE_NODOTDOT;
+    if (geteuid() == 0)
+	flags |= ARCHIVE_EXTRACT_OWNER;
+    if ((disk = archive_write_disk_new()) == NULL)
+	return NULL;
+    archive_write_disk_set_options(disk, flags);
+    archive_write_disk_set_standard_lookup(disk);
+    return disk;
+}
+
+/* As tar does, extract absolute names relative to the current directory */
+static void
+unpack_strip(struct archive_entry *e)
+{
+    const char *cp;
+
+    if ((cp = archive_entry_pathname(e)) != NULL && *cp == '/') {
+	while (*cp == '/')
+	    cp++;
+	archive_entry_copy_pathname(e, cp);
+    }
+    if ((cp = archive_entry_hardlink(e)) != NULL && *cp == '/') {
+	while (*cp == '/')
+	    cp++;
+	archive_entry_copy_hardlink(e, cp);
+    }
+}
+
+/* Extract the current member, complaining about anything unusual */
+static int
+unpack_entry(const char *pkg, struct archive *a, struct archive_entry *e,
+    struct archive *disk)
+{
+    int r;
+
+    if (Verbose > 1)
+	printf("x %s\n", archive_entry_pathname(e));
+    r = archive_read_extract2(a, e, disk);
+    if (r != ARCHIVE_OK)
+	warnx("%s: %s: %s", pkg, archive_entry_pathname(e),
+	    archive_error_string(disk));
+    return r < ARCHIVE_WARN ? FAIL : SUCCESS;
+}
+
+/* Is this member one of the "+" files at the head of a package? */
+static Boolean
+pkg_meta_member(struct archive_entry *e)
+{
+    const char *name = archive_entry_pathname(e);
+
+    return name != NULL && *name == '+' && strchr(name, '/') == NULL &&
+	archive_entry_filetype(e) == AE_IFREG;
+}
+
+/* Read the current member into memory */
+static struct pkg_meta_ent *
+pkg_meta_read(struct pkg_meta *meta, struct archive *a,
+    struct archive_entry *e)
+{
+    struct pkg_meta_ent *me;
+    int64_t size;
+    ssize_t r;
+
+    if ((size = archive_entry_size(e)) < 0 || size > SSIZE_MAX - 1)
+	return NULL;
+    if ((meta->ents = reallocf(meta->ents,
+	(meta->n + 1) * sizeof(*meta->ents))) == NULL)
+	err(2, NULL);
+    me = &meta->ents[meta->n];
+    me->mode = archive_entry_perm(e);
+    if ((me->name = strdup(archive_entry_pathname(e))) == NULL ||
+	(me->data = malloc(size + 1)) == NULL)
+	err(2, NULL);
+    me->len = 0;
+    while (me->len < (size_t)size &&
+	(r = archive_read_data(a, me->data + me->len, size - me->len)) > 0)
+	me->len += r;
+    me->data[me->len] = '\0';
+    meta->n++;
+    if (me->len != (size_t)size)
+	return NULL;
+    return me;
+}
+
+/* Write the metadata files out into the current directory */
+int
+pkg_meta_extract(struct pkg_meta *meta)
+{
+    struct pkg_meta_ent *me;
+    int fd, i;
+
+    for (i = 0; i < meta->n; i++) {
+	me = &meta->ents[i];
+	if (Verbose > 1)
+	    printf("x %s\n", me->name);
+	stat_cache_invalidate(me->name);
+	if ((fd = open(me->name, O_WRONLY | O_CREAT | O_TRUNC,
+	    me->mode)) == -1) {
+	    warn("%s", me->name);
+	    return FAIL;
+	}
+	if (write(fd, me->data, me->len) != (ssize_t)me->len) {
+	    warn("%s", me->name);
+	    close(fd);
+	    return FAIL;
+	}
+	close(fd);
+    }
+    return SUCCESS;
+}
+
+/* The space the metadata files take up */
+off_t
+pkg_meta_size(struct pkg_meta *meta)
+{
+    off_t size = 0;
+    int i;
+
+    for (i = 0; i < meta->n; i++)
+	size += meta->ents[i].len;
+    return size;
+}
+
+/*
+ * Add up the sizes of all the members of an archive, for packages that
+ * don't record their size.  Only the headers are looked at and nothing
+ * is written out, but a compressed package still has to be decompressed
+ * to find them, so this costs a second pass over it.
+ */
+off_t
+unpack_size(const char *pkg)
+{
+    struct archive *a;
+    struct archive_entry *e;
+    off_t size = 0;
+    int r;
+
+    if ((a = unpack_open(pkg)) == NULL)
+	return -1;
+    while ((r = archive_read_next_header(a, &e)) == ARCHIVE_OK)
+	if (archive_entry_size(e) > 0)
+	    size += archive_entry_size(e);
+    archive_read_free(a);
+    return r == ARCHIVE_EOF ? size : -1;
+}
+
+/* Return the contents of a metadata file, or NULL if there was none */
+const char *
+pkg_meta_get(struct pkg_meta *meta, const char *name, size_t *len)
+{
+    int i;
+
+    for (i = 0; i < meta->n; i++)
+	if (!strcmp(meta->ents[i].name, name)) {
+	    if (len != NULL)
+		*len = meta->ents[i].len;
+	    return meta->ents[i].data;
+	}
+    return NULL;
+}
+
+/* Parse the packing list out of the metadata */
+int
+pkg_meta_plist(struct pkg_meta *meta, Package *pkg)
+{
+    static const char tag[] = "@comment PKG_FORMAT_REVISION:";
+    const char *data, *cp;
+    size_t len;
+    FILE *fp;
+    int major;
+
+    if ((data = pkg_meta_get(meta, CONTENTS_FNAME, &len)) == NULL ||
+	len == 0)
+	return FAIL;
+    /* read_plist() would exit, taking any package this is a dependency of */
+    if ((cp = memmem(data, len, tag, sizeof(tag) - 1)) != NULL &&
+	sscanf(cp + sizeof(tag) - 1, "%d", &major) == 1 &&
+	major > PLIST_FMT_VER_MAJOR) {
+	warnx("plist format revision (%d) is higher than supported (%d)",
+	    major, PLIST_FMT_VER_MAJOR);
+	return FAIL;
+    }
+    if ((fp = fmemopen((void *)(uintptr_t)data, len, "r")) == NULL)
+	return FAIL;
+    read_plist(pkg, fp);
+    fclose(fp);
+    return SUCCESS;
+}
+
+void
+pkg_meta_free(struct pkg_meta *meta)
+{
+    int i;
+
+    for (i = 0; i < meta->n; i++) {
+	free(meta->ents[i].name);
+	free(meta->ents[i].data);
+    }
+    free(meta->ents);
+    meta->ents = NULL;
+    meta->n = 0;
+}
+
+/* Read the "+" files from the head of an opened archive, and close it */
+static int
+pkg_meta_scan(const char *pkg, struct archive *a, struct pkg_meta *meta)
+{
+    struct archive_entry *e;
+    int r, rv = 0;
+
+    while ((r = archive_read_next_header(a, &e)) == ARCHIVE_OK) {
+	unpack_strip(e);
+	if (!pkg_meta_member(e))
+	    break;
+	if (pkg_meta_read(meta, a, e) == NULL) {
+	    warnx("%s: short read of %s", pkg, archive_entry_pathname(e));
+	    rv = 1;
+	    break;
+	}
+    }
+    if (rv == 0 && r != ARCHIVE_OK && r != ARCHIVE_EOF) {
+	warnx("%s: %s", pkg, archive_error_string(a));
+	rv = 1;
+    }
+    archive_read_free(a);
+    return rv;
+}
+
+/*
+ * Read just the "+" files at the head of a package into memory, without
+ * writing anything to disk or needing a playpen.  Reading stops at the
+ * first member that isn't one, so only the start of the archive is ever
+ * decompressed.  Returns 0 on success.
+ */
+int
+pkg_meta_load(const char *pkg, struct pkg_meta *meta)
+{
+    struct archive *a;
+
+    memset(meta, 0, sizeof(*meta));
+    if ((a = unpack_open(pkg)) == NULL)
+	return 1;
+    return pkg_meta_scan(pkg, a, meta);
+}
+
+/*
+ * As pkg_meta_load(), for a package being read from fp, such as one
+ * still on its way from a server, of which only the head is read.
+ */
+int
+pkg_meta_load_fp(const char *name, FILE *fp, struct pkg_meta *meta)
+{
+    struct archive *a;
+
+    memset(meta, 0, sizeof(*meta));
+    if ((a = archive_read_new()) == NULL)
+	return 1;
+    archive_read_support_filter_all(a);
+    archive_read_support_format_all(a);
+    if (archive_read_open_FILE(a, fp) != ARCHIVE_OK) {
+	warnx("%s: %s", name, archive_error_string(a));
+	archive_read_free(a);
+	return 1;
+    }
+    return pkg_meta_scan(name, a, meta);
+}
+
+/*
+ * Unpack a package in a single pass.  The "+" files at the head of the
+ * archive are read into meta.  Once they have all been seen, ready is
+ * called: it decides where the rest of the package is to go, changing
+ * to that directory and writing out the metadata files wherever they
+ * are wanted, and returns 0 to go on, 1 to stop there or -1 on error.
+ * Returns 0 on success.
+ */
+int
+unpack_pkg(const char *pkg, struct pkg_meta *meta,
+    int (*ready)(struct pkg_meta *, void *), void *arg)
+{
+    struct archive *a, *disk;
+    struct archive_entry *e;
+    Boolean head = TRUE;
+    int r, rv = 0;
+
+    memset(meta, 0, sizeof(*meta));
+    if ((a = unpack_open_extract(pkg)) == NULL)
+	return 1;
+    if ((disk = unpack_disk()) == NULL) {
+	archive_read_free(a);
+	return 1;
+    }
+    while ((r = archive_read_next_header(a, &e)) == ARCHIVE_OK) {
+	unpack_strip(e);
+	if (head && pkg_meta_member(e)) {
+	    if (pkg_meta_read(meta, a, e) == NULL) {
+		warnx("%s: short read of %s", pkg, archive_entry_pathname(e));
+		rv = -1;
+		break;
+	    }
+	    continue;
+	}
+	if (head) {
+	    head = FALSE;
+	    if ((rv = ready(meta, arg)) != 0)
+		break;
+	}
+	if (unpack_entry(pkg, a, e, disk) == FAIL) {
+	    rv = -1;
+	    break;
+	}
+    }
+    if (rv == 0 && r != ARCHIVE_EOF) {
+	warnx("%s: %s", pkg, archive_error_string(a));
+	rv = -1;
+    }
+    else if (rv == 0 && head)
+	rv = ready(meta, arg);
+    archive_write_free(disk);
+    archive_read_free(a);
+    stat_cache_flush();
+    return rv < 0;
+}
+
+/*
+ * Extract the members of an open archive into the current directory.
+ * If flist is not NULL, it is a list of the only member names to
+ * extract, separated by white space, and reading stops as soon as they
+ * have all been found.
+ */
+static int
+unpack_archive(const char *pkg, struct archive *a, const char *flist)
+{
+    struct archive *disk;
+    struct archive_entry *e;
+    char *names = NULL, *want[64], *cp;
+    int i, nwant = 0, r, rv = 0;
+
+    if ((disk = unpack_disk()) == NULL)
+	return 1;
+    if (flist != NULL) {
+	if ((names = strdup(flist)) == NULL)
+	    err(2, NULL);
+	for (cp = names; nwant < 64 &&
+	    (want[nwant] = strsep(&cp, " \t\n")) != NULL;)
+	    if (*want[nwant] != '\0')
+		nwant++;
+    }
+    while ((r = archive_read_next_header(a, &e)) == ARCHIVE_OK) {
+	unpack_strip(e);
+	if (flist != NULL) {
+	    for (i = 0; i < nwant; i++)
+		if (!strcmp(want[i], archive_entry_pathname(e)))
+		    break;
+	    if (i == nwant)
+		continue;
+	    want[i] = want[--nwant];
+	}
+	if (unpack_entry(pkg, a, e, disk) == FAIL) {
+	    rv = 1;
+	    break;
+	}
+	if (flist != NULL && nwant == 0)
+	    break;
+    }
+    if (rv == 0 && r != ARCHIVE_OK && r != ARCHIVE_EOF) {
+	warnx("%s: %s", pkg, archive_error_string(a));
+	rv = 1;
+    }
+    archive_write_free(disk);
+    stat_cache_flush();
+    free(names);
+    return rv;
+}
+
+/*
+ * Unpack a package file into the current directory.  If flist is not
+ * NULL, only the members it names are extracted; see unpack_archive().
+ */
+int
+unpack(const char *pkg, const char *flist)
+{
+    struct archive *a;
+    int rv = 1;
+
+    if ((a = unpack_open_extract(pkg)) != NULL) {
+	rv = unpack_archive(pkg, a, flist);
+	archive_read_free(a);
+    }
+    if (rv)
+	warnx("tar extract of %s failed!", pkg);
+    return rv;
+}
+
+static ssize_t
+unpack_read(struct archive *a, void *arg, const void **buf)
+{
+    struct unpack_src *src = arg;
+    size_t r;
+
+    r = fread(src->buf, 1, src->bufsize, src->fp);
+    if (r == 0 && ferror(src->fp)) {
+	archive_set_error(a, EIO, "error reading from server");
+	return -1;
+    }
+    if (r > 0 && src->teefd != -1 &&
+	write(src->teefd, src->buf, r) != (ssize_t)r) {
+	archive_set_error(a, errno, "error writing copy of package");
+	return -1;
+    }
+    *buf = src->buf;
+    return r;
+}
+
+/*
+ * Unpack a package into the current directory as it is read from fp,
+ * which is usually a download in progress, writing a copy of it to
+ * teefd if that isn't -1.  The package goes straight from fp to
+ * libarchive, a block of PKG_FETCH_BUFSIZE bytes (or UNPACK_BLOCKSIZE
+ * if that isn't set) at a time.  name is only used in messages.
+ */
+int
+unpack_fp(const char *name, FILE *fp, int teefd)
+{
+    struct unpack_src src;
+    struct archive *raw, *a;
+    const char *cp;
+    size_t r;
+    int rv;
+
+    src.fp = fp;
+    src.teefd = teefd;
+    if ((cp = getenv("PKG_FETCH_BUFSIZE")) == NULL ||
+	(src.bufsize = strtonum(cp, 512, 64 * 1024 * 1024, NULL)) == 0)
+	src.bufsize = UNPACK_BLOCKSIZE;
+    if ((src.buf = malloc(src.bufsize)) == NULL)
+	err(2, NULL);
+    /* Don't copy everything through a small stdio buffer first */
+    setvbuf(fp, NULL, _IOFBF, src.bufsize);
+
+    /* Decompress in another thread, as for unpack_open_extract() */
+    if ((raw = archive_read_new()) == NULL) {
+	free(src.buf);
+	return 1;
+    }
+    archive_read_support_filter_all(raw);
+    archive_read_support_format_raw(raw);
+    if (unpack_raw(name, raw, archive_read_open(raw, &src, NULL, unpack_read,
+	NULL)) == FAIL || (a = unpack_pipe(name, raw)) == NULL)
+	rv = 1;
+    else {
+	rv = unpack_archive(name, a, NULL);
+	archive_read_free(a);
+    }
+    /* Copy any padding after the end of the archive too */
+    if (rv == 0 && teefd != -1)
+	while ((r = fread(src.buf, 1, src.bufsize, fp)) > 0 &&
+	    write(teefd, src.buf, r) == (ssize_t)r)
+	    ;
+    free(src.buf);
+    if (rv)
+	warnx("extract of %s failed!", name);
+    return rv;
+}
@@ -0,0 +1,660 @@
+/*
+ * FreeBSD install - a package for the installation and maintenance
+ * of non-core utilities.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * Routines for computing and checking the file checksums recorded
+ * in packing lists.
+ *
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "lib.h"
+#include <err.h>
+#include <errno.h>
+#include <db.h>
+#include <md5.h>
+#include <pthread.h>
+#include <sha256.h>
+
+/*
+ * Checksum cache, keyed by inode.  A record is only used if the size,
+ * modification and inode change times of the file still match those
+ * it was computed for.
+ */
+struct cksum_key {
+    dev_t		dev;
+    ino_t		ino;
+    int			type;
+};
+
+struct cksum_rec {
+    off_t		size;
+    struct timespec	mtime;
+    struct timespec	ctime;
+    char		digest[CKSUM_BUFSIZE];
+};
+
+/* A checksum waiting to be written to the cache, or taken out of it */
+struct cksum_pend {
+    struct cksum_key	key;
+    struct cksum_rec	rec;
+    Boolean		del;
+};
+
+/* Checksums saved up before the cache is locked to write them */
+#define CKSUM_CACHE_BATCH	1024
+/* ... and how many to keep while others have it locked */
+#define CKSUM_CACHE_PEND_MAX	(8 * CKSUM_CACHE_BATCH)
+
+/* The cache may be shared by several threads, see pkg_info -A */
+static pthread_mutex_t CksumCacheLock = PTHREAD_MUTEX_INITIALIZER;
+static DB *CksumCache;
+static Boolean CksumCacheTried, CksumCacheReopen;
+static char CksumCachePath[FILENAME_MAX];
+static struct cksum_pend *CksumPend;
+static int CksumNPend, CksumMaxPend;
+
+static const struct {
+    int		type;
+    const char	*tag;
+    const char	*name;
+} cksum_types[] = {
+    /*
+     * In order of preference when verifying, fastest first.  libmd's
+     * SHA-256 is plain C and well behind its MD5, so MD5 is used unless
+     * the SHA-256 is built to use the CPU's own instructions.  Whether
+     * it is isn't found out at run time, so by default recording SHA-256
+     * changes nothing about how fast packages are checked.
+     */
+#ifdef CKSUM_FAST_SHA256
+    { CKSUM_SHA256,	CKSUM_SHA256_TAG,	"SHA256" },
+    { CKSUM_MD5,	CKSUM_MD5_TAG,		"MD5" },
+#else
+    { CKSUM_MD5,	CKSUM_MD5_TAG,		"MD5" },
+    { CKSUM_SHA256,	CKSUM_SHA256_TAG,	"SHA256" },
+#endif
+    { 0,		NULL,			NULL }
+};
+
+/* Return the checksum type of a "@comment" argument, or 0 if none */
+int
+cksum_type(const char *comment)
+{
+    int i;
+
+    if (comment == NULL)
+	return 0;
+    for (i = 0; cksum_types[i].type; i++)
+	if (!strncmp(comment, cksum_types[i].tag, strlen(cksum_types[i].tag)))
+	    return cksum_types[i].type;
+    return 0;
+}
+
+/* Return the printable name of a checksum type */
+const char *
+cksum_name(int type)
+{
+    int i;
+
+    for (i = 0; cksum_types[i].type; i++)
+	if (cksum_types[i].type == type)
+	    return cksum_types[i].name;
+    return "unknown";
+}
+
+/* Return the "@comment" tag, including the colon, for a checksum type */
+const char *
+cksum_tag(int type)
+{
+    int i;
+
+    for (i = 0; cksum_types[i].type; i++)
+	if (cksum_types[i].type == type)
+	    return cksum_types[i].tag;
+    return NULL;
+}
+
+/*
+ * Parse a comma separated list of checksum names ("md5,sha256") into
+ * a mask of CKSUM_* bits.  Returns 0 if any name is unknown.
+ */
+int
+cksum_parse(const char *list)
+{
+    char *copy, *cp, *name;
+    int i, mask = 0, type;
+
+    if ((copy = strdup(list)) == NULL)
+	return 0;
+    for (cp = copy; (name = strsep(&cp, ",")) != NULL;) {
+	if (*name == '\0')
+	    continue;
+	type = 0;
+	for (i = 0; cksum_types[i].type; i++)
+	    if (!strcasecmp(name, cksum_types[i].name))
+		type = cksum_types[i].type;
+	if (!type) {
+	    mask = 0;
+	    break;
+	}
+	mask |= type;
+    }
+    free(copy);
+    return mask;
+}
+
+/*
+ * Find the fastest checksum recorded for the file entry p.  The
+ * checksum comments immediately follow the file they belong to; MD5
+ * always comes first so that older tools, which only look at p->next,
+ * keep working.  Returns the comment entry and its type in *type, or
+ * NULL if the file has no checksum recorded.
+ */
+PackingList
+cksum_find(PackingList p, int *type)
+{
+    PackingList q, best = NULL;
+    int i, t, rank = -1;
+
+    for (q = p->next; q != NULL && q->type == PLIST_COMMENT; q = q->next) {
+	if (!(t = cksum_type(q->name)))
+	    continue;
+	for (i = 0; cksum_types[i].type != t; i++)
+	    ;
+	if (best == NULL || i < rank) {
+	    best = q;
+	    rank = i;
+	}
+    }
+    if (best != NULL && type != NULL)
+	*type = cksum_types[rank].type;
+    return best;
+}
+
+/* Checksum a memory buffer, returning the hex digest in buf */
+char *
+cksum_data(int type, const void *data, size_t len, char *buf)
+{
+    switch (type) {
+    case CKSUM_MD5:
+	return MD5Data(data, len, buf);
+    case CKSUM_SHA256:
+	return SHA256_Data(data, len, buf);
+    default:
+	return NULL;
+    }
+}
+
+/* Checksum an open file descriptor from its current offset */
+char *
+cksum_fd(int type, int fd, char *buf)
+{
+    MD5_CTX md5;
+    SHA256_CTX sha256;
+    char iobuf[CKSUM_IOSIZE];
+    ssize_t len;
+
+    if (type == CKSUM_MD5)
+	MD5Init(&md5);
+    else if (type == CKSUM_SHA256)
+	SHA256_Init(&sha256);
+    else
+	return NULL;
+    while ((len = read(fd, iobuf, CKSUM_IOSIZE)) > 0) {
+	if (type == CKSUM_MD5)
+	    MD5Update(&md5, iobuf, len);
+	else
+	    SHA256_Update(&sha256, iobuf, len);
+    }
+    if (len < 0)
+	return NULL;
+    return type == CKSUM_MD5 ? MD5End(&md5, buf) : SHA256_End(&sha256, buf);
+}
+
+/*
+ * Write the saved up checksums to the cache, and take out those of
+ * files that have gone.  The cache is only locked for writing while
+ * that is done, and if others are still reading it the changes are
+ * kept to try again with the next batch rather than waiting for them
+ * to finish.  They are only dropped if too many pile up, or if the
+ * cache is still busy when we exit.  Called with CksumCacheLock held.
+ */
+static void
+cksum_cache_flush(Boolean last)
+{
+    DB *db;
+    DBT k, d;
+    int i;
+
+    if (CksumNPend == 0)
+	return;
+    if (CksumCache != NULL) {
+	CksumCache->close(CksumCache);
+	CksumCache = NULL;
+    }
+    db = dbopen(CksumCachePath, O_RDWR | O_CREAT | O_EXLOCK | O_NONBLOCK,
+	0644, DB_HASH, NULL);
+    CksumCacheReopen = TRUE;
+    if (db == NULL) {
+	if (!last && CksumNPend < CKSUM_CACHE_PEND_MAX)
+	    return;
+	if (Verbose > 1)
+	    warn("checksum cache %s not updated", CksumCachePath);
+	CksumNPend = 0;
+	return;
+    }
+    for (i = 0; i < CksumNPend; i++) {
+	k.data = &CksumPend[i].key;
+	k.size = sizeof(CksumPend[i].key);
+	if (CksumPend[i].del) {
+	    (void)db->del(db, &k, 0);
+	    continue;
+	}
+	d.data = &CksumPend[i].rec;
+	d.size = sizeof(CksumPend[i].rec);
+	(void)db->put(db, &k, &d, 0);
+    }
+    db->close(db);
+    CksumNPend = 0;
+}
+
+/* Write out anything saved up and close the checksum cache */
+void
+cksum_cache_close(void)
+{
+    pthread_mutex_lock(&CksumCacheLock);
+    cksum_cache_flush(TRUE);
+    if (CksumCache != NULL) {
+	CksumCache->close(CksumCache);
+	CksumCache = NULL;
+    }
+    pthread_mutex_unlock(&CksumCacheLock);
+}
+
+/*
+ * Open the checksum cache for reading, on first use or after it has
+ * been written to.  Readers share the lock, so they only have to wait
+ * while somebody is writing.  Returns NULL if there is no cache (yet).
+ * Called with CksumCacheLock held.
+ */
+static DB *
+cksum_cache(void)
+{
+    const char *cp;
+
+    if (!CksumCacheTried) {
+	CksumCacheTried = TRUE;
+	if ((cp = getenv("PKG_CKSUM_CACHE")) != NULL)
+	    strlcpy(CksumCachePath, cp, sizeof(CksumCachePath));
+	else
+	    snprintf(CksumCachePath, sizeof(CksumCachePath), "%s/%s",
+		LOG_DIR, CKSUM_CACHE_FNAME);
+	if (*CksumCachePath != '\0')
+	    atexit(cksum_cache_close);
+	CksumCacheReopen = TRUE;
+    }
+    if (CksumCache != NULL || *CksumCachePath == '\0' || !CksumCacheReopen)
+	return CksumCache;
+    CksumCacheReopen = FALSE;
+    CksumCache = dbopen(CksumCachePath, O_RDONLY | O_SHLOCK, 0, DB_HASH,
+	NULL);
+    if (CksumCache == NULL && errno != ENOENT && Verbose > 1)
+	warn("checksum cache %s not available", CksumCachePath);
+    return CksumCache;
+}
+
+static void
+cksum_cache_key(struct cksum_key *key, const struct stat *sb, int type)
+{
+    memset(key, 0, sizeof(*key));
+    key->dev = sb->st_dev;
+    key->ino = sb->st_ino;
+    key->type = type;
+}
+
+/* Look up the checksum of an unchanged file in the cache */
+static char *
+cksum_cache_get(int type, const struct stat *sb, char *buf)
+{
+    struct cksum_key key;
+    struct cksum_rec rec;
+    DB *db;
+    DBT k, d;
+
+    pthread_mutex_lock(&CksumCacheLock);
+    if ((db = cksum_cache()) == NULL) {
+	pthread_mutex_unlock(&CksumCacheLock);
+	return NULL;
+    }
+    cksum_cache_key(&key, sb, type);
+    k.data = &key;
+    k.size = sizeof(key);
+    if (db->get(db, &k, &d, 0) != 0 || d.size != sizeof(rec)) {
+	pthread_mutex_unlock(&CksumCacheLock);
+	return NULL;
+    }
+    memcpy(&rec, d.data, sizeof(rec));
+    pthread_mutex_unlock(&CksumCacheLock);
+    if (rec.size != sb->st_size ||
+	rec.mtime.tv_sec != sb->st_mtim.tv_sec ||
+	rec.mtime.tv_nsec != sb->st_mtim.tv_nsec ||
+	rec.ctime.tv_sec != sb->st_ctim.tv_sec ||
+	rec.ctime.tv_nsec != sb->st_ctim.tv_nsec)
+	return NULL;
+    rec.digest[CKSUM_BUFSIZE - 1] = '\0';
+    return strcpy(buf, rec.digest);
+}
+
+/*
+ * Save up a change to the cache: the checksum of a file, or if digest
+ * is NULL, the removal of any it has.
+ */
+static void
+cksum_cache_put(int type, const struct stat *sb, const char *digest)
+{
+    struct cksum_pend *pe;
+
+    pthread_mutex_lock(&CksumCacheLock);
+    (void)cksum_cache();
+    if (*CksumCachePath == '\0') {
+	pthread_mutex_unlock(&CksumCacheLock);
+	return;
+    }
+    if (CksumNPend == CksumMaxPend) {
+	CksumMaxPend += CKSUM_CACHE_BATCH;
+	if ((CksumPend = reallocf(CksumPend,
+	    CksumMaxPend * sizeof(*CksumPend))) == NULL) {
+	    /* Exiting runs cksum_cache_close(), which needs the lock */
+	    CksumNPend = CksumMaxPend = 0;
+	    pthread_mutex_unlock(&CksumCacheLock);
+	    err(2, NULL);
+	}
+    }
+    pe = &CksumPend[CksumNPend++];
+    cksum_cache_key(&pe->key, sb, type);
+    memset(&pe->rec, 0, sizeof(pe->rec));
+    pe->del = digest == NULL;
+    if (!pe->del) {
+	pe->rec.size = sb->st_size;
+	pe->rec.mtime = sb->st_mtim;
+	pe->rec.ctime = sb->st_ctim;
+	strlcpy(pe->rec.digest, digest, sizeof(pe->rec.digest));
+    }
+    if (CksumNPend % CKSUM_CACHE_BATCH == 0)
+	cksum_cache_flush(FALSE);
+    pthread_mutex_unlock(&CksumCacheLock);
+}
+
+/*
+ * Take the checksums of a file that is about to be deleted out of the
+ * cache, so that the cache doesn't grow with every package installed
+ * and deleted, nor answer for whatever gets the inode next.
+ */
+void
+cksum_cache_forget(const char *fname)
+{
+    struct stat sb;
+
+    if (lstat(fname, &sb) == FAIL || !S_ISREG(sb.st_mode))
+	return;
+    cksum_cache_put(CKSUM_MD5, &sb, NULL);
+    cksum_cache_put(CKSUM_SHA256, &sb, NULL);
+}
+
+/*
+ * Don't use the cache at all.  pkg_create checksums files that are
+ * about to be packed up and thrown away, which would only fill it up.
+ */
+void
+cksum_cache_disable(void)
+{
+    pthread_mutex_lock(&CksumCacheLock);
+    CksumCacheTried = TRUE;
+    *CksumCachePath = '\0';
+    pthread_mutex_unlock(&CksumCacheLock);
+}
+
+/*
+ * Checksum the contents of a file, following symlinks.  Regular files
+ * that haven't changed since they were last checksummed are answered
+ * from the cache without reading them.
+ */
+char *
+cksum_file(int type, const char *fname, char *buf)
+{
+    struct stat sb;
+    char *cp;
+    int fd;
+
+    if ((fd = open(fname, O_RDONLY)) == -1)
+	return NULL;
+    if (fstat(fd, &sb) == FAIL || !S_ISREG(sb.st_mode)) {
+	cp = cksum_fd(type, fd, buf);
+	close(fd);
+	return cp;
+    }
+    if ((cp = cksum_cache_get(type, &sb, buf)) == NULL &&
+	(cp = cksum_fd(type, fd, buf)) != NULL)
+	cksum_cache_put(type, &sb, cp);
+    close(fd);
+    return cp;
+}
+
+/*
+ * Compute the checksum of an installed file the way the packing list
+ * format revision of pkg expects it to have been recorded.  Returns
+ * NULL if no checksum applies to this kind of file.
+ */
+char *
+cksum_compute(Package *pkg, const char *fname, int type, char *buf)
+{
+    struct stat sb;
+
+    if (lstat(fname, &sb) == FAIL)
+	return NULL;
+    /*
+     * For packing lists whose version is 1.1 or greater, the checksum
+     * for a symlink is calculated on the string returned by readlink().
+     */
+    if (S_ISLNK(sb.st_mode) && verscmp(pkg, 1, 0) > 0) {
+	char linkbuf[FILENAME_MAX];
+	int len;
+
+	if ((len = readlink(fname, linkbuf, FILENAME_MAX)) > 0)
+	    return cksum_data(type, linkbuf, len, buf);
+	return NULL;
+    }
+    if (S_ISLNK(sb.st_mode) && stat(fname, &sb) == FAIL)
+	return verscmp(pkg, 1, 1) < 0 ? cksum_file(type, fname, buf) : NULL;
+    if (S_ISREG(sb.st_mode) || verscmp(pkg, 1, 1) < 0)
+	return cksum_file(type, fname, buf);
+    return NULL;
+}
+
+/*
+ * Verify the installed file fname against the checksum recorded for
+ * the file entry p.  Returns 0 if it matches, 1 on a mismatch and -1
+ * if there was nothing to compare.  The type of checksum used is
+ * returned in *type.
+ */
+int
+cksum_verify(Package *pkg, PackingList p, const char *fname, int *type)
+{
+    PackingList q;
+    char buf[CKSUM_BUFSIZE];
+    const char *cp;
+    int t;
+
+    if ((q = cksum_find(p, &t)) == NULL)
+	return -1;
+    if (type != NULL)
+	*type = t;
+    if ((cp = cksum_compute(pkg, fname, t, buf)) == NULL)
+	return -1;
+    return strcmp(cp, q->name + strlen(cksum_tag(t))) ? 1 : 0;
+}
+
+/*
+ * Collect the files of a packing list for verification, in packing
+ * list order.  Files marked with @ignore are skipped, as they are when
+ * the package is deleted.  Returns the number of entries.
+ */
+int
+cksum_gather(Package *pkg, struct cksum_ent **entp)
+{
+    PackingList p;
+    struct cksum_ent *ents = NULL, *e;
+    const char *where = ".";
+    char *prefix = NULL;
+    int n = 0, max = 0;
+
+    for (p = pkg->head; p != NULL; p = p->next) {
+	switch (p->type) {
+	case PLIST_IGNORE:
+	    if (p->next == NULL)
+		break;
+	    p = p->next;
+	    break;
+
+	case PLIST_CWD:
+	    if (!prefix)
+		prefix = p->name;
+	    where = (p->name == NULL) ? prefix : p->name;
+	    break;
+
+	case PLIST_FILE:
+	    if (n == max) {
+		max = max ? max * 2 : 64;
+		if ((ents = reallocf(ents, max * sizeof(*ents))) == NULL)
+		    err(2, NULL);
+	    }
+	    e = &ents[n++];
+	    memset(e, 0, sizeof(*e));
+	    e->p = p;
+	    if (*p->name == '/')
+		e->path = strdup(p->name);
+	    else
+		asprintf(&e->path, "%s/%s", strcmp(where, "/") ? where : "",
+		    p->name);
+	    if (e->path == NULL)
+		err(2, NULL);
+	    cksum_find(p, &e->type);
+	    break;
+
+	default:
+	    break;
+	}
+    }
+    *entp = ents;
+    return n;
+}
+
+static int
+cksum_ent_cmp(const void *a, const void *b)
+{
+    const struct cksum_ent *e1 = *(struct cksum_ent * const *)a;
+    const struct cksum_ent *e2 = *(struct cksum_ent * const *)b;
+
+    if (e1->dev != e2->dev)
+	return e1->dev < e2->dev ? -1 : 1;
+    if (e1->ino != e2->ino)
+	return e1->ino < e2->ino ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Stat the gathered files and return them in the order they should be
+ * read in.  Inode numbers are handed out by cylinder group, so reading
+ * in inode order keeps the disk from seeking back and forth across the
+ * filesystem the way packing list order does.
+ */
+struct cksum_ent **
+cksum_order(struct cksum_ent *ents, int n)
+{
+    struct cksum_ent **order;
+    struct stat sb;
+    int i;
+
+    if ((order = malloc((n ? n : 1) * sizeof(*order))) == NULL)
+	err(2, NULL);
+    for (i = 0; i < n; i++) {
+	order[i] = &ents[i];
+	if (lstat(ents[i].path, &sb) == FAIL)
+	    continue;
+	ents[i].mode = sb.st_mode;
+	if (S_ISLNK(sb.st_mode) && stat(ents[i].path, &sb) == FAIL)
+	    continue;
+	ents[i].exists = TRUE;
+	ents[i].dev = sb.st_dev;
+	ents[i].ino = sb.st_ino;
+    }
+    qsort(order, n, sizeof(*order), cksum_ent_cmp);
+    return order;
+}
+
+/*
+ * Ask the kernel to start reading a file we are about to checksum,
+ * unless its checksum is going to come from the cache anyway.
+ */
+void
+cksum_prefetch(struct cksum_ent *e)
+{
+    struct stat sb;
+    char buf[CKSUM_BUFSIZE];
+    int fd;
+
+    if (!e->type || !e->exists || !S_ISREG(e->mode))
+	return;
+    if ((fd = open(e->path, O_RDONLY)) == -1)
+	return;
+    if (fstat(fd, &sb) == 0 && cksum_cache_get(e->type, &sb, buf) == NULL)
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+/*
+ * Verify all gathered files, in disk order, keeping CKSUM_READAHEAD
+ * files worth of read-ahead in flight.  The results are left in the
+ * entries, which stay in packing list order.
+ */
+void
+cksum_verify_all(Package *pkg, struct cksum_ent *ents, int n)
+{
+    struct cksum_ent **order, *e;
+    int i;
+
+    order = cksum_order(ents, n);
+    for (i = 0; i < n && i < CKSUM_READAHEAD; i++)
+	cksum_prefetch(order[i]);
+    for (i = 0; i < n; i++) {
+	if (i + CKSUM_READAHEAD < n)
+	    cksum_prefetch(order[i + CKSUM_READAHEAD]);
+	e = order[i];
+	if (CKSUM_PRESENT(e))
+	    e->result = cksum_verify(pkg, e->p, e->path, NULL);
+	else
+	    e->result = -1;
+    }
+    free(order);
+}
+
+void
+cksum_free(struct cksum_ent *ents, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+	free(ents[i].path);
+    free(ents);
+}
@@ -207,15 +207,15 @@ requiredby(const char *pkgname, struct reqr_by_head **list, Boolean strict, Bool
 
     snprintf(fname, sizeof(fname), "%s/%s/%s", LOG_DIR, pkgname,
 	     REQUIRED_BY_FNAME);
+    retval = 0;
     fp = fopen(fname, "r");
     if (fp == NULL) {
 	/* Probably pkgname doesn't have any packages that depend on it */
 	if (strict == TRUE)
 	    warnx("couldn't open dependency file '%s'", fname);
-	return 0;
+	return reqby_apply(pkgname, &rb_list, 0);
     }
 
-    retval = 0;
     while (fgets(fbuf, sizeof(fbuf), fp) != NULL) {
 	if (fbuf[strlen(fbuf) - 1] == '\n')
 	    fbuf[strlen(fbuf) - 1] = '\0';
@@ -237,5 +237,6 @@ requiredby(const char *pkgname, struct reqr_by_head **list, Boolean strict, Bool
     }
     fclose(fp);
 
-    return retval;
+    /* Include any changes that haven't been written out yet */
+    return retval < 0 ? retval : reqby_apply(pkgname, &rb_list, retval);
 }
@@ -22,11 +22,22 @@
 __FBSDID("$FreeBSD: stable/10/usr.sbin/pkg_install/lib/exec.c 252363 2013-06-29 00:37:49Z obrien $");
 
 #include "lib.h"
+#include <sys/wait.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <paths.h>
+#include <signal.h>
+#include <spawn.h>
+
+extern char **environ;
 
 /*
  * Unusual system() substitute.  Accepts format string and args,
  * builds and executes command.  Returns exit code.
+ *
+ * This goes through the shell, so only use it for commands that need
+ * one, like those in packing lists; spawn_cmd() is cheaper otherwise.
  */
 
 int
@@ -34,28 +45,20 @@ vsystem(const char *fmt, ...)
 {
     va_list args;
     char *cmd;
-    long maxargs;
     int ret;
 
-    maxargs = sysconf(_SC_ARG_MAX);
-    maxargs -= 32;			/* some slop for the sh -c */
-    cmd = malloc(maxargs);
-    if (!cmd) {
-	warnx("vsystem can't alloc arg space");
-	return 1;
-    }
-
     va_start(args, fmt);
-    if (vsnprintf(cmd, maxargs, fmt, args) > maxargs) {
-	warnx("vsystem args are too long");
-	va_end(args);
+    ret = vasprintf(&cmd, fmt, args);
+    va_end(args);
+    if (ret == -1) {
+	warnx("vsystem can't alloc arg space");
 	return 1;
     }
 #ifdef DEBUG
 printf("Executing %s\n", cmd);
 #endif
     ret = system(cmd);
-    va_end(args);
+    stat_cache_flush();
     free(cmd);
     return ret;
 }
@@ -65,26 +68,20 @@ vpipe(const char *fmt, ...)
 {
    FILE *fp;
    char *cmd, *rp;
-   long maxargs;
    va_list args;
+   int ret;
 
     rp = malloc(MAXPATHLEN);
     if (!rp) {
 	warnx("vpipe can't alloc buffer space");
 	return NULL;
     }
-    maxargs = sysconf(_SC_ARG_MAX);
-    maxargs -= 32;			    /* some slop for the sh -c */
-    cmd = alloca(maxargs);
-    if (!cmd) {
-	warnx("vpipe can't alloc arg space");
-	return NULL;
-    }
-
     va_start(args, fmt);
-    if (vsnprintf(cmd, maxargs, fmt, args) > maxargs) {
-	warnx("vsystem args are too long");
-	va_end(args);
+    ret = vasprintf(&cmd, fmt, args);
+    va_end(args);
+    if (ret == -1) {
+	warnx("vpipe can't alloc arg space");
+	free(rp);
 	return NULL;
     }
 #ifdef DEBUG
@@ -92,19 +89,401 @@ vpipe(const char *fmt, ...)
 #endif
     fflush(NULL);
     fp = popen(cmd, "r");
+    free(cmd);
     if (fp == NULL) {
 	warnx("popen() failed");
-	va_end(args);
+	free(rp);
 	return NULL;
     }
     get_string(rp, MAXPATHLEN, fp);
+    stat_cache_flush();
 #ifdef DEBUG
     fprintf(stderr, "Returned %s\n", rp);
 #endif
-    va_end(args);
     if (pclose(fp) || (strlen(rp) == 0)) {
 	free(rp);
 	return NULL;
     }
     return rp;
 }
+
+/* The environment, with the settings in env added or replaced */
+static char **
+spawn_env(char * const *env)
+{
+    char **nenv;
+    size_t len;
+    int i, j, k, n, m;
+
+    for (n = 0; environ[n] != NULL; n++)
+	;
+    for (m = 0; env[m] != NULL; m++)
+	;
+    if ((nenv = malloc((n + m + 1) * sizeof(*nenv))) == NULL)
+	return NULL;
+    for (i = j = 0; i < n; i++) {
+	for (k = 0; k < m; k++) {
+	    len = strcspn(env[k], "=");
+	    if (!strncmp(environ[i], env[k], len) && environ[i][len] == '=')
+		break;
+	}
+	if (k == m)
+	    nenv[j++] = environ[i];
+    }
+    for (k = 0; k < m; k++)
+	nenv[j++] = env[k];
+    nenv[j] = NULL;
+    return nenv;
+}
+
+/* Read the first line a command writes, and throw away the rest */
+static void
+spawn_read(int fd, char *out, size_t outlen)
+{
+    char buf[BUFSIZ];
+    size_t len = 0;
+    ssize_t r;
+
+    for (;;) {
+	if (len < outlen - 1)
+	    r = read(fd, out + len, outlen - 1 - len);
+	else
+	    r = read(fd, buf, sizeof(buf));
+	if (r == -1 && errno == EINTR)
+	    continue;
+	if (r <= 0)
+	    break;
+	if (len < outlen - 1)
+	    len += r;
+    }
+    out[len] = '\0';
+    out[strcspn(out, "\n")] = '\0';
+}
+
+/*
+ * Run a command directly, without a shell, as described by so (which
+ * may be NULL).  argv[0] is the full path of the command.  As with
+ * system(), SIGINT and SIGQUIT are ignored while waiting for it.
+ * Returns its exit status, 128 plus the signal number if it was killed
+ * or -1 if it couldn't be run at all.
+ */
+int
+spawnv_cmd(const struct spawn_opts *so, const char * const *argv)
+{
+    static const struct spawn_opts none;
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    struct sigaction ign, intsave, quitsave;
+    sigset_t sigs;
+    char **env = environ;
+    int cwd = -1, pfd[2] = { -1, -1 }, error, status;
+    pid_t pid;
+
+    if (so == NULL)
+	so = &none;
+#ifdef DEBUG
+    fprintf(stderr, "Executing %s\n", argv[0]);
+#endif
+    if (so->env != NULL && (env = spawn_env(so->env)) == NULL) {
+	warn("%s", argv[0]);
+	return -1;
+    }
+    if (so->out != NULL && so->outlen > 0) {
+	if (pipe(pfd) == -1) {
+	    warn("pipe");
+	    if (env != environ)
+		free(env);
+	    return -1;
+	}
+	*so->out = '\0';
+    }
+    /* posix_spawn() can't portably change directory for us */
+    if (so->cwd != NULL) {
+	if ((cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 ||
+	    chdir(so->cwd) == -1) {
+	    warn("%s", so->cwd);
+	    error = -1;
+	    goto done;
+	}
+    }
+
+    posix_spawn_file_actions_init(&fa);
+    if (pfd[1] != -1) {
+	posix_spawn_file_actions_adddup2(&fa, pfd[1], STDOUT_FILENO);
+	posix_spawn_file_actions_addclose(&fa, pfd[0]);
+	posix_spawn_file_actions_addclose(&fa, pfd[1]);
+    }
+    else if (so->quiet)
+	posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, _PATH_DEVNULL,
+	    O_WRONLY, 0);
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGQUIT);
+    posix_spawnattr_setsigdefault(&attr, &sigs);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    memset(&ign, 0, sizeof(ign));
+    ign.sa_handler = SIG_IGN;
+    sigaction(SIGINT, &ign, &intsave);
+    sigaction(SIGQUIT, &ign, &quitsave);
+    fflush(NULL);
+    error = posix_spawn(&pid, argv[0], &fa, &attr,
+	(char * const *)(uintptr_t)argv, env);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    if (cwd != -1 && fchdir(cwd) == -1) {
+	cleanup(0);
+	err(2, "%s: can't change back to the current directory", __func__);
+    }
+
+    if (error != 0) {
+	warnc(error, "%s", argv[0]);
+	error = -1;
+    }
+    else {
+	if (pfd[1] != -1) {
+	    close(pfd[1]);
+	    pfd[1] = -1;
+	    spawn_read(pfd[0], so->out, so->outlen);
+	}
+	while (waitpid(pid, &status, 0) == -1)
+	    if (errno != EINTR) {
+		status = -1;
+		break;
+	    }
+	if (status == -1)
+	    error = -1;
+	else if (WIFSIGNALED(status))
+	    error = 128 + WTERMSIG(status);
+	else
+	    error = WEXITSTATUS(status);
+    }
+    sigaction(SIGINT, &intsave, NULL);
+    sigaction(SIGQUIT, &quitsave, NULL);
+    stat_cache_flush();
+
+done:
+    if (cwd != -1)
+	close(cwd);
+    if (pfd[0] != -1)
+	close(pfd[0]);
+    if (pfd[1] != -1)
+	close(pfd[1]);
+    if (env != environ)
+	free(env);
+    return error;
+}
+
+/* As spawnv_cmd(), with the arguments listed after path and a NULL */
+int
+spawn_cmd(const struct spawn_opts *so, const char *path, ...)
+{
+    const char *argv[16];
+    va_list args;
+    int i = 0;
+
+    argv[i++] = path;
+    va_start(args, path);
+    while ((argv[i] = va_arg(args, const char *)) != NULL)
+	if (++i == 16) {
+	    va_end(args);
+	    warnx("%s: too many arguments", path);
+	    return -1;
+	}
+    va_end(args);
+    return spawnv_cmd(so, argv);
+}
+
+/*
+ * Packing list commands can be run in one long-lived shell rather than
+ * a new one each, which makes a big difference for packages with
+ * hundreds of @exec lines.  Each command is sent down a pipe to the
+ * shell, which runs it in a subshell, with our stdin, and writes its
+ * exit status back on descriptor 3.
+ */
+static pid_t ShellPid = -1;
+static int ShellCmdFd = -1, ShellStatusFd = -1;
+
+/* Quote a string for the shell */
+static char *
+shell_quote(const char *str)
+{
+    char *buf, *cp;
+
+    if ((buf = cp = malloc(strlen(str) * 4 + 3)) == NULL)
+	err(2, NULL);
+    *cp++ = '\'';
+    for (; *str != '\0'; str++) {
+	if (*str == '\'') {
+	    memcpy(cp, "'\\''", 4);
+	    cp += 4;
+	}
+	else
+	    *cp++ = *str;
+    }
+    *cp++ = '\'';
+    *cp = '\0';
+    return buf;
+}
+
+/* Move a descriptor clear of the ones the shell gets, closed on exec */
+static int
+shell_fd(int fd)
+{
+    int nfd;
+
+    nfd = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    close(fd);
+    return nfd;
+}
+
+static int
+shell_open(void)
+{
+    static const char *argv[] = { "sh", NULL };
+    posix_spawn_file_actions_t fa;
+    int cmd[2], status[2], error;
+
+    if (pipe(cmd) == -1)
+	return -1;
+    if (pipe(status) == -1) {
+	close(cmd[0]);
+	close(cmd[1]);
+	return -1;
+    }
+    cmd[0] = shell_fd(cmd[0]);
+    cmd[1] = shell_fd(cmd[1]);
+    status[0] = shell_fd(status[0]);
+    status[1] = shell_fd(status[1]);
+    if (cmd[0] == -1 || cmd[1] == -1 || status[0] == -1 || status[1] == -1)
+	error = errno;
+    else {
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, STDIN_FILENO, 4);
+	posix_spawn_file_actions_adddup2(&fa, cmd[0], STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&fa, status[1], 3);
+	error = posix_spawn(&ShellPid, _PATH_BSHELL, &fa, NULL,
+	    (char * const *)(uintptr_t)argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+    }
+    close(cmd[0]);
+    close(status[1]);
+    if (error != 0) {
+	warnc(error, "%s", _PATH_BSHELL);
+	close(cmd[1]);
+	close(status[0]);
+	ShellPid = -1;
+	return -1;
+    }
+    ShellCmdFd = cmd[1];
+    ShellStatusFd = status[0];
+    return 0;
+}
+
+/* Finish with the shell, if there is one */
+void
+shell_close(void)
+{
+    int status;
+
+    if (ShellPid == -1)
+	return;
+    close(ShellCmdFd);
+    close(ShellStatusFd);
+    while (waitpid(ShellPid, &status, 0) == -1 && errno == EINTR)
+	;
+    ShellPid = -1;
+    ShellCmdFd = ShellStatusFd = -1;
+}
+
+/* Write all of a command to the shell */
+static int
+shell_write(const char *buf, size_t len)
+{
+    struct sigaction ign, pipesave;
+    ssize_t r;
+
+    memset(&ign, 0, sizeof(ign));
+    ign.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ign, &pipesave);
+    while (len > 0) {
+	if ((r = write(ShellCmdFd, buf, len)) == -1) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	buf += r;
+	len -= r;
+    }
+    sigaction(SIGPIPE, &pipesave, NULL);
+    return len == 0 ? 0 : -1;
+}
+
+/* Read back the exit status of a command */
+static int
+shell_status(void)
+{
+    char buf[16];
+    size_t len = 0;
+    ssize_t r;
+
+    while (len < sizeof(buf) - 1) {
+	if ((r = read(ShellStatusFd, buf + len, 1)) == -1 && errno == EINTR)
+	    continue;
+	if (r <= 0)
+	    return -1;
+	if (buf[len] == '\n')
+	    break;
+	len++;
+    }
+    buf[len] = '\0';
+    return atoi(buf);
+}
+
+/*
+ * system() substitute for packing list commands.  If PKG_EXEC_BATCH is
+ * set in the environment, all the commands up to the next shell_close()
+ * are run by the same shell; each still gets a subshell of its own, run
+ * in the current directory, so a command can't affect the next one.
+ * As with system(), SIGINT and SIGQUIT are ignored while it runs.
+ * Returns non-zero if the command failed.
+ */
+int
+shell_cmd(const char *cmd)
+{
+    struct sigaction ign, intsave, quitsave;
+    char cwd[MAXPATHLEN], *qcwd, *qcmd, *buf;
+    int len, ret;
+
+    if ((ShellPid == -1 && (getenv(PKG_EXEC_BATCH_VNAME) == NULL ||
+	shell_open() == -1)) || getcwd(cwd, sizeof(cwd)) == NULL) {
+	ret = system(cmd);
+	stat_cache_flush();
+	return ret;
+    }
+    qcwd = shell_quote(cwd);
+    qcmd = shell_quote(cmd);
+    len = asprintf(&buf, "(cd %s && eval %s) <&4 3>&- 4<&-; echo $? >&3\n",
+	qcwd, qcmd);
+    free(qcwd);
+    free(qcmd);
+    if (len == -1)
+	err(2, NULL);
+    memset(&ign, 0, sizeof(ign));
+    ign.sa_handler = SIG_IGN;
+    sigaction(SIGINT, &ign, &intsave);
+    sigaction(SIGQUIT, &ign, &quitsave);
+    fflush(NULL);
+    if (shell_write(buf, len) == -1 || (ret = shell_status()) == -1) {
+	/* Start another one for the next command */
+	warnx("shell exited unexpectedly running '%s'", cmd);
+	shell_close();
+	ret = -1;
+    }
+    sigaction(SIGINT, &intsave, NULL);
+    sigaction(SIGQUIT, &quitsave, NULL);
+    free(buf);
+    stat_cache_flush();
+    return ret;
+}
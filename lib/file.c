@@ -23,21 +23,295 @@ __FBSDID("$FreeBSD: stable/10/usr.sbin/pkg_install/lib/file.c 236333 2012-05-30
 
 #include "lib.h"
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pwd.h>
 #include <time.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 
+/*
+ * Cache of stat(2) and lstat(2) results, so that the predicates below
+ * cost at most one system call per path however often a path is looked
+ * at.  Only absolute paths are cached, so changing directory doesn't
+ * affect it.  Anything we do to the filesystem ourselves must call
+ * stat_cache_invalidate(), and running another process must call
+ * stat_cache_flush(); vsystem(), vpipe() and spawn_cmd() do so.
+ *
+ * Paths are cached as written, less any "//" or "/./", so the same
+ * file may be cached under several names when there are symlinks on
+ * the way to it.  Each entry therefore also records the directory it
+ * is in, by device and inode, so that invalidating any one name for
+ * a file forgets all of them.
+ */
+#define STAT_CACHE_BUCKETS	256
+#define STAT_CACHE_MAX		4096
+
+struct stat_ent {
+    struct stat_ent *next;	/* With the same path hash */
+    struct stat_ent *inext;	/* With the same parent and name hash */
+    dev_t pdev;			/* Of the directory it is in */
+    ino_t pino;
+    int lerrno;			/* From lstat(2), or 0 */
+    int serrno;			/* From stat(2), or 0 */
+    struct stat lsb, sb;
+    const char *base;		/* The last component of path */
+    char path[1];
+};
+
+static struct stat_ent *StatCache[STAT_CACHE_BUCKETS];
+static struct stat_ent *StatCacheIds[STAT_CACHE_BUCKETS];
+static int StatCacheCount;
+
+static unsigned int
+stat_cache_hash(const char *path)
+{
+    unsigned int h = 5381;
+
+    while (*path)
+	h = h * 33 + (unsigned char)*path++;
+    return h % STAT_CACHE_BUCKETS;
+}
+
+static unsigned int
+stat_cache_id_hash(dev_t dev, ino_t ino, const char *base)
+{
+    return (stat_cache_hash(base) + (unsigned int)dev * 31 +
+	(unsigned int)ino) % STAT_CACHE_BUCKETS;
+}
+
+void
+stat_cache_flush(void)
+{
+    struct stat_ent *e;
+    int i;
+
+    for (i = 0; i < STAT_CACHE_BUCKETS; i++) {
+	while ((e = StatCache[i]) != NULL) {
+	    StatCache[i] = e->next;
+	    free(e);
+	}
+	StatCacheIds[i] = NULL;
+    }
+    StatCacheCount = 0;
+}
+
+/*
+ * Put an absolute path in the form it is cached under, dropping empty
+ * and "." components.  Returns FAIL for anything with a ".." in it,
+ * which can't be straightened out without following symlinks.
+ */
+static int
+stat_cache_norm(const char *path, char *buf, size_t size)
+{
+    const char *cp;
+    size_t len, n = 0;
+
+    for (cp = path; *cp != '\0'; cp += len) {
+	while (*cp == '/')
+	    cp++;
+	len = strcspn(cp, "/");
+	if (len == 0 || (len == 1 && *cp == '.'))
+	    continue;
+	if (len == 2 && cp[0] == '.' && cp[1] == '.')
+	    return FAIL;
+	if (n + len + 2 > size)
+	    return FAIL;
+	buf[n++] = '/';
+	memcpy(buf + n, cp, len);
+	n += len;
+    }
+    if (n == 0)
+	buf[n++] = '/';
+    buf[n] = '\0';
+    return SUCCESS;
+}
+
+/* Find the directory a normalised path is in, by device and inode */
+static int
+stat_cache_parent(char *path, const char **base, dev_t *dev, ino_t *ino)
+{
+    struct stat sb;
+    char *cp;
+    int rv;
+
+    cp = strrchr(path, '/');
+    *base = cp + 1;
+    if (cp == path)
+	rv = stat("/", &sb);
+    else {
+	*cp = '\0';
+	rv = stat(path, &sb);
+	*cp = '/';
+    }
+    if (rv == FAIL)
+	return FAIL;
+    *dev = sb.st_dev;
+    *ino = sb.st_ino;
+    return SUCCESS;
+}
+
+static void
+stat_cache_remove(struct stat_ent *e)
+{
+    struct stat_ent **ep;
+
+    for (ep = &StatCache[stat_cache_hash(e->path)]; *ep != e;
+	ep = &(*ep)->next)
+	;
+    *ep = e->next;
+    for (ep = &StatCacheIds[stat_cache_id_hash(e->pdev, e->pino, e->base)];
+	*ep != e; ep = &(*ep)->inext)
+	;
+    *ep = e->inext;
+    free(e);
+    StatCacheCount--;
+}
+
+/*
+ * Find or create the cache entry for an absolute path.  Nothing is
+ * cached for a path whose directory doesn't exist.
+ */
+static struct stat_ent *
+stat_cache_lookup(const char *path)
+{
+    struct stat_ent *e;
+    char norm[MAXPATHLEN];
+    const char *base;
+    dev_t pdev;
+    ino_t pino;
+    unsigned int h;
+    size_t len;
+
+    if (*path != '/' || stat_cache_norm(path, norm, sizeof(norm)) == FAIL)
+	return NULL;
+    h = stat_cache_hash(norm);
+    for (e = StatCache[h]; e != NULL; e = e->next)
+	if (!strcmp(e->path, norm))
+	    return e;
+
+    if (stat_cache_parent(norm, &base, &pdev, &pino) == FAIL)
+	return NULL;
+    len = strlen(norm);
+    if ((e = malloc(sizeof(*e) + len)) == NULL)
+	return NULL;
+    memcpy(e->path, norm, len + 1);
+    e->base = e->path + (base - norm);
+    e->pdev = pdev;
+    e->pino = pino;
+    e->lerrno = lstat(norm, &e->lsb) == FAIL ? errno : 0;
+    /* Only symlinks need a second look to answer stat() */
+    if (e->lerrno || !S_ISLNK(e->lsb.st_mode)) {
+	e->serrno = e->lerrno;
+	e->sb = e->lsb;
+    } else
+	e->serrno = stat(norm, &e->sb) == FAIL ? errno : 0;
+
+    if (StatCacheCount >= STAT_CACHE_MAX)
+	stat_cache_flush();
+    e->next = StatCache[h];
+    StatCache[h] = e;
+    h = stat_cache_id_hash(pdev, pino, e->base);
+    e->inext = StatCacheIds[h];
+    StatCacheIds[h] = e;
+    StatCacheCount++;
+    return e;
+}
+
+/*
+ * Forget what we know about a path we are about to change, under any
+ * of its names.  If it is a directory, which may be known by names we
+ * can't work out from here, everything is forgotten.
+ */
+void
+stat_cache_invalidate(const char *path)
+{
+    struct stat_ent *e, *next;
+    struct stat sb;
+    char cwd[MAXPATHLEN], abs[MAXPATHLEN], norm[MAXPATHLEN];
+    const char *base;
+    dev_t pdev;
+    ino_t pino;
+
+    if (StatCacheCount == 0)
+	return;
+    if (*path != '/') {
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+	    stat_cache_flush();
+	    return;
+	}
+	snprintf(abs, sizeof(abs), "%s/%s", cwd, path);
+	path = abs;
+    }
+    if (stat_cache_norm(path, norm, sizeof(norm)) == FAIL ||
+	(lstat(norm, &sb) == 0 && S_ISDIR(sb.st_mode))) {
+	stat_cache_flush();
+	return;
+    }
+
+    for (e = StatCache[stat_cache_hash(norm)]; e != NULL; e = e->next)
+	if (!strcmp(e->path, norm)) {
+	    /* Was a directory, until somebody else changed it */
+	    if (!e->lerrno && S_ISDIR(e->lsb.st_mode)) {
+		stat_cache_flush();
+		return;
+	    }
+	    stat_cache_remove(e);
+	    break;
+	}
+    if (stat_cache_parent(norm, &base, &pdev, &pino) == FAIL)
+	return;
+    for (e = StatCacheIds[stat_cache_id_hash(pdev, pino, base)]; e != NULL;
+	e = next) {
+	next = e->inext;
+	if (e->pdev == pdev && e->pino == pino && !strcmp(e->base, base)) {
+	    if (!e->lerrno && S_ISDIR(e->lsb.st_mode)) {
+		stat_cache_flush();
+		return;
+	    }
+	    stat_cache_remove(e);
+	}
+    }
+}
+
+int
+cached_stat(const char *path, struct stat *sb)
+{
+    struct stat_ent *e;
+
+    if ((e = stat_cache_lookup(path)) == NULL)
+	return stat(path, sb);
+    if (e->serrno) {
+	errno = e->serrno;
+	return FAIL;
+    }
+    *sb = e->sb;
+    return SUCCESS;
+}
+
+int
+cached_lstat(const char *path, struct stat *sb)
+{
+    struct stat_ent *e;
+
+    if ((e = stat_cache_lookup(path)) == NULL)
+	return lstat(path, sb);
+    if (e->lerrno) {
+	errno = e->lerrno;
+	return FAIL;
+    }
+    *sb = e->lsb;
+    return SUCCESS;
+}
+
 /* Quick check to see if a file exists */
 Boolean
 fexists(const char *fname)
 {
-    int fd;
-
-    if ((fd = open(fname, O_RDONLY)) == -1)
-	return FALSE;
+    struct stat sb;
 
-    close(fd);
-    return TRUE;
+    return cached_stat(fname, &sb) != FAIL;
 }
 
 /* Quick check to see if something is a directory or symlink to a directory */
@@ -46,9 +320,7 @@ isdir(const char *fname)
 {
     struct stat sb;
 
-    if (lstat(fname, &sb) != FAIL && S_ISDIR(sb.st_mode))
-	return TRUE;
-    else if (lstat(strconcat(fname, "/."), &sb) != FAIL && S_ISDIR(sb.st_mode))
+    if (cached_stat(fname, &sb) != FAIL && S_ISDIR(sb.st_mode))
 	return TRUE;
     else
 	return FALSE;
@@ -85,7 +357,7 @@ Boolean
 isfile(const char *fname)
 {
     struct stat sb;
-    if (stat(fname, &sb) != FAIL && S_ISREG(sb.st_mode))
+    if (cached_stat(fname, &sb) != FAIL && S_ISREG(sb.st_mode))
 	return TRUE;
     return FALSE;
 }
@@ -99,7 +371,7 @@ Boolean
 isemptyfile(const char *fname)
 {
     struct stat sb;
-    if (stat(fname, &sb) != FAIL && S_ISREG(sb.st_mode)) {
+    if (cached_stat(fname, &sb) != FAIL && S_ISREG(sb.st_mode)) {
 	if (sb.st_size != 0)
 	    return FALSE;
     }
@@ -111,7 +383,7 @@ Boolean
 issymlink(const char *fname)
 {
     struct stat sb;
-    if (lstat(fname, &sb) != FAIL && S_ISLNK(sb.st_mode))
+    if (cached_lstat(fname, &sb) != FAIL && S_ISLNK(sb.st_mode))
 	return TRUE;
     return FALSE;
 }
@@ -139,43 +411,38 @@ char *
 fileFindByPath(const char *base, const char *fname)
 {
     static char tmp[FILENAME_MAX];
-    char *cp;
-    const char *suffixes[] = {".tbz", ".tgz", ".tar", ".txz", NULL};
-    int i;
+    char dir[FILENAME_MAX], *cp, *path;
 
     if (fexists(fname) && isfile(fname)) {
 	strcpy(tmp, fname);
 	return tmp;
     }
     if (base) {
-	strcpy(tmp, base);
+	strlcpy(dir, base, FILENAME_MAX);
 
-	cp = strrchr(tmp, '/');
+	cp = strrchr(dir, '/');
 	if (cp) {
 	    *cp = '\0';	/* chop name */
-	    cp = strrchr(tmp, '/');
+	    cp = strrchr(dir, '/');
+	}
+	if (cp) {
+	    strcpy(cp + 1, "All");
+	    if (repo_find(dir, fname, tmp, FILENAME_MAX))
+		return tmp;
 	}
-	if (cp)
-	    for (i = 0; suffixes[i] != NULL; i++) {
-		*(cp + 1) = '\0';
-		strcat(cp, "All/");
-		strcat(cp, fname);
-		strcat(cp, suffixes[i]);
-		if (fexists(tmp))
-		    return tmp;
-	    }
     }
 
-    cp = getenv("PKG_PATH");
+    if ((cp = getenv("PKG_PATH")) == NULL)
+	return NULL;
+    if ((path = cp = strdup(cp)) == NULL)
+	return NULL;
     while (cp) {
-	char *cp2 = strsep(&cp, ":");
-
-	for (i = 0; suffixes[i] != NULL; i++) {
-	    snprintf(tmp, FILENAME_MAX, "%s/%s%s", cp2 ? cp2 : cp, fname, suffixes[i]);
-	    if (fexists(tmp) && isfile(tmp))
-		return tmp;
+	if (repo_find(strsep(&cp, ":"), fname, tmp, FILENAME_MAX)) {
+	    free(path);
+	    return tmp;
 	}
     }
+    free(path);
     return NULL;
 }
 
@@ -249,6 +516,7 @@ write_file(const char *name, const char *str)
     FILE *fp;
     size_t len;
 
+    stat_cache_invalidate(name);
     fp = fopen(name, "w");
     if (!fp) {
 	cleanup(0);
@@ -266,26 +534,242 @@ write_file(const char *name, const char *str)
     }
 }
 
+/*
+ * Native copying, so that copying or moving a file doesn't cost us a
+ * fork and exec of cp, mv or a pair of tars.  Anything we can't handle
+ * here (sockets, say) fails, and the callers then fall back on the
+ * external commands.
+ */
+#define COPY_IOSIZE	(1024 * 1024)
+
+/* Copy the rest of one open file into another */
+static int
+copy_data(int from, int to)
+{
+    static char *buf;
+    ssize_t r, w, off;
+
+    if (buf == NULL && (buf = malloc(COPY_IOSIZE)) == NULL)
+	return FAIL;
+    while ((r = read(from, buf, COPY_IOSIZE)) > 0)
+	for (off = 0; off < r; off += w)
+	    if ((w = write(to, buf + off, r - off)) == -1)
+		return FAIL;
+    return r == 0 ? SUCCESS : FAIL;
+}
+
+/*
+ * Give a copy the attributes of the original.  With preserve, that is
+ * everything tar -p would restore: owner, mode, times and file flags.
+ * Without, the mode less the umask, as cp(1) does.
+ */
+static int
+copy_attrs(const char *to, const struct stat *sb, Boolean preserve)
+{
+    struct timeval tv[2];
+    mode_t mask;
+
+    if (!preserve) {
+	mask = umask(0);
+	umask(mask);
+	return lchmod(to, sb->st_mode & ALLPERMS & ~mask);
+    }
+    /* Like tar, only insist on the owner if we are able to set it */
+    if (lchown(to, sb->st_uid, sb->st_gid) == FAIL && geteuid() == 0)
+	return FAIL;
+    if (lchmod(to, sb->st_mode & ALLPERMS) == FAIL)
+	return FAIL;
+    TIMESPEC_TO_TIMEVAL(&tv[0], &sb->st_atim);
+    TIMESPEC_TO_TIMEVAL(&tv[1], &sb->st_mtim);
+    if (lutimes(to, tv) == FAIL)
+	return FAIL;
+    if (sb->st_flags && lchflags(to, sb->st_flags) == FAIL)
+	return FAIL;
+    return SUCCESS;
+}
+
+/*
+ * Copy a file, symlink or directory tree.  Symlinks are copied, not
+ * followed, except for from itself if follow is set.  With preserve,
+ * FIFOs and device nodes are made afresh, as tar -p would.
+ */
+static int
+copy_node(const char *from, const char *to, Boolean follow, Boolean preserve)
+{
+    struct stat sb;
+    struct dirent *dp;
+    DIR *dirp;
+    char f[FILENAME_MAX], t[FILENAME_MAX];
+    int ifd, ofd, rv;
+
+    if ((follow ? stat(from, &sb) : lstat(from, &sb)) == FAIL)
+	return FAIL;
+    stat_cache_invalidate(to);
+
+    if (S_ISDIR(sb.st_mode)) {
+	/* Merge into a directory already there, or replace anything else */
+	if (mkdir(to, 0700) == FAIL && (errno != EEXIST || (!isdir(to) &&
+	    (unlink(to) == FAIL || mkdir(to, 0700) == FAIL))))
+	    return FAIL;
+	if ((dirp = opendir(from)) == NULL)
+	    return FAIL;
+	rv = SUCCESS;
+	while (rv == SUCCESS && (dp = readdir(dirp)) != NULL) {
+	    if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+		continue;
+	    snprintf(f, FILENAME_MAX, "%s/%s", from, dp->d_name);
+	    snprintf(t, FILENAME_MAX, "%s/%s", to, dp->d_name);
+	    rv = copy_node(f, t, FALSE, preserve);
+	}
+	closedir(dirp);
+	/* Last, so that copying the contents doesn't change the times */
+	return rv == SUCCESS ? copy_attrs(to, &sb, preserve) : FAIL;
+    }
+
+    if (unlink(to) == FAIL && errno != ENOENT)
+	return FAIL;
+    if (S_ISLNK(sb.st_mode)) {
+	ssize_t len;
+
+	if ((len = readlink(from, f, FILENAME_MAX - 1)) == -1)
+	    return FAIL;
+	f[len] = '\0';
+	if (symlink(f, to) == FAIL)
+	    return FAIL;
+    }
+    else if (S_ISREG(sb.st_mode)) {
+	if ((ifd = open(from, O_RDONLY)) == -1)
+	    return FAIL;
+	if ((ofd = open(to, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1) {
+	    close(ifd);
+	    return FAIL;
+	}
+	rv = copy_data(ifd, ofd);
+	close(ifd);
+	if (close(ofd) == FAIL || rv == FAIL) {
+	    unlink(to);
+	    return FAIL;
+	}
+    }
+    else if (preserve && S_ISFIFO(sb.st_mode)) {
+	if (mkfifo(to, 0600) == FAIL)
+	    return FAIL;
+    }
+    else if (preserve && (S_ISCHR(sb.st_mode) || S_ISBLK(sb.st_mode))) {
+	if (mknod(to, (sb.st_mode & S_IFMT) | 0600, sb.st_rdev) == FAIL)
+	    return FAIL;
+    }
+    else
+	return FAIL;
+    return copy_attrs(to, &sb, preserve);
+}
+
+/* Remove a file, symlink or directory tree */
+static int
+remove_node(const char *path)
+{
+    struct stat sb;
+    struct dirent *dp;
+    DIR *dirp;
+    char p[FILENAME_MAX];
+    int rv = SUCCESS;
+
+    if (lstat(path, &sb) == FAIL)
+	return FAIL;
+    stat_cache_invalidate(path);
+    if (!S_ISDIR(sb.st_mode))
+	return unlink(path);
+    if ((dirp = opendir(path)) == NULL)
+	return FAIL;
+    while (rv == SUCCESS && (dp = readdir(dirp)) != NULL) {
+	if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+	    continue;
+	snprintf(p, FILENAME_MAX, "%s/%s", path, dp->d_name);
+	rv = remove_node(p);
+    }
+    closedir(dirp);
+    return rv == SUCCESS ? rmdir(path) : FAIL;
+}
+
+/*
+ * Make a path to be copied to or from absolute, so that the stat cache
+ * needn't look up the current directory for each file in it.
+ */
+static void
+copy_abs(char *path)
+{
+    char cwd[MAXPATHLEN], tmp[FILENAME_MAX];
+
+    if (*path == '/' || getcwd(cwd, sizeof(cwd)) == NULL)
+	return;
+    snprintf(tmp, sizeof(tmp), "%s/%s", cwd, path);
+    strlcpy(path, tmp, FILENAME_MAX);
+}
+
+/* Create the missing parent directories of a path, as tar does */
+static void
+copy_parents(const char *to)
+{
+    char dir[FILENAME_MAX], *cp;
+
+    strlcpy(dir, to, FILENAME_MAX);
+    for (cp = strchr(dir, '/'); cp != NULL; cp = strchr(cp + 1, '/')) {
+	*cp = '\0';
+	if (*dir && !isdir(dir)) {
+	    stat_cache_invalidate(dir);
+	    (void)mkdir(dir, 0777);
+	}
+	*cp = '/';
+    }
+}
+
 void
 copy_file(const char *dir, const char *fname, const char *to)
 {
-    char cmd[FILENAME_MAX];
+    char from[FILENAME_MAX], dest[FILENAME_MAX];
+    const char *cp;
+    struct stat sb;
+    Boolean existed;
 
     if (fname[0] == '/')
-	snprintf(cmd, FILENAME_MAX, "/bin/cp -r %s %s", fname, to);
+	strlcpy(from, fname, FILENAME_MAX);
+    else
+	snprintf(from, FILENAME_MAX, "%s/%s", dir, fname);
+    /* Like cp, copy into the destination if it is a directory */
+    if (isdir(to)) {
+	cp = strrchr(from, '/');
+	snprintf(dest, FILENAME_MAX, "%s/%s", to, cp ? cp + 1 : from);
+    }
     else
-	snprintf(cmd, FILENAME_MAX, "/bin/cp -r %s/%s %s", dir, fname, to);
-    if (vsystem(cmd)) {
+	strlcpy(dest, to, FILENAME_MAX);
+    copy_abs(from);
+    copy_abs(dest);
+    existed = lstat(dest, &sb) == 0;
+    if (copy_node(from, dest, TRUE, FALSE) == SUCCESS)
+	return;
+    /* Don't leave cp(1) a half made copy to copy into */
+    if (!existed)
+	(void)remove_node(dest);
+
+    if (spawn_cmd(NULL, "/bin/cp", "-r", from, to, NULL)) {
 	cleanup(0);
-	errx(2, "%s: could not perform '%s'", __func__, cmd);
+	errx(2, "%s: could not perform '/bin/cp -r %s %s'", __func__, from, to);
     }
 }
 
-void
+/*
+ * Move fname, relative to dir unless it is absolute, to the same name
+ * relative to tdir, as mv(1) would: into the target if that is a
+ * directory, and across filesystems by copying and then removing.
+ * Returns FAIL if it couldn't be moved.
+ */
+int
 move_file(const char *dir, const char *fname, const char *tdir)
 {
     char from[FILENAME_MAX];
     char to[FILENAME_MAX];
+    const char *cp;
+    struct stat sb;
 
     if (fname[0] == '/')
 	strncpy(from, fname, FILENAME_MAX);
@@ -293,13 +777,57 @@ move_file(const char *dir, const char *fname, const char *tdir)
 	snprintf(from, FILENAME_MAX, "%s/%s", dir, fname);
 
     snprintf(to, FILENAME_MAX, "%s/%s", tdir, fname);
+    if (isdir(to)) {
+	cp = strrchr(from, '/');
+	strlcat(to, "/", FILENAME_MAX);
+	strlcat(to, cp ? cp + 1 : from, FILENAME_MAX);
+    }
+    copy_abs(from);
+    copy_abs(to);
 
-    if (rename(from, to) == -1) {
-        if (vsystem("/bin/mv %s %s", from, to)) {
-	    cleanup(0);
-	    errx(2, "%s: could not move '%s' to '%s'", __func__, from, to);
-	}
+    stat_cache_invalidate(from);
+    stat_cache_invalidate(to);
+    if (rename(from, to) == 0)
+	return SUCCESS;
+    /*
+     * Across filesystems, copy everything then remove it.  Like mv, an
+     * empty directory in the way is replaced and any other is an error.
+     */
+    if (errno == EXDEV &&
+	(lstat(to, &sb) == FAIL || !S_ISDIR(sb.st_mode) || rmdir(to) == 0)) {
+	if (move_node(from, to) == SUCCESS)
+	    return SUCCESS;
     }
+    if (spawn_cmd(NULL, "/bin/mv", from, to, NULL)) {
+	warnx("%s: could not move '%s' to '%s'", __func__, from, to);
+	return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Move from to to where they are on different filesystems, copying
+ * everything as tar -p would and then removing the original.  Files in
+ * the way are replaced, and directories merged into.  Returns FAIL if
+ * it can't be done here, having removed anything it made, so that the
+ * caller can fall back on an external command.
+ */
+int
+move_node(const char *from, const char *to)
+{
+    struct stat sb;
+    Boolean existed;
+
+    existed = lstat(to, &sb) == 0;
+    if (copy_node(from, to, FALSE, TRUE) == FAIL) {
+	/* Or mv(1) or tar would add to the half made copy */
+	if (!existed)
+	    (void)remove_node(to);
+	return FAIL;
+    }
+    if (remove_node(from) == FAIL)
+	warn("%s: unable to remove after copying", from);
+    return SUCCESS;
 }
 
 /*
@@ -307,21 +835,38 @@ move_file(const char *dir, const char *fname, const char *tdir)
  * if "to" is TRUE, from the current directory to a location someplace
  * else.
  *
- * Though slower, using tar to copy preserves symlinks and everything
- * without me having to write some big hairy routine to do it.
+ * This is done natively, preserving symlinks, owners, modes and times
+ * as tar -p would; tar is only used for what we can't copy ourselves.
  */
 void
 copy_hierarchy(const char *dir, const char *fname, Boolean to)
 {
-    char cmd[FILENAME_MAX * 3];
+    char cmd[FILENAME_MAX * 3], from[FILENAME_MAX], dest[FILENAME_MAX];
+    const char *rel;
 
+    /* tar strips the leading slash from absolute names */
+    for (rel = fname; *rel == '/'; rel++)
+	;
     if (!to) {
 	/* If absolute path, use it */
 	if (*fname == '/')
 	    dir = "/";
+	snprintf(from, FILENAME_MAX, "%s/%s", dir, rel);
+	strlcpy(dest, rel, FILENAME_MAX);
+    }
+    else {
+	strlcpy(from, fname, FILENAME_MAX);
+	snprintf(dest, FILENAME_MAX, "%s/%s", dir, rel);
+    }
+    copy_abs(from);
+    copy_abs(dest);
+    copy_parents(dest);
+    if (copy_node(from, dest, FALSE, TRUE) == SUCCESS)
+	return;
+
+    if (!to)
 	snprintf(cmd, FILENAME_MAX * 3, "/usr/bin/tar cf - -C %s %s | /usr/bin/tar xpf -",
 		 dir, fname);
-    }
     else
 	snprintf(cmd, FILENAME_MAX * 3, "/usr/bin/tar cf - %s | /usr/bin/tar xpf - -C %s",
 		 fname, dir);
@@ -332,39 +877,7 @@ copy_hierarchy(const char *dir, const char *fname, Boolean to)
 	cleanup(0);
 	errx(2, "%s: could not perform '%s'", __func__, cmd);
     }
-}
-
-/* Unpack a tar file */
-int
-unpack(const char *pkg, const char *flist)
-{
-    const char *comp, *cp;
-    char suff[80];
-
-    comp = "";
-    /*
-     * Figure out by a crude heuristic whether this or not this is probably
-     * compressed and whichever compression utility was used (gzip or bzip2).
-     */
-    if (strcmp(pkg, "-")) {
-	cp = strrchr(pkg, '.');
-	if (cp) {
-	    strcpy(suff, cp + 1);
-	    if (strchr(suff, 'z') || strchr(suff, 'Z')) {
-		if (strchr(suff, 'b'))
-		    comp = "-j";
-		else
-		    comp = "-z";
-	    }
-	}
-    }
-    else
-	comp = "-j";
-    if (vsystem("/usr/bin/tar -xp %s -f '%s' %s", comp, pkg, flist ? flist : "")) {
-	warnx("tar extract of %s failed!", pkg);
-	return 1;
-    }
-    return 0;
+    stat_cache_flush();
 }
 
 /*
@@ -434,3 +947,81 @@ format_cmd(char *buf, int max, const char *fmt, const char *dir, const char *nam
     }
     *buf = '\0';
 }
+
+static int LogDirLock = -1;
+
+/*
+ * Is the descriptor named in our environment one we inherited, open on
+ * LOG_DIR and locked?  Anyone can set the variable, so it is only taken
+ * at its word if flock() agrees: on the holder's own descriptor that
+ * succeeds at once, while on any other it fails as long as the holder
+ * is still about.
+ */
+static int
+log_dir_inherited(const char *var)
+{
+    struct stat fsb, dsb;
+    const char *errstr;
+    int fd;
+
+    fd = strtonum(var, 0, INT_MAX, &errstr);
+    if (errstr != NULL || fcntl(fd, F_GETFD) == FAIL ||
+	fstat(fd, &fsb) == FAIL || stat(LOG_DIR, &dsb) == FAIL ||
+	fsb.st_dev != dsb.st_dev || fsb.st_ino != dsb.st_ino ||
+	flock(fd, LOCK_EX | LOCK_NB) == FAIL)
+	return -1;
+    return fd;
+}
+
+/*
+ * Take the lock that pkg_add and pkg_delete hold on the package database
+ * while they change it, first waiting for anyone else to finish.  Package
+ * scripts run meanwhile may run pkg_add or pkg_delete themselves, so the
+ * locked descriptor is left open across exec, and its number is passed
+ * on through the environment for them to pick up.
+ */
+void
+lock_log_dir(void)
+{
+    const char *dir = LOG_DIR, *cp;
+    char num[16];
+
+    if (LogDirLock != -1)
+	return;
+    if ((cp = getenv(PKG_DBLOCK_VNAME)) != NULL) {
+	if ((LogDirLock = log_dir_inherited(cp)) != -1)
+	    return;
+	unsetenv(PKG_DBLOCK_VNAME);
+    }
+    /* Nothing has been installed yet, but it is about to be */
+    if (mkdir(dir, 0755) == SUCCESS)
+	stat_cache_invalidate(dir);
+    if ((LogDirLock = open(dir, O_RDONLY)) == -1) {
+	warn("can't lock %s", dir);
+	return;
+    }
+    if (flock(LogDirLock, LOCK_EX | LOCK_NB) == FAIL) {
+	if (errno == EWOULDBLOCK) {
+	    warnx("waiting for another process to finish with %s", dir);
+	    if (flock(LogDirLock, LOCK_EX) == SUCCESS)
+		goto locked;
+	}
+	warn("can't lock %s", dir);
+	close(LogDirLock);
+	LogDirLock = -1;
+	return;
+    }
+ locked:
+    snprintf(num, sizeof(num), "%d", LogDirLock);
+    setenv(PKG_DBLOCK_VNAME, num, 1);
+}
+
+void
+unlock_log_dir(void)
+{
+    if (LogDirLock == -1)
+	return;
+    close(LogDirLock);
+    LogDirLock = -1;
+    unsetenv(PKG_DBLOCK_VNAME);
+}
@@ -77,6 +77,15 @@
 #define PKG_DBDIR	"PKG_DBDIR"
 /* macro to get name of directory where we put logging information */
 #define LOG_DIR		(getenv(PKG_DBDIR) ? getenv(PKG_DBDIR) : DEF_LOG_DIR)
+/* The descriptor holding the lock on LOG_DIR, for everything run meanwhile */
+#define PKG_DBLOCK_VNAME	"_PKG_DBLOCK"
+
+/* Where the query service listens by default, else ${PKG_SERVICE} if set */
+#define DEF_SERVICE	"/var/run/pkg_info.sock"
+/* just in case we change the environment variable name */
+#define PKG_SERVICE	"PKG_SERVICE"
+/* macro to get the name of the query service's socket */
+#define SERVICE_PATH	(getenv(PKG_SERVICE) ? getenv(PKG_SERVICE) : DEF_SERVICE)
 
 /* The names of our "special" files */
 #define CONTENTS_FNAME		"+CONTENTS"
@@ -90,24 +99,41 @@
 #define REQUIRED_BY_FNAME	"+REQUIRED_BY"
 #define DISPLAY_FNAME		"+DISPLAY"
 #define MTREE_FNAME		"+MTREE_DIRS"
+#define REPO_INDEX_FNAME	".pkgindex"
+#define CKSUM_CACHE_FNAME	"pkg_cksum.db"
 
 #define CMD_CHAR		'@'	/* prefix for extended PLIST cmd */
 
 /* The name of the "prefix" environment variable given to scripts */
 #define PKG_PREFIX_VNAME	"PKG_PREFIX"
 
+/* If set, run a package's @exec/@unexec commands in a single shell */
+#define PKG_EXEC_BATCH_VNAME	"PKG_EXEC_BATCH"
+
 /*
  * Version of the package tools - increase whenever you make a change
  * in the code that is not cosmetic only.
  */
-#define PKG_INSTALL_VERSION	20130122
+#define PKG_INSTALL_VERSION	20261018
 
 #define PKG_WRAPCONF_FNAME	"/var/db/pkg_install.conf"
 #define main(argc, argv)	real_main(argc, argv)
 
 /* Version numbers to assist with changes in package file format */
 #define PLIST_FMT_VER_MAJOR	1
-#define PLIST_FMT_VER_MINOR	1
+#define PLIST_FMT_VER_MINOR	2
+
+/* Total size of the files in a package, recorded by pkg_create */
+#define PKG_SIZE_TAG		"PKG_SIZE:"
+
+/* Checksums that can be recorded for a file in the packing list */
+#define CKSUM_MD5		0x01
+#define CKSUM_SHA256		0x02
+#define CKSUM_MD5_TAG		"MD5:"
+#define CKSUM_SHA256_TAG	"SHA256:"
+#define CKSUM_BUFSIZE		65	/* Big enough for any hex digest */
+#define CKSUM_IOSIZE		(64 * 1024)
+#define CKSUM_READAHEAD		16	/* Files hinted ahead of the reader */
 
 enum _plist_t {
     PLIST_FILE, PLIST_CWD, PLIST_CMD, PLIST_CHMOD,
@@ -143,6 +169,46 @@ struct _pack {
 };
 typedef struct _pack Package;
 
+/* A file to be verified against its recorded checksum */
+struct cksum_ent {
+    PackingList p;
+    char *path;
+    int type;			/* Preferred recorded checksum, or 0 */
+    int result;			/* As returned by cksum_verify() */
+    Boolean exists;
+    mode_t mode;		/* From lstat(2) */
+    dev_t dev;			/* From stat(2) */
+    ino_t ino;
+};
+
+/*
+ * Is a gathered file there to be checked?  A dangling symlink is: its
+ * checksum is of the name it points to, not of a target.
+ */
+#define CKSUM_PRESENT(e)	((e)->exists || S_ISLNK((e)->mode))
+
+/* A "+" file read from the head of a package archive */
+struct pkg_meta_ent {
+    char *name;
+    char *data;
+    size_t len;
+    mode_t mode;
+};
+
+struct pkg_meta {
+    struct pkg_meta_ent *ents;
+    int n;
+};
+
+/* How to run a command with spawn_cmd(), if not simply as we are */
+struct spawn_opts {
+    const char *cwd;		/* Directory to run it in */
+    char * const *env;		/* "NAME=value" settings, NULL terminated */
+    char *out;			/* Where to put the first line of its output */
+    size_t outlen;
+    Boolean quiet;		/* Throw its output away */
+};
+
 struct reqr_by_entry {
     STAILQ_ENTRY(reqr_by_entry) link;
     char pkgname[PATH_MAX];
@@ -153,8 +219,13 @@ STAILQ_HEAD(reqr_by_head, reqr_by_entry);
 /* Misc */
 int		vsystem(const char *, ...);
 char		*vpipe(const char *, ...);
+int		spawn_cmd(const struct spawn_opts *, const char *, ...);
+int		spawnv_cmd(const struct spawn_opts *, const char * const *);
+int		shell_cmd(const char *);
+void		shell_close(void);
 void		cleanup(int);
 const char	*make_playpen(char *, off_t);
+const char	*enter_playpen(const char *);
 char		*where_playpen(void);
 int		leave_playpen(void);
 off_t		min_free(const char *);
@@ -171,6 +242,12 @@ char		*strconcat(const char *, const char *);
 char		*get_string(char *, int, FILE *);
 
 /* File */
+int		cached_stat(const char *, struct stat *);
+int		cached_lstat(const char *, struct stat *);
+void		stat_cache_invalidate(const char *);
+void		stat_cache_flush(void);
+void		lock_log_dir(void);
+void		unlock_log_dir(void);
 Boolean		fexists(const char *);
 Boolean		isdir(const char *);
 Boolean		isemptydir(const char *fname);
@@ -179,17 +256,58 @@ Boolean		isfile(const char *);
 Boolean		isempty(const char *);
 Boolean		issymlink(const char *);
 Boolean		isURL(const char *);
+Boolean		fileComposeURL(const char *, const char *, char *);
 const char	*fileGetURL(const char *, const char *, int);
+void		fileFetchAll(const char *, const char **, int);
+off_t		fileStatURL(const char *, char *);
+int		fileMetaURL(const char *, struct pkg_meta *);
 char		*fileFindByPath(const char *, const char *);
 char		*fileGetContents(const char *);
 void		write_file(const char *, const char *);
 void		copy_file(const char *, const char *, const char *);
-void		move_file(const char *, const char *, const char *);
+int		move_file(const char *, const char *, const char *);
+int		move_node(const char *, const char *);
 void		copy_hierarchy(const char *, const char *, Boolean);
 int		delete_hierarchy(const char *, Boolean, Boolean);
-int		unpack(const char *, const char *);
 void		format_cmd(char *, int, const char *, const char *, const char *);
 
+/* Archives */
+int		unpack(const char *, const char *);
+int		unpack_fp(const char *, FILE *, int);
+int		unpack_pkg(const char *, struct pkg_meta *,
+		    int (*)(struct pkg_meta *, void *), void *);
+int		pkg_meta_load(const char *, struct pkg_meta *);
+int		pkg_meta_load_fp(const char *, FILE *, struct pkg_meta *);
+int		pkg_meta_extract(struct pkg_meta *);
+off_t		pkg_meta_size(struct pkg_meta *);
+off_t		unpack_size(const char *);
+const char	*pkg_meta_get(struct pkg_meta *, const char *, size_t *);
+int		pkg_meta_plist(struct pkg_meta *, Package *);
+void		pkg_meta_free(struct pkg_meta *);
+
+/* Checksums */
+int		cksum_type(const char *);
+const char	*cksum_name(int);
+const char	*cksum_tag(int);
+int		cksum_parse(const char *);
+PackingList	cksum_find(PackingList, int *);
+char		*cksum_data(int, const void *, size_t, char *);
+char		*cksum_fd(int, int, char *);
+char		*cksum_file(int, const char *, char *);
+char		*cksum_compute(Package *, const char *, int, char *);
+int		cksum_verify(Package *, PackingList, const char *, int *);
+void		cksum_cache_close(void);
+void		cksum_cache_forget(const char *);
+void		cksum_cache_disable(void);
+int		cksum_gather(Package *, struct cksum_ent **);
+struct cksum_ent **cksum_order(struct cksum_ent *, int);
+void		cksum_prefetch(struct cksum_ent *);
+void		cksum_verify_all(Package *, struct cksum_ent *, int);
+void		cksum_free(struct cksum_ent *, int);
+
+/* Repository */
+Boolean		repo_find(const char *, const char *, char *, size_t);
+
 /* Msg */
 void		upchuck(const char *);
 void		barf(const char *, ...);
@@ -200,6 +318,7 @@ Boolean		y_or_n(Boolean, const char *, ...);
 PackingList	new_plist_entry(void);
 PackingList	last_plist(Package *);
 PackingList	find_plist(Package *, plist_t);
+off_t		plist_size(Package *);
 char		*find_plist_option(Package *, const char *name);
 void		plist_delete(Package *, Boolean, plist_t, const char *);
 void		free_plist(Package *);
@@ -220,16 +339,28 @@ int		real_main(int, char **);
 
 /* Query installed packages */
 char		**matchinstalled(legacy_match_t, char **, int *);
+char		**matchinstalled_globs(char **, int *);
 char		**matchbyorigin(const char *, int *);
 char		***matchallbyorigin(const char **, int *);
+char		**installed_names(void);
+void		installed_flush(void);
+int		origin_match(const char *, const char *);
 int		isinstalledpkg(const char *name);
 struct pkg	*getpkg(const char *name);
 int		pattern_match(legacy_match_t MatchType, char *pattern, const char *pkgname);
 
+/* Query service */
+int		service_query(const char *, const char *, char ***);
+
 /* Dependencies */
 int		sortdeps(char **);
 int		chkifdepends(const char *, const char *);
 int		requiredby(const char *, struct reqr_by_head **, Boolean, Boolean);
+void		reqby_add(const char *, const char *);
+void		reqby_remove(const char *, const char *);
+int		reqby_apply(const char *, struct reqr_by_head *, int);
+int		reqby_commit(void);
+void		reqby_abort(void);
 
 /* Version */
 int		verscmp(Package *, int, int);
@@ -242,5 +373,6 @@ extern Boolean  Force;
 extern int	AutoAnswer;
 extern int	Verbose;
 extern struct pkgdb *db;
+extern const char *PenRoot;
 
 #endif /* _INST_LIB_LIB_H_ */
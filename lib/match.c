@@ -44,6 +44,9 @@ struct store *storecreate(struct store *);
 static int storeappend(struct store *, const char *);
 static int fname_cmp(const FTSENT * const *, const FTSENT * const *);
 
+/* The names of all the installed packages, once they have been read */
+static struct store *Installed = NULL;
+
 /*
  * Function to query names of installed packages.
  * MatchType	- one of LEGACY_MATCH_ALL, LEGACY_MATCH_EREGEX, LEGACY_MATCH_REGEX, LEGACY_MATCH_GLOB, LEGACY_MATCH_NGLOB;
@@ -129,6 +132,102 @@ matchinstalled(legacy_match_t MatchType, char **patterns, int *retval)
 	return store->store;
 }
 
+/*
+ * Match a whole list of glob patterns, such as a package's @conflicts,
+ * against the installed packages in a single pass over their names.
+ * The literal prefix of each pattern is found first, so that most of
+ * them are ruled out for a package with one comparison, and the names
+ * are only read from the database once.  Version conditions are
+ * allowed, as with pattern_match().  Returns a NULL-terminated list of
+ * the installed packages that match any of the patterns, or NULL if
+ * none do.
+ */
+char **
+matchinstalled_globs(char **patterns, int *retval)
+{
+    static struct store *store = NULL;
+    char **installed;
+    size_t *prefix;
+    int i, j, n;
+
+    if (retval != NULL)
+	*retval = 0;
+    store = storecreate(store);
+    if (store == NULL) {
+	if (retval != NULL)
+	    *retval = 1;
+	return NULL;
+    }
+    if (patterns == NULL || (installed = installed_names()) == NULL)
+	return NULL;
+
+    for (n = 0; patterns[n] != NULL; n++)
+	;
+    if ((prefix = calloc(n + 1, sizeof(*prefix))) == NULL) {
+	warnx("%s(): calloc() failed", __func__);
+	if (retval != NULL)
+	    *retval = 1;
+	return NULL;
+    }
+    for (j = 0; j < n; j++)
+	prefix[j] = strcspn(patterns[j], "*?[{\\<>=!");
+
+    for (i = 0; installed[i] != NULL; i++)
+	for (j = 0; j < n; j++)
+	    if (!strncmp(installed[i], patterns[j], prefix[j]) &&
+		pattern_match(LEGACY_MATCH_GLOB, patterns[j], installed[i]) == 1) {
+		storeappend(store, installed[i]);
+		break;
+	    }
+    free(prefix);
+
+    return store->used == 0 ? NULL : store->store;
+}
+
+/*
+ * Read the names of all the installed packages, the first time they are
+ * wanted.  Nothing here changes the package database, so they are kept
+ * for the rest of the run, or until installed_flush() is called.
+ */
+char **
+installed_names(void)
+{
+    char pkgname[MAXPATHLEN];
+    struct pkgdb_it *it;
+    struct pkg *pkg;
+
+    if (Installed != NULL)
+	return Installed->store;
+    if (!pkg_initialized() || (it = pkgdb_query(db, NULL, MATCH_ALL)) == NULL)
+	return NULL;
+    if ((Installed = storecreate(NULL)) == NULL) {
+	pkgdb_it_free(it);
+	return NULL;
+    }
+
+    pkg = NULL;
+    while (pkgdb_it_next(it, &pkg, PKG_LOAD_BASIC) == EPKG_OK) {
+	pkg_snprintf(pkgname, sizeof(pkgname), "%n-%v", pkg, pkg);
+	storeappend(Installed, pkgname);
+    }
+    pkgdb_it_free(it);
+    pkg_free(pkg);
+
+    return Installed->store;
+}
+
+/* Forget the installed package names, so that they are read afresh */
+void
+installed_flush(void)
+{
+    if (Installed == NULL)
+	return;
+    storecreate(Installed);
+    free(Installed->store);
+    free(Installed);
+    Installed = NULL;
+}
+
 int
 pattern_match(legacy_match_t MatchType, char *pattern, const char *pkgname)
 {
@@ -219,6 +318,13 @@ pattern_match(legacy_match_t MatchType, char *pattern, const char *pkgname)
     return errcode;
 }
 
+/* Returns 1 if origin matches the csh-style glob pattern, 0 otherwise */
+int
+origin_match(const char *pattern, const char *origin)
+{
+    return csh_match(pattern, origin, FNM_PATHNAME) == 0 ? 1 : 0;
+}
+
 /*
  * Synopsis is similar to matchinstalled(), but use origin
  * as a key for matching packages.
@@ -291,7 +397,7 @@ matchallbyorigin(const char **origins, int *retval)
 
 	for (j = 0; installed[j] != NULL; j++) {
 	    if (allorigins[j]) {
-		if (csh_match(origins[i], allorigins[j], FNM_PATHNAME) == 0) {
+		if (origin_match(origins[i], allorigins[j])) {
 		    storeappend(store, installed[j]);
 		}
 	    }
@@ -23,6 +23,7 @@ __FBSDID("$FreeBSD: stable/10/usr.sbin/pkg_install/lib/pen.c 228990 2011-12-30 1
 
 #include "lib.h"
 #include <err.h>
+#include <fts.h>
 #include <libutil.h>
 #include <libgen.h>
 #include <sys/signal.h>
@@ -32,6 +33,9 @@ __FBSDID("$FreeBSD: stable/10/usr.sbin/pkg_install/lib/pen.c 228990 2011-12-30 1
 /* For keeping track of where we are */
 static char PenLocation[FILENAME_MAX];
 
+/* If set, playpens made in here are left for the caller to remove */
+const char *PenRoot;
+
 char *
 where_playpen(void)
 {
@@ -59,10 +63,10 @@ find_play_pen(char *pen, off_t sz)
     else if ((stat("/usr/tmp", &sb) == SUCCESS || mkdir("/usr/tmp", 01777) == SUCCESS) && min_free("/usr/tmp") >= sz)
 	strcpy(pen, "/usr/tmp/instmp.XXXXXX");
     else {
-	cleanup(0);
+	/* Leave it to the caller whether this is fatal */
 	humanize_number(humbuf, sizeof humbuf, sz, "", HN_AUTOSCALE,
 	    HN_NOSPACE);
-	errx(2,
+	warnx(
 "%s: can't find enough temporary space to extract the files, please set your\n"
 "PKG_TMPDIR environment variable to a location with at least %s bytes\n"
 "free", __func__, humbuf);
@@ -71,16 +75,20 @@ find_play_pen(char *pen, off_t sz)
     return pen;
 }
 
-#define MAX_STACK	20
-static char *pstack[MAX_STACK];
-static int pdepth = -1;
+/* As deep as dependencies go, now that they are installed in-process */
+static char **pstack;
+static int pdepth = -1, pmax;
 
 static const char *
 pushPen(const char *pen)
 {
-    if (++pdepth == MAX_STACK)
-	errx(2, "%s: stack overflow.\n", __func__);
-    pstack[pdepth] = strdup(pen);
+    if (++pdepth == pmax) {
+	pmax = pmax ? pmax * 2 : 20;
+	if ((pstack = reallocf(pstack, pmax * sizeof(*pstack))) == NULL)
+	    err(2, NULL);
+    }
+    if ((pstack[pdepth] = strdup(pen)) == NULL)
+	err(2, NULL);
 
     return pstack[pdepth];
 }
@@ -110,8 +118,8 @@ make_playpen(char *pen, off_t sz)
 	return NULL;
 
     if (!mkdtemp(pen)) {
-	cleanup(0);
-	errx(2, "%s: can't mktemp '%s'", __func__, pen);
+	warn("%s: can't mktemp '%s'", __func__, pen);
+	return NULL;
     }
 
     if (Verbose) {
@@ -126,10 +134,10 @@ make_playpen(char *pen, off_t sz)
 
     if (min_free(pen) < sz) {
 	rmdir(pen);
-	cleanup(0);
-	errx(2, "%s: not enough free space to create '%s'.\n"
+	warnx("%s: not enough free space to create '%s'.\n"
 	     "Please set your PKG_TMPDIR environment variable to a location\n"
 	     "with more space and\ntry the command again", __func__, pen);
+	return NULL;
     }
 
     if (!getcwd(cwd, FILENAME_MAX)) {
@@ -138,14 +146,87 @@ make_playpen(char *pen, off_t sz)
     }
 
     if (chdir(pen) == FAIL) {
-	cleanup(0);
-	errx(2, "%s: can't chdir to '%s'", __func__, pen);
+	warn("%s: can't chdir to '%s'", __func__, pen);
+	rmdir(pen);
+	return NULL;
     }
 
     strcpy(PenLocation, pen);
     return pushPen(cwd);
 }
 
+/*
+ * Move into a playpen that another process made with make_playpen(),
+ * so that leave_playpen() gets out of it and removes it as usual.
+ * Returns the pathname of the previous working directory.
+ */
+const char *
+enter_playpen(const char *pen)
+{
+    char cwd[FILENAME_MAX];
+
+    if (!getcwd(cwd, FILENAME_MAX)) {
+	upchuck("getcwd");
+	return NULL;
+    }
+
+    if (chdir(pen) == FAIL) {
+	warn("%s: can't chdir to '%s'", __func__, pen);
+	return NULL;
+    }
+
+    strlcpy(PenLocation, pen, sizeof(PenLocation));
+    return pushPen(cwd);
+}
+
+/*
+ * Remove a playpen and everything left in it, without the cost of
+ * running rm(1) for every package.  Returns 0 on success.
+ */
+static int
+remove_pen(const char *pen)
+{
+    char * const paths[] = { (char *)(uintptr_t)pen, NULL };
+    FTS *fts;
+    FTSENT *e;
+    int rv = 0;
+
+    if ((fts = fts_open(paths, FTS_PHYSICAL | FTS_NOSTAT, NULL)) == NULL)
+	return -1;
+    while ((e = fts_read(fts)) != NULL) {
+	switch (e->fts_info) {
+	case FTS_D:
+	    break;
+	case FTS_DP:
+	    if (rmdir(e->fts_accpath) == FAIL)
+		rv = -1;
+	    break;
+	case FTS_DNR:
+	case FTS_ERR:
+	case FTS_NS:
+	    rv = -1;
+	    break;
+	default:
+	    if (unlink(e->fts_accpath) == FAIL)
+		rv = -1;
+	    break;
+	}
+    }
+    fts_close(fts);
+    return rv;
+}
+
+static Boolean
+under_pen_root(const char *pen)
+{
+    size_t len;
+
+    if (PenRoot == NULL)
+	return FALSE;
+    len = strlen(PenRoot);
+    return !strncmp(pen, PenRoot, len) && pen[len] == '/';
+}
+
 /* Convenience routine for getting out of playpen */
 int
 leave_playpen()
@@ -166,7 +247,12 @@ leave_playpen()
 	errx(2, "%s: can't chdir back to '%s'", __func__, PenLocation);
     }
 
-    if (left[0] == '/' && vsystem("/bin/rm -rf %s", left))
+    /*
+     * Those under PenRoot go when it does.  Fall back on rm(1) for
+     * anything awkward.
+     */
+    if (left[0] == '/' && !under_pen_root(left) && remove_pen(left) &&
+	spawn_cmd(NULL, "/bin/rm", "-rf", left, NULL))
 	warnx("couldn't remove temporary dir '%s'", left);
     signal(SIGINT, oldsig);
 
@@ -23,7 +23,6 @@ __FBSDID("$FreeBSD: stable/10/usr.sbin/pkg_install/lib/plist.c 240682 2012-09-18
 
 #include "lib.h"
 #include <err.h>
-#include <md5.h>
 
 /* Add an item to a packing list */
 void
@@ -107,6 +106,23 @@ find_plist(Package *pkg, plist_t type)
     return NULL;
 }
 
+/*
+ * Return the total size of the package's files, as recorded by
+ * pkg_create, or -1 if the packing list doesn't say.
+ */
+off_t
+plist_size(Package *pkg)
+{
+    PackingList p;
+    long long size;
+
+    for (p = pkg->head; p != NULL; p = p->next)
+	if (p->type == PLIST_COMMENT && p->name != NULL &&
+	    sscanf(p->name, PKG_SIZE_TAG "%lld", &size) == 1 && size >= 0)
+	    return size;
+    return -1;
+}
+
 /* Look for a specific boolean option argument in the list */
 char *
 find_plist_option(Package *pkg, const char *name)
@@ -426,8 +442,15 @@ delete_package(Boolean ign_err, Boolean nukedirs, Package *pkg)
     Boolean preserve;
     char tmp[FILENAME_MAX], *name = NULL;
     char *prefix = NULL;
+    struct cksum_ent *ents;
+    int i = 0, n;
 
     preserve = find_plist_option(pkg, "preserve") ? TRUE : FALSE;
+
+    /* Verify all the files up front, reading them in disk order */
+    n = cksum_gather(pkg, &ents);
+    cksum_verify_all(pkg, ents, n);
+
     for (p = pkg->head; p; p = p->next) {
 	switch (p->type)  {
 	case PLIST_NAME:
@@ -450,7 +473,7 @@ delete_package(Boolean ign_err, Boolean nukedirs, Package *pkg)
 	    format_cmd(tmp, FILENAME_MAX, p->name, Where, last_file);
 	    if (Verbose)
 		printf("Execute '%s'\n", tmp);
-	    if (!Fake && system(tmp)) {
+	    if (!Fake && shell_cmd(tmp)) {
 		warnx("unexec command for '%s' failed", tmp);
 		fail = FAIL;
 	    }
@@ -467,38 +490,24 @@ delete_package(Boolean ign_err, Boolean nukedirs, Package *pkg)
 	   "this packing list is incorrect - ignoring delete request", tmp);
 	    }
 	    else {
-		if (p->next && p->next->type == PLIST_COMMENT && !strncmp(p->next->name, "MD5:", 4)) {
-		    char *cp = NULL, buf[33];
-
-		    /*
-		     * For packing lists whose version is 1.1 or greater, the md5
-		     * hash for a symlink is calculated on the string returned
-		     * by readlink().
-		     */
-		    if (issymlink(tmp) && verscmp(pkg, 1, 0) > 0) {
-			int len;
-			char linkbuf[FILENAME_MAX];
-
-			if ((len = readlink(tmp, linkbuf, FILENAME_MAX)) > 0)
-			     cp = MD5Data((unsigned char *)linkbuf, len, buf);
-		    } else if (isfile(tmp) || verscmp(pkg, 1, 1) < 0)
-			cp = MD5File(tmp, buf);
-
-		    if (cp != NULL) {
-			/* Mismatch? */
-			if (strcmp(cp, p->next->name + 4)) {
-			    warnx("'%s' fails original MD5 checksum - %s",
-				  tmp, Force ? "deleted anyway." : "not deleted.");
-			    if (!Force) {
-				fail = FAIL;
-				continue;
-			    }
-			}
+		struct cksum_ent *e;
+
+		/* Mismatch? */
+		while (i < n && ents[i].p != p)
+		    i++;
+		e = i < n ? &ents[i] : NULL;
+		if (e != NULL && e->result == 1) {
+		    warnx("'%s' fails original %s checksum - %s",
+			  tmp, cksum_name(e->type), Force ? "deleted anyway." : "not deleted.");
+		    if (!Force) {
+			fail = FAIL;
+			continue;
 		    }
 		}
 		if (Verbose)
 		    printf("Delete file %s\n", tmp);
 		if (!Fake) {
+		    cksum_cache_forget(tmp);
 		    if (delete_hierarchy(tmp, ign_err, nukedirs))
 			fail = FAIL;
 		    if (preserve && name) {
@@ -506,6 +515,8 @@ delete_package(Boolean ign_err, Boolean nukedirs, Package *pkg)
 			    
 			if (make_preserve_name(tmp2, FILENAME_MAX, name, tmp)) {
 			    if (fexists(tmp2)) {
+				stat_cache_invalidate(tmp2);
+				stat_cache_invalidate(tmp);
 				if (rename(tmp2, tmp))
 				   warn("preserve: unable to restore %s as %s",
 					tmp2, tmp);
@@ -537,12 +548,14 @@ delete_package(Boolean ign_err, Boolean nukedirs, Package *pkg)
 	    break;
 	}
     }
+    shell_close();
+    cksum_free(ents, n);
     return fail;
 }
 
 #ifdef DEBUG
-#define RMDIR(dir) vsystem("%s %s", RMDIR_CMD, dir)
-#define REMOVE(dir,ie) vsystem("%s %s%s", REMOVE_CMD, (ie ? "-f " : ""), dir)
+#define RMDIR(dir) spawn_cmd(NULL, RMDIR_CMD, dir, NULL)
+#define REMOVE(dir,ie) spawn_cmd(NULL, REMOVE_CMD, (ie ? "-f" : "--"), dir, NULL)
 #else
 #define RMDIR rmdir
 #define	REMOVE(file,ie) (remove(file) && !(ie))
@@ -561,8 +574,9 @@ delete_hierarchy(const char *dir, Boolean ign_err, Boolean nukedirs)
 		isdir(dir) ? "directory" : "file", dir);
 	return !ign_err;
     }
-    else if (nukedirs) {
-	if (vsystem("%s -r%s %s", REMOVE_CMD, (ign_err ? "f" : ""), dir))
+    stat_cache_invalidate(dir);
+    if (nukedirs) {
+	if (spawn_cmd(NULL, REMOVE_CMD, (ign_err ? "-rf" : "-r"), dir, NULL))
 	    return 1;
     }
     else if (isdir(dir) && !issymlink(dir)) {
@@ -581,6 +595,7 @@ delete_hierarchy(const char *dir, Boolean ign_err, Boolean nukedirs)
 	    *cp2 = '\0';
 	if (!isemptydir(dir))
 	    return 0;
+	stat_cache_invalidate(dir);
 	if (RMDIR(dir) && !ign_err) {
 	    if (!fexists(dir))
 		warnx("directory '%s' doesn't exist", dir);
@@ -0,0 +1,207 @@
+/*
+ * FreeBSD install - a package for the installation and maintenance
+ * of non-core utilities.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * Index of the package files available in a repository directory, so
+ * that looking for a package doesn't cost a round trip per suffix.
+ *
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "lib.h"
+#include <err.h>
+
+#define REPO_BUCKETS	1024
+
+/* A package, with a bit set for each suffix it is available with */
+struct repo_ent {
+    struct repo_ent *next;
+    int suffixes;
+    char name[1];
+};
+
+struct repo_dir {
+    struct repo_dir *next;
+    Boolean scanned;		/* the directory itself has been read */
+    struct repo_ent *ents[REPO_BUCKETS];
+    char path[1];
+};
+
+static struct repo_dir *Repos;
+
+/* In order of preference */
+static const char *repo_suffixes[] = {".tbz", ".tgz", ".tar", ".txz", NULL};
+
+static unsigned int
+repo_hash(const char *name, size_t len)
+{
+    unsigned int h = 5381;
+
+    while (len--)
+	h = h * 33 + (unsigned char)*name++;
+    return h % REPO_BUCKETS;
+}
+
+/* Add a file name to the index, if it looks like a package */
+static void
+repo_add(struct repo_dir *rd, const char *fname, size_t len)
+{
+    struct repo_ent *re;
+    unsigned int h;
+    size_t slen;
+    int i;
+
+    for (i = 0; repo_suffixes[i] != NULL; i++) {
+	slen = strlen(repo_suffixes[i]);
+	if (len > slen && !strncmp(fname + len - slen, repo_suffixes[i], slen))
+	    break;
+    }
+    if (repo_suffixes[i] == NULL)
+	return;
+    len -= slen;
+    h = repo_hash(fname, len);
+    for (re = rd->ents[h]; re != NULL; re = re->next)
+	if (!strncmp(re->name, fname, len) && re->name[len] == '\0') {
+	    re->suffixes |= 1 << i;
+	    return;
+	}
+    if ((re = malloc(sizeof(*re) + len)) == NULL)
+	err(2, NULL);
+    memcpy(re->name, fname, len);
+    re->name[len] = '\0';
+    re->suffixes = 1 << i;
+    re->next = rd->ents[h];
+    rd->ents[h] = re;
+}
+
+/* Add every package in the directory itself to the index */
+static void
+repo_scan(struct repo_dir *rd)
+{
+    struct dirent *dp;
+    DIR *dirp;
+
+    rd->scanned = TRUE;
+    if ((dirp = opendir(rd->path)) == NULL)
+	return;
+    while ((dp = readdir(dirp)) != NULL)
+	repo_add(rd, dp->d_name, strlen(dp->d_name));
+    closedir(dirp);
+}
+
+/*
+ * Index a repository directory on first use.  If the directory has a
+ * REPO_INDEX_FNAME manifest listing its files, that is read instead of
+ * the directory itself, unless the directory has changed since.
+ */
+static struct repo_dir *
+repo_open(const char *dir)
+{
+    struct repo_dir *rd;
+    struct stat dsb, msb;
+    FILE *fp;
+    char path[FILENAME_MAX], *line;
+    size_t len;
+
+    for (rd = Repos; rd != NULL; rd = rd->next)
+	if (!strcmp(rd->path, dir))
+	    return rd;
+
+    len = strlen(dir);
+    if ((rd = calloc(1, sizeof(*rd) + len)) == NULL)
+	err(2, NULL);
+    memcpy(rd->path, dir, len + 1);
+    rd->next = Repos;
+    Repos = rd;
+
+    snprintf(path, FILENAME_MAX, "%s/%s", dir, REPO_INDEX_FNAME);
+    if ((fp = fopen(path, "r")) == NULL) {
+	repo_scan(rd);
+	return rd;
+    }
+    if (fstat(fileno(fp), &msb) == FAIL || stat(dir, &dsb) == FAIL ||
+	msb.st_mtime < dsb.st_mtime) {
+	if (Verbose > 1)
+	    printf("Package index %s is out of date\n", path);
+	fclose(fp);
+	repo_scan(rd);
+	return rd;
+    }
+    if (Verbose > 1)
+	printf("Reading package index %s\n", path);
+    while ((line = fgetln(fp, &len)) != NULL) {
+	while (len > 0 && isspace((unsigned char)line[len - 1]))
+	    len--;
+	repo_add(rd, line, len);
+    }
+    fclose(fp);
+    return rd;
+}
+
+/* Look for fname in the index of dir, putting its path in buf */
+static Boolean
+repo_lookup(struct repo_dir *rd, const char *dir, const char *fname,
+    char *buf, size_t size)
+{
+    struct repo_ent *re;
+    int i;
+
+    for (re = rd->ents[repo_hash(fname, strlen(fname))]; re != NULL;
+	re = re->next)
+	if (!strcmp(re->name, fname))
+	    break;
+    if (re == NULL)
+	return FALSE;
+    for (i = 0; repo_suffixes[i] != NULL; i++) {
+	if (!(re->suffixes & (1 << i)))
+	    continue;
+	snprintf(buf, size, "%s/%s%s", dir, fname, repo_suffixes[i]);
+	/* In case the manifest is out of date */
+	if (isfile(buf))
+	    return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * Look for the package fname in the repository directory dir, trying
+ * each of the package suffixes in turn.  On success, the path of the
+ * package file is returned in buf.
+ */
+Boolean
+repo_find(const char *dir, const char *fname, char *buf, size_t size)
+{
+    struct repo_dir *rd;
+    char key[FILENAME_MAX], cwd[FILENAME_MAX];
+
+    if (*dir == '\0')
+	dir = ".";
+    /* We move around, so relative directories are indexed by full path */
+    if (*dir != '/') {
+	if (getcwd(cwd, FILENAME_MAX) == NULL)
+	    return FALSE;
+	snprintf(key, FILENAME_MAX, "%s/%s", cwd, dir);
+	rd = repo_open(key);
+    }
+    else
+	rd = repo_open(dir);
+
+    if (repo_lookup(rd, dir, fname, buf, size))
+	return TRUE;
+    /* The manifest may not list everything that is there */
+    if (rd->scanned)
+	return FALSE;
+    repo_scan(rd);
+    return repo_lookup(rd, dir, fname, buf, size);
+}
@@ -0,0 +1,298 @@
+/*
+ * FreeBSD install - a package for the installation and maintenance
+ * of non-core utilities.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * Journal of changes to the +REQUIRED_BY files of installed packages,
+ * so that each file is rewritten only once however many packages are
+ * added or deleted in a run.
+ *
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "lib.h"
+#include <err.h>
+
+#define REQBY_BUCKETS	256
+
+struct reqby_edit {
+    struct reqby_edit *next;
+    Boolean add;
+    char name[1];
+};
+
+/* The pending changes to one package's +REQUIRED_BY, in order */
+struct reqby_file {
+    struct reqby_file *next;
+    struct reqby_edit *head, **tail;
+    char pkg[1];
+};
+
+static struct reqby_file *Journal[REQBY_BUCKETS];
+
+static unsigned int
+reqby_hash(const char *pkg)
+{
+    unsigned int h = 5381;
+
+    while (*pkg)
+	h = h * 33 + (unsigned char)*pkg++;
+    return h % REQBY_BUCKETS;
+}
+
+static struct reqby_file *
+reqby_find(const char *pkg, Boolean create)
+{
+    struct reqby_file *rf;
+    unsigned int h = reqby_hash(pkg);
+    size_t len;
+
+    for (rf = Journal[h]; rf != NULL; rf = rf->next)
+	if (!strcmp(rf->pkg, pkg))
+	    return rf;
+    if (!create)
+	return NULL;
+    len = strlen(pkg);
+    if ((rf = calloc(1, sizeof(*rf) + len)) == NULL)
+	err(2, NULL);
+    memcpy(rf->pkg, pkg, len + 1);
+    rf->tail = &rf->head;
+    rf->next = Journal[h];
+    Journal[h] = rf;
+    return rf;
+}
+
+static void
+reqby_log(const char *pkg, const char *name, Boolean add)
+{
+    struct reqby_file *rf = reqby_find(pkg, TRUE);
+    struct reqby_edit *re;
+    size_t len = strlen(name);
+
+    if ((re = malloc(sizeof(*re) + len)) == NULL)
+	err(2, NULL);
+    memcpy(re->name, name, len + 1);
+    re->add = add;
+    re->next = NULL;
+    *rf->tail = re;
+    rf->tail = &re->next;
+}
+
+/* Note that the installed package pkg is now required by name */
+void
+reqby_add(const char *pkg, const char *name)
+{
+    reqby_log(pkg, name, TRUE);
+}
+
+/* Note that the installed package pkg is no longer required by name */
+void
+reqby_remove(const char *pkg, const char *name)
+{
+    reqby_log(pkg, name, FALSE);
+}
+
+/*
+ * Bring a list of the packages requiring pkg, as read by requiredby(),
+ * up to date with the journal.  Returns the new length of the list.
+ */
+int
+reqby_apply(const char *pkg, struct reqr_by_head *list, int count)
+{
+    struct reqby_file *rf;
+    struct reqby_edit *re;
+    struct reqr_by_entry *rb, *next;
+
+    if ((rf = reqby_find(pkg, FALSE)) == NULL)
+	return count;
+    for (re = rf->head; re != NULL; re = re->next) {
+	STAILQ_FOREACH(rb, list, link)
+	    if (!strcmp(rb->pkgname, re->name))
+		break;
+	if (re->add && rb == NULL) {
+	    if ((rb = malloc(sizeof(*rb))) == NULL)
+		err(2, NULL);
+	    strlcpy(rb->pkgname, re->name, sizeof(rb->pkgname));
+	    STAILQ_INSERT_TAIL(list, rb, link);
+	    count++;
+	}
+	else if (!re->add) {
+	    STAILQ_FOREACH_SAFE(rb, list, link, next)
+		if (!strcmp(rb->pkgname, re->name)) {
+		    STAILQ_REMOVE(list, rb, reqr_by_entry, link);
+		    free(rb);
+		    count--;
+		}
+	}
+    }
+    return count;
+}
+
+/* A +REQUIRED_BY file, rewritten and waiting to be renamed into place */
+struct reqby_out {
+    char fname[FILENAME_MAX];
+    char ftmp[FILENAME_MAX];
+};
+
+/*
+ * Write out and sync the new contents of one +REQUIRED_BY file to a
+ * temporary file beside it.  Returns 0 if there is nothing to rename,
+ * 1 if there is and -1 on error.
+ */
+static int
+reqby_rewrite(struct reqby_file *rf, struct reqby_out *out)
+{
+    struct reqr_by_head list = STAILQ_HEAD_INITIALIZER(list);
+    struct reqr_by_entry *rb;
+    struct reqby_edit *re;
+    char dir[FILENAME_MAX], *line;
+    size_t len;
+    int count = 0, rv = -1;
+    Boolean adds = FALSE;
+    FILE *fp;
+    int fd;
+
+    snprintf(dir, sizeof(dir), "%s/%s", LOG_DIR, rf->pkg);
+    snprintf(out->fname, sizeof(out->fname), "%s/%s", dir,
+	REQUIRED_BY_FNAME);
+    for (re = rf->head; re != NULL; re = re->next)
+	adds |= re->add;
+    if (!isdir(dir)) {
+	/* Nothing to do if it has been deleted since */
+	if (adds)
+	    warnx("can't open dependency file '%s'!\n"
+		"dependency registration is incomplete", out->fname);
+	return adds ? -1 : 0;
+    }
+
+    if ((fp = fopen(out->fname, "r")) != NULL) {
+	while ((line = fgetln(fp, &len)) != NULL) {
+	    if (len > 0 && line[len - 1] == '\n')
+		len--;
+	    if ((rb = malloc(sizeof(*rb))) == NULL)
+		err(2, NULL);
+	    if (len >= sizeof(rb->pkgname))
+		len = sizeof(rb->pkgname) - 1;
+	    memcpy(rb->pkgname, line, len);
+	    rb->pkgname[len] = '\0';
+	    STAILQ_INSERT_TAIL(&list, rb, link);
+	    count++;
+	}
+	fclose(fp);
+    }
+    /* Don't bother if there was nothing to remove */
+    if (reqby_apply(rf->pkg, &list, count) == count && !adds) {
+	rv = 0;
+	goto done;
+    }
+
+    snprintf(out->ftmp, sizeof(out->ftmp), "%s.XXXXXX", out->fname);
+    if ((fd = mkstemp(out->ftmp)) == -1) {
+	warnx("couldn't open temp file '%s'", out->ftmp);
+	goto done;
+    }
+    if ((fp = fdopen(fd, "w")) == NULL) {
+	close(fd);
+	warnx("couldn't fdopen temp file '%s'", out->ftmp);
+	goto fail;
+    }
+    STAILQ_FOREACH(rb, &list, link)
+	fprintf(fp, "%s\n", rb->pkgname);
+    if (fchmod(fd, 0644) == FAIL) {
+	warnx("error changing permission of temp file '%s'", out->ftmp);
+	fclose(fp);
+	goto fail;
+    }
+    if (fflush(fp) == EOF || fsync(fd) == FAIL) {
+	warn("error writing temp file '%s'", out->ftmp);
+	fclose(fp);
+	goto fail;
+    }
+    if (fclose(fp) == EOF) {
+	warnx("error closing temp file '%s'", out->ftmp);
+	goto fail;
+    }
+    rv = 1;
+    goto done;
+
+ fail:
+    unlink(out->ftmp);
+ done:
+    while ((rb = STAILQ_FIRST(&list)) != NULL) {
+	STAILQ_REMOVE_HEAD(&list, link);
+	free(rb);
+    }
+    return rv;
+}
+
+/*
+ * Apply everything in the journal.  Each +REQUIRED_BY file affected is
+ * rewritten and synced once, and only when all of them have been are
+ * they renamed into place.  Returns the number of files that couldn't
+ * be updated.
+ */
+int
+reqby_commit(void)
+{
+    struct reqby_file *rf;
+    struct reqby_out *outs = NULL;
+    int i, n = 0, max = 0, errors = 0;
+
+    for (i = 0; i < REQBY_BUCKETS; i++)
+	for (rf = Journal[i]; rf != NULL; rf = rf->next) {
+	    if (n == max) {
+		max = max ? max * 2 : 64;
+		if ((outs = reallocf(outs, max * sizeof(*outs))) == NULL)
+		    err(2, NULL);
+	    }
+	    switch (reqby_rewrite(rf, &outs[n])) {
+	    case 1:
+		n++;
+		break;
+	    case -1:
+		errors++;
+		break;
+	    }
+	}
+
+    for (i = 0; i < n; i++) {
+	stat_cache_invalidate(outs[i].fname);
+	if (rename(outs[i].ftmp, outs[i].fname) == FAIL) {
+	    warnx("error renaming '%s' to '%s'", outs[i].ftmp, outs[i].fname);
+	    unlink(outs[i].ftmp);
+	    errors++;
+	}
+    }
+    free(outs);
+    reqby_abort();
+    return errors;
+}
+
+/* Throw away everything in the journal */
+void
+reqby_abort(void)
+{
+    struct reqby_file *rf;
+    struct reqby_edit *re;
+    int i;
+
+    for (i = 0; i < REQBY_BUCKETS; i++)
+	while ((rf = Journal[i]) != NULL) {
+	    Journal[i] = rf->next;
+	    while ((re = rf->head) != NULL) {
+		rf->head = re->next;
+		free(re);
+	    }
+	    free(rf);
+	}
+}
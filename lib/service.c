@@ -0,0 +1,115 @@
+/*
+ * FreeBSD install - a package for the installation and maintenance
+ * of non-core utilities.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * Client side of the query service run by pkg_info -S, which keeps the
+ * installed package database in memory so that quick questions don't
+ * each have to open and read it.
+ *
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include "lib.h"
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <err.h>
+
+/* Seconds to wait for an answer before giving up on the service */
+#define SERVICE_TIMEOUT	30
+
+static char **Answer;
+
+static void
+service_free(void)
+{
+    int i;
+
+    if (Answer == NULL)
+	return;
+    for (i = 0; Answer[i] != NULL; i++)
+	free(Answer[i]);
+    free(Answer);
+    Answer = NULL;
+}
+
+/*
+ * Ask the query service, if one is listening on SERVICE_PATH, the
+ * question verb about arg.  Returns the service's exit status for the
+ * question, and the package names it gave, if any, as a NULL-terminated
+ * list in *result.  The list is only good until the next call.  Returns
+ * -1 if there is no service or it didn't answer, in which case the
+ * caller has to work the answer out for itself.
+ */
+int
+service_query(const char *verb, const char *arg, char ***result)
+{
+    struct sockaddr_un sun;
+    struct timeval tv;
+    const char *path = SERVICE_PATH;
+    char line[PATH_MAX + 2], *cp;
+    int s, status, count, i;
+    FILE *fp;
+
+    service_free();
+    if (result != NULL)
+	*result = NULL;
+    if (*path == '\0' || strlen(path) >= sizeof(sun.sun_path) ||
+	strchr(arg, '\n') != NULL)
+	return -1;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_LOCAL;
+    strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+    if ((s = socket(PF_LOCAL, SOCK_STREAM, 0)) == -1)
+	return -1;
+    if (connect(s, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+	close(s);
+	return -1;
+    }
+    tv.tv_sec = SERVICE_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if ((fp = fdopen(s, "r+")) == NULL) {
+	close(s);
+	return -1;
+    }
+
+    fprintf(fp, "%s %s\n", verb, arg);
+    if (fflush(fp) == EOF || fgets(line, sizeof(line), fp) == NULL ||
+	sscanf(line, "%d %d", &status, &count) != 2 || count < 0)
+	goto fail;
+    if ((Answer = calloc(count + 1, sizeof(*Answer))) == NULL)
+	err(2, NULL);
+    for (i = 0; i < count; i++) {
+	if (fgets(line, sizeof(line), fp) == NULL ||
+	    (cp = strchr(line, '\n')) == NULL)
+	    goto fail;
+	*cp = '\0';
+	if ((Answer[i] = strdup(line)) == NULL)
+	    err(2, NULL);
+    }
+    fclose(fp);
+
+    if (result != NULL && count > 0)
+	*result = Answer;
+    return status;
+
+ fail:
+    if (Verbose)
+	warnx("no answer from the query service on %s", path);
+    fclose(fp);
+    service_free();
+    return -1;
+}
@@ -23,36 +23,41 @@ __FBSDID("$FreeBSD: stable/10/usr.sbin/pkg_install/lib/url.c 236333 2012-05-30 2
 
 #include "lib.h"
 #include <err.h>
+#include <errno.h>
 #include <fetch.h>
 #include <libgen.h>
+#include <signal.h>
 #include <sys/wait.h>
 #include <stdio.h>
 
+#define FETCH_JOBS	4	/* Downloads at once, unless PKG_FETCH_JOBS says */
+
 /*
- * Try and fetch a file by URL, returning the directory name for where
- * it's unpacked, if successful.
+ * Where fileFetchAll() puts the packages it fetches ahead of time, if
+ * there's no download cache to put them in.
  */
-const char *
-fileGetURL(const char *base, const char *spec, int keep_package)
+static char FetchDir[FILENAME_MAX];
+static pid_t FetchPid;		/* the process that made FetchDir */
+
+static int url_fetch(const char *, const char *);
+static Boolean cache_path(const char *, char *);
+static Boolean cache_fresh(const char *, const char *);
+
+/*
+ * Work out the URL of a package.  If spec isn't a URL already, it is
+ * the name of a package in the same hierarchy as the package at base,
+ * or failing that, the one sysinstall left us a hint about.
+ */
+Boolean
+fileComposeURL(const char *base, const char *spec, char *fname)
 {
-    const char *rp;
-    char *cp, *tmp;
-    char fname[FILENAME_MAX];
-    char pen[FILENAME_MAX];
-    char pkg[FILENAME_MAX];
-    char buf[8192];
-    FILE *ftp;
-    pid_t tpid;
-    int pfd[2], pstat, r, w = 0;
-    char *hint;
-    int fd, pkgfd = 0;
+    char *cp, *hint;
 
-    rp = NULL;
     /* Special tip that sysinstall left for us */
     hint = getenv("PKG_ADD_BASE");
     if (!isURL(spec)) {
 	if (!base && !hint)
-	    return NULL;
+	    return FALSE;
 	/*
 	 * We've been given an existing URL (that's known-good) and now we need
 	 * to construct a composite one out of that and the basename we were
@@ -79,7 +84,7 @@ fileGetURL(const char *base, const char *spec, int keep_package)
 		   strcat(cp, ".tbz");
 	    }
 	    else
-		return NULL;
+		return FALSE;
 	}
 	else {
 	    /*
@@ -96,6 +101,29 @@ fileGetURL(const char *base, const char *spec, int keep_package)
     }
     else
 	strcpy(fname, spec);
+    return TRUE;
+}
+
+/*
+ * Try and fetch a file by URL, returning the directory name for where
+ * it's unpacked, if successful.
+ */
+const char *
+fileGetURL(const char *base, const char *spec, int keep_package)
+{
+    const char *rp;
+    char *tmp;
+    char fname[FILENAME_MAX];
+    char pen[FILENAME_MAX];
+    char pkg[FILENAME_MAX];
+    char local[FILENAME_MAX];
+    char cached[FILENAME_MAX];
+    FILE *ftp = NULL;
+    int pkgfd = 0;
+
+    rp = NULL;
+    if (!fileComposeURL(base, spec, fname))
+	return NULL;
 
     if (keep_package) {
 	tmp = getenv("PKGDIR");
@@ -111,12 +139,40 @@ fileGetURL(const char *base, const char *spec, int keep_package)
     }
 
     fetchDebug = (Verbose > 0);
-    if ((ftp = fetchGetURL(fname, Verbose ? "v" : NULL)) == NULL) {
+    /*
+     * Go through the download cache if there is one; otherwise see if
+     * fileFetchAll() got it for us already.
+     */
+    local[0] = '\0';
+    if (cache_path(fname, cached)) {
+	if (isfile(cached) && !cache_fresh(fname, cached)) {
+	    if (Verbose)
+		printf("Cached copy %s is out of date\n", cached);
+	    stat_cache_invalidate(cached);
+	    unlink(cached);
+	}
+	if (isfile(cached)) {
+	    if (Verbose)
+		printf("Using cached copy %s\n", cached);
+	}
+	else if (url_fetch(fname, cached) == FAIL && Verbose)
+	    warnx("unable to cache %s", fname);
+	if (isfile(cached))
+	    ftp = fopen(cached, "r");
+    }
+    else if (FetchDir[0] != '\0') {
+	snprintf(local, FILENAME_MAX, "%s/%s", FetchDir, basename(fname));
+	if (isfile(local))
+	    ftp = fopen(local, "r");
+    }
+    if (ftp == NULL && (ftp = fetchGetURL(fname, Verbose ? "v" : NULL)) == NULL) {
 	printf("Error: Unable to get %s: %s\n",
 	       fname, fetchLastErrString);
 	/* If the fetch fails, yank the package. */
-	if (keep_package && unlink(pkg) < 0 && Verbose) {
-	    warnx("failed to remove partially fetched package: %s", pkg);
+	if (keep_package) {
+	    stat_cache_invalidate(pkg);
+	    if (unlink(pkg) < 0 && Verbose)
+		warnx("failed to remove partially fetched package: %s", pkg);
 	}
 	return NULL;
     }
@@ -129,49 +185,351 @@ fileGetURL(const char *base, const char *spec, int keep_package)
 	fclose(ftp);
 	return NULL;
     }
-    if (pipe(pfd) == -1) {
-	warn("pipe()");
-	cleanup(0);
-	exit(2);
-    }
-    if ((tpid = fork()) == -1) {
-	warn("pipe()");
-	cleanup(0);
-	exit(2);
-    }
-    if (!tpid) {
-	dup2(pfd[0], 0);
-	for (fd = getdtablesize() - 1; fd >= 3; --fd)
-	    close(fd);
-	execl("/usr/bin/tar", "tar",
-	    Verbose ? "-xpjvf" : "-xpjf",
-	    "-", (char *)0);
-	_exit(2);
-    }
-    close(pfd[0]);
-    for (;;) {
-	if ((r = fread(buf, 1, sizeof buf, ftp)) < 1)
-	    break;
-	if ((w = write(pfd[1], buf, r)) != r)
-	    break;
-	if (keep_package) {
-	    if ((w = write(pkgfd, buf, r)) != r)
-		break;
-	}    
-    }
-    if (ferror(ftp))
-	warn("warning: error reading from server");
+    /* Callers find out whether this worked by looking for +CONTENTS */
+    (void)unpack_fp(fname, ftp, keep_package ? pkgfd : -1);
     fclose(ftp);
+    /* A prefetched copy is only needed the once */
+    if (local[0] != '\0') {
+	stat_cache_invalidate(local);
+	unlink(local);
+    }
     if (keep_package) {
 	close(pkgfd);
     } 
-    close(pfd[1]);
-    if (w == -1)
-	warn("warning: error writing to tar");
-    tpid = waitpid(tpid, &pstat, 0);
-    if (Verbose)
-	printf("tar command returns %d status\n", WEXITSTATUS(pstat));
     if (rp && (isatty(0) || Verbose))
 	printf(" Done.\n");
     return rp;
 }
+
+
+static void
+fetch_cleanup(void)
+{
+    /* Leave it alone in any child that exits the long way round */
+    if (FetchDir[0] != '\0' && getpid() == FetchPid)
+	spawn_cmd(NULL, REMOVE_CMD, "-rf", FetchDir, NULL);
+}
+
+/*
+ * Find out about the package at a URL without downloading it.  If the
+ * download cache has a complete copy, its path is put in local, which
+ * is otherwise left empty.  Returns the size of the package, or -1 if
+ * it can't be found out.
+ */
+off_t
+fileStatURL(const char *url, char *local)
+{
+    struct url_stat us;
+    struct stat sb;
+
+    local[0] = '\0';
+    if (cache_path(url, local)) {
+	if (stat(local, &sb) == 0)
+	    return sb.st_size;
+	local[0] = '\0';
+    }
+    if (fetchStatURL(url, &us, "") == -1 || us.size < 0)
+	return -1;
+    return us.size;
+}
+
+/*
+ * Read the metadata at the head of the package at a URL, downloading no
+ * more of it than that.  Returns 0 on success, as pkg_meta_load().
+ */
+int
+fileMetaURL(const char *url, struct pkg_meta *meta)
+{
+    FILE *ftp;
+    int rv;
+
+    memset(meta, 0, sizeof(*meta));
+    if ((ftp = fetchGetURL(url, Verbose ? "v" : NULL)) == NULL) {
+	if (Verbose)
+	    warnx("unable to get %s: %s", url, fetchLastErrString);
+	return 1;
+    }
+    rv = pkg_meta_load_fp(url, ftp, meta);
+    fclose(ftp);
+    return rv;
+}
+
+/* The download cache named by PKG_CACHEDIR, if any */
+static const char *
+cache_dir(void)
+{
+    const char *dir;
+
+    if ((dir = getenv("PKG_CACHEDIR")) == NULL || *dir == '\0')
+	return NULL;
+    if (!isdir(dir)) {
+	stat_cache_invalidate(dir);
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+	    warn("%s", dir);
+	    return NULL;
+	}
+    }
+    return dir;
+}
+
+/*
+ * Where the download cache keeps the package at url: a file named after
+ * a digest of the URL, so that the same package name from two different
+ * places doesn't collide, and the package's own name, for the reader.
+ */
+static Boolean
+cache_path(const char *url, char *path)
+{
+    char sum[CKSUM_BUFSIZE];
+    const char *dir, *cp;
+
+    if ((dir = cache_dir()) == NULL ||
+	cksum_data(CKSUM_SHA256, url, strlen(url), sum) == NULL)
+	return FALSE;
+    cp = strrchr(url, '/');
+    snprintf(path, FILENAME_MAX, "%s/%.16s-%s", dir, sum, cp ? cp + 1 : url);
+    return TRUE;
+}
+
+/* Read the size and modification time recorded in a .stamp file */
+static void
+cache_stamp(const char *stamp, long long *size, long long *mtime)
+{
+    FILE *fp;
+
+    *size = *mtime = -1;
+    if ((fp = fopen(stamp, "r")) != NULL) {
+	if (fscanf(fp, "%lld %lld", size, mtime) != 2)
+	    *size = *mtime = -1;
+	fclose(fp);
+    }
+}
+
+/*
+ * Is the complete copy of url at path still what the server has?  It
+ * is if path.stamp matches what the server says about it now, or if
+ * the server can't be asked, so that the cache still works offline.
+ */
+static Boolean
+cache_fresh(const char *url, const char *path)
+{
+    struct url_stat us;
+    struct stat sb;
+    char stamp[FILENAME_MAX];
+    long long osize, omtime;
+
+    if (fetchStatURL(url, &us, "") == -1)
+	return TRUE;
+    snprintf(stamp, FILENAME_MAX, "%s.stamp", path);
+    cache_stamp(stamp, &osize, &omtime);
+    if (omtime > 0)
+	return us.size == osize && us.mtime == omtime;
+    /* Nothing to go on but the size */
+    return stat(path, &sb) == 0 && (us.size < 0 || us.size == sb.st_size);
+}
+
+/*
+ * Download url to path, by way of path.part.  If an earlier download
+ * was interrupted, carry on from where it stopped, unless the file has
+ * changed on the server since: path.stamp records the size and
+ * modification time the server gave for it, and is kept alongside path
+ * so that cache_fresh() can tell when it goes out of date.  path.part is
+ * locked while it is written, so that two processes wanting the same
+ * package take turns rather than writing over each other.  Returns
+ * SUCCESS once path is complete.
+ */
+static int
+url_fetch(const char *url, const char *path)
+{
+    struct url *u;
+    struct url_stat us;
+    struct stat sb, now;
+    char part[FILENAME_MAX], stamp[FILENAME_MAX], buf[8192];
+    long long osize, omtime;
+    FILE *ftp, *fp;
+    off_t size;
+    ssize_t r;
+    int fd, error, rv = FAIL;
+
+    snprintf(part, FILENAME_MAX, "%s.part", path);
+    snprintf(stamp, FILENAME_MAX, "%s.stamp", path);
+    if ((u = fetchParseURL(url)) == NULL) {
+	warnx("%s: %s", url, fetchLastErrString);
+	return FAIL;
+    }
+    stat_cache_invalidate(part);
+    for (;;) {
+	if ((fd = open(part, O_WRONLY | O_CREAT, 0644)) == -1 ||
+	    flock(fd, LOCK_EX) == -1 || fstat(fd, &sb) == -1) {
+	    warn("%s", part);
+	    goto bail;
+	}
+	if (stat(part, &now) == 0 && now.st_dev == sb.st_dev &&
+	    now.st_ino == sb.st_ino)
+	    break;
+	/* Whoever had it before us finished it and renamed it */
+	close(fd);
+	fd = -1;
+	stat_cache_invalidate(path);
+	if (isfile(path)) {
+	    rv = SUCCESS;
+	    goto bail;
+	}
+    }
+    cache_stamp(stamp, &osize, &omtime);
+    /* Only resume if we can tell it's still the same file */
+    u->offset = omtime > 0 ? sb.st_size : 0;
+    if ((ftp = fetchXGet(u, &us, Verbose ? "v" : NULL)) == NULL) {
+	if (Verbose)
+	    warnx("unable to get %s: %s", url, fetchLastErrString);
+	goto bail;
+    }
+    if (u->offset > 0 && (us.size != osize || us.mtime != omtime)) {
+	/* It's changed on the server since; start again */
+	fclose(ftp);
+	u->offset = 0;
+	if ((ftp = fetchXGet(u, &us, Verbose ? "v" : NULL)) == NULL) {
+	    if (Verbose)
+		warnx("unable to get %s: %s", url, fetchLastErrString);
+	    goto bail;
+	}
+    }
+    if ((fp = fopen(stamp, "w")) != NULL) {
+	fprintf(fp, "%lld %lld\n", (long long)us.size, (long long)us.mtime);
+	fclose(fp);
+    }
+
+    /* The server may not have started where we asked it to */
+    size = u->offset;
+    if (ftruncate(fd, size) == -1 || lseek(fd, size, SEEK_SET) == -1) {
+	warn("%s", part);
+	fclose(ftp);
+	goto bail;
+    }
+    if (size > 0 && Verbose)
+	printf("Resuming %s at %lld bytes\n", url, (long long)size);
+    while ((r = fread(buf, 1, sizeof(buf), ftp)) > 0) {
+	if (write(fd, buf, r) != r) {
+	    warn("%s", part);
+	    break;
+	}
+	size += r;
+    }
+    error = ferror(ftp) || r > 0;
+    fclose(ftp);
+    /* Anything short is kept, to carry on with next time */
+    if (!error && (us.size <= 0 || size == us.size)) {
+	stat_cache_invalidate(path);
+	if (rename(part, path) == 0)
+	    rv = SUCCESS;
+    }
+
+bail:
+    if (fd != -1)
+	close(fd);
+    fetchFreeURL(u);
+    return rv;
+}
+
+/*
+ * Download the packages named in specs (composed with base as for
+ * fileGetURL()) ahead of time, several at once, so that fileGetURL()
+ * can unpack them from local files instead.  They go into the download
+ * cache if there is one, and anything already there that is still
+ * current isn't fetched.  The
+ * rest are shared out between up to FETCH_JOBS processes, each fetching
+ * its share in turn so that libfetch can reuse its connection to the
+ * server.  Anything that isn't fetched here is simply fetched again by
+ * fileGetURL().
+ */
+void
+fileFetchAll(const char *base, const char **specs, int n)
+{
+    char url[FILENAME_MAX], **urls, **paths;
+    const char *tmpdir, *cp;
+    pid_t *pids;
+    int i, j, jobs, status, nfetch = 0;
+    Boolean cached;
+
+    if (n == 0)
+	return;
+    if (cache_dir() == NULL && FetchDir[0] == '\0') {
+	if ((tmpdir = getenv("PKG_TMPDIR")) == NULL &&
+	    (tmpdir = getenv("TMPDIR")) == NULL)
+	    tmpdir = "/var/tmp";
+	snprintf(FetchDir, FILENAME_MAX, "%s/pkgfetch.XXXXXX", tmpdir);
+	if (mkdtemp(FetchDir) == NULL) {
+	    warn("%s", FetchDir);
+	    FetchDir[0] = '\0';
+	    return;
+	}
+	FetchPid = getpid();
+	atexit(fetch_cleanup);
+    }
+
+    /* Work out what there is to fetch */
+    if ((urls = calloc(n, sizeof(*urls))) == NULL ||
+	(paths = calloc(n, sizeof(*paths))) == NULL)
+	err(2, NULL);
+    for (i = 0; i < n; i++) {
+	if (!fileComposeURL(base, specs[i], url))
+	    continue;
+	if ((paths[nfetch] = malloc(FILENAME_MAX)) == NULL)
+	    err(2, NULL);
+	if (!(cached = cache_path(url, paths[nfetch]))) {
+	    cp = strrchr(url, '/');
+	    snprintf(paths[nfetch], FILENAME_MAX, "%s/%s", FetchDir,
+		cp ? cp + 1 : url);
+	}
+	if (isfile(paths[nfetch])) {
+	    if (!cached || cache_fresh(url, paths[nfetch])) {
+		free(paths[nfetch]);
+		continue;
+	    }
+	    stat_cache_invalidate(paths[nfetch]);
+	    unlink(paths[nfetch]);
+	}
+	if ((urls[nfetch++] = strdup(url)) == NULL)
+	    err(2, NULL);
+    }
+
+    if ((cp = getenv("PKG_FETCH_JOBS")) == NULL ||
+	(jobs = strtonum(cp, 1, 64, NULL)) == 0)
+	jobs = FETCH_JOBS;
+    if (jobs > nfetch)
+	jobs = nfetch;
+    if (nfetch > 0 && (isatty(0) || Verbose))
+	printf("Prefetching %d packages, %d at a time...", nfetch, jobs),
+	    fflush(stdout);
+    fflush(NULL);
+    if ((pids = calloc(jobs + 1, sizeof(*pids))) == NULL)
+	err(2, NULL);
+    for (i = 0; i < jobs; i++) {
+	if ((pids[i] = fork()) == -1) {
+	    warn("fork()");
+	    break;
+	}
+	if (pids[i] == 0) {
+	    /* Leave cleaning up to our parent */
+	    signal(SIGINT, SIG_DFL);
+	    signal(SIGHUP, SIG_DFL);
+	    fetchDebug = (Verbose > 0);
+	    for (j = i; j < nfetch; j += jobs)
+		url_fetch(urls[j], paths[j]);
+	    _exit(0);
+	}
+    }
+    while (--i >= 0)
+	while (waitpid(pids[i], &status, 0) == -1 && errno == EINTR)
+	    ;
+    free(pids);
+    for (i = 0; i < nfetch; i++) {
+	free(urls[i]);
+	free(paths[i]);
+    }
+    free(urls);
+    free(paths);
+    stat_cache_flush();
+    if (nfetch > 0 && (isatty(0) || Verbose))
+	printf(" Done.\n");
+}
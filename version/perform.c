@@ -90,9 +90,12 @@ pkg_perform(char **indexarg)
 	patterns = NULL;
      }
 
-    if (LookUpOrigin != NULL)
-	pkgs = matchbyorigin(LookUpOrigin, &err_cnt);
-    else
+    /* Ask a running query service first */
+    if (LookUpOrigin != NULL) {
+	if ((err_cnt = service_query("origin", LookUpOrigin, &pkgs)) == -1)
+	    pkgs = matchbyorigin(LookUpOrigin, &err_cnt);
+    } else if (MatchType != LEGACY_MATCH_ALL ||
+	(err_cnt = service_query("list", "", &pkgs)) == -1)
 	pkgs = matchinstalled(MatchType, patterns, &err_cnt);
 
     if (err_cnt != 0)
@@ -174,8 +177,16 @@ pkg_do(char *pkg)
      */
     if (plist.origin != NULL && !UseINDEXOnly) {
 	snprintf(tmp, PATH_MAX, "%s/%s", PORTS_DIR, plist.origin);
-	if (isdir(tmp) && chdir(tmp) != FAIL && isfile("Makefile")) {
-	    if ((latest = vpipe("/usr/bin/make -V PKGNAME", tmp)) == NULL)
+	snprintf(tmp2, PATH_MAX, "%s/Makefile", tmp);
+	if (isfile(tmp2)) {
+	    struct spawn_opts so;
+
+	    memset(&so, 0, sizeof(so));
+	    so.cwd = tmp;
+	    so.out = tmp2;
+	    so.outlen = PATH_MAX;
+	    if (spawn_cmd(&so, "/usr/bin/make", "-V", "PKGNAME", NULL) ||
+		*tmp2 == '\0' || (latest = strdup(tmp2)) == NULL)
 		warnx("Failed to get PKGNAME from %s/Makefile!", tmp);
 	    else
 		show_version(plist, latest, "port");